@@ -21,6 +21,8 @@
 #define PSOARCHIVE__AFS_H
 
 #include "psoarchive-error.h"
+#include "psoarchive-build.h"
+#include "psoarchive-queue.h"
 
 #include <stdint.h>
 #include <sys/types.h>
@@ -32,6 +34,16 @@ typedef struct pso_afs_read pso_afs_read_t;
 struct pso_afs_write;
 typedef struct pso_afs_write pso_afs_write_t;
 
+/* Parameters for the flags parameter for pso_afs_read_open(). PSO_AFS_MMAP maps
+   the whole archive into memory, so that pso_afs_file_read() copies straight
+   out of the mapping and pso_afs_file_map() can be used. If the archive can't
+   be mapped (or mmap() isn't available), the archive is read normally instead.
+   PSO_AFS_SEQUENTIAL and PSO_AFS_RANDOM are hints about how the files in the
+   archive will be accessed, and are passed on to the OS. */
+#define PSO_AFS_MMAP            (1 << 0)
+#define PSO_AFS_SEQUENTIAL      (1 << 1)
+#define PSO_AFS_RANDOM          (1 << 2)
+
 /* Archive reading functionality... */
 pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
                                      pso_error_t *err);
@@ -39,9 +51,21 @@ pso_afs_read_t *pso_afs_read_open(const char *fn, uint32_t flags,
                                   pso_error_t *err);
 pso_error_t pso_afs_read_close(pso_afs_read_t *a);
 
+/* Reading files from an open archive is safe to do from several threads at
+   once, even on the same handle. pso_afs_read_clone() makes a new handle to the
+   same archive, sharing the table of contents with the original, so that each
+   thread can have its own handle to close when it is done with it. The archive
+   itself is closed when the last handle to it is closed. On systems without
+   pread(), the reads on all handles to an archive are made to take turns, and
+   pso_afs_read_submit() must not be used while other threads are reading from
+   the same archive. */
+pso_afs_read_t *pso_afs_read_clone(pso_afs_read_t *a, pso_error_t *err);
+
 uint32_t pso_afs_file_count(pso_afs_read_t *a);
 
-/* XXXX: No op. */
+/* If the archive has a filename table, files are looked up and named by the
+   names in the table. Otherwise, files are named by their position in the
+   archive (like "00012.bin"). */
 uint32_t pso_afs_file_lookup(pso_afs_read_t *a, const char *fn);
 pso_error_t pso_afs_file_name(pso_afs_read_t *a, uint32_t hnd, char *fn,
                               size_t len);
@@ -49,6 +73,51 @@ ssize_t pso_afs_file_size(pso_afs_read_t *a, uint32_t hnd);
 ssize_t pso_afs_file_read(pso_afs_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len);
 
+/* Get a pointer to the data of a file in an archive opened with PSO_AFS_MMAP,
+   without copying it anywhere. The pointer is valid until the archive is
+   closed. This can be passed directly to the PRS/PRSD decompression functions
+   for compressed files. Returns PSOARCHIVE_ENOTSUPP if the archive is not
+   mapped. */
+pso_error_t pso_afs_file_map(pso_afs_read_t *a, uint32_t hnd,
+                             const uint8_t **ptr, size_t *len);
+
+/* Queue up reads of several files at once on an I/O queue from
+   pso_io_queue_new(), and start them going. Each request reads up to len bytes
+   of file hnd into buf (len is cut down to the size of the file, if need be).
+   The requests must not be touched until they are handed back by
+   pso_io_queue_reap(), and the archive must stay open until then. If any of
+   the requests are bad, none of them are queued up. */
+pso_error_t pso_afs_read_submit(pso_io_queue_t *q, pso_afs_read_t *a,
+                                pso_read_req_t *reqs, size_t count);
+
+/* Extract every file in the archive into the directory dir (which is created if
+   it doesn't exist), using up to threads threads (or one per CPU, if threads is
+   0 or less). The files are read in the order that they are stored in the
+   archive. The flags parameter takes the PSO_EXTRACT_* flags, which can be used
+   to decompress the files on the way out. Files are named as they would be by
+   pso_afs_file_name(), except that any slashes are replaced, and if several
+   files have the same name, all but the first have a number (normally their
+   handle) added to the end of the name, so that no two files get the same
+   name. Files that are already in dir are never overwritten, and
+   PSOARCHIVE_EFILE is returned if there are any in the way. */
+pso_error_t pso_afs_extract_all(pso_afs_read_t *a, const char *dir,
+                               uint32_t flags, int threads);
+
+
+/* Parameters for the flags parameter for pso_afs_new(). PSO_AFS_NAME_TABLE
+   writes a filename table to the archive, holding the name passed in when each
+   file was added, along with its modification time and size. */
+#define PSO_AFS_NAME_TABLE      (1 << 3)
+
+/* PSO_AFS_BUILD collects up all the files added to the archive and writes the
+   whole thing out front to back when pso_afs_write_close() is called. The table
+   of contents is sized to fit the files, rather than always reserving space for
+   the maximum number of files, and the output never has to be seekable (so it
+   can be a pipe, for instance). Data added with pso_afs_write_add() or
+   pso_afs_write_add_fd() is copied and held in memory until then, whereas files
+   added with pso_afs_write_add_file() are not read until the archive is
+   written. */
+#define PSO_AFS_BUILD           (1 << 4)
 
 /* Archive creation/writing functionality... */
 pso_afs_write_t *pso_afs_new(const char *fn, uint32_t flags, pso_error_t *err);
@@ -56,6 +125,25 @@ pso_afs_write_t *pso_afs_new_fd(int fd, uint32_t flags, pso_error_t *err);
 
 pso_error_t pso_afs_write_close(pso_afs_write_t *a);
 
+/* Open an existing archive to change it in place. Files can be replaced with
+   pso_afs_write_replace(), and new files added to the end with the usual add
+   functions. Only the parts of the archive that change are written, so this is
+   much cheaper than building the archive again. New entries go in the unused
+   space after the table of contents; if there isn't any left, the first file
+   in the archive is moved to the end to make room. If the archive has a
+   filename table, it is kept up to date (PSO_AFS_NAME_TABLE is ignored here,
+   and PSO_AFS_BUILD is not allowed). */
+pso_afs_write_t *pso_afs_write_open(const char *fn, uint32_t flags,
+                                    pso_error_t *err);
+pso_afs_write_t *pso_afs_write_open_fd(int fd, uint32_t flags,
+                                       pso_error_t *err);
+
+/* Replace the data of file hnd in an archive opened with pso_afs_write_open().
+   If the new data fits in the space the old data took up, it is written over
+   the old data, otherwise it is put at the end of the archive. */
+pso_error_t pso_afs_write_replace(pso_afs_write_t *a, uint32_t hnd,
+                                  const uint8_t *data, uint32_t len);
+
 pso_error_t pso_afs_write_add(pso_afs_write_t *a, const char *fn,
                               const uint8_t *data, uint32_t len);
 pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
@@ -63,4 +151,15 @@ pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
 pso_error_t pso_afs_write_add_file(pso_afs_write_t *a, const char *afn,
                                    const char *fn);
 
+/* Add a whole batch of files to the archive, loading and compressing them (as
+   asked for in each item) on up to threads threads (or one per CPU, if threads
+   is 0 or less). The files are added in the order given, and the archive will
+   be exactly the same no matter how many threads are used (see
+   pso_build_item_t for where the times in the filename table come from). No
+   more than about max_bytes of file data will be held in memory at once (or
+   PSO_BUILD_MAX_BYTES, if max_bytes is 0). */
+pso_error_t pso_afs_write_add_batch(pso_afs_write_t *a,
+                                   const pso_build_item_t *items, size_t count,
+                                   int threads, size_t max_bytes);
+
 #endif /* !PSOARCHIVE__AFS_H */
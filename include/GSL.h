@@ -21,6 +21,8 @@
 #define PSOARCHIVE__GSL_H
 
 #include "psoarchive-error.h"
+#include "psoarchive-build.h"
+#include "psoarchive-queue.h"
 
 #include <stdint.h>
 #include <sys/types.h>
@@ -45,6 +47,16 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
                                      pso_error_t *err);
 pso_error_t pso_gsl_read_close(pso_gsl_read_t *a);
 
+/* Reading files from an open archive is safe to do from several threads at
+   once, even on the same handle. pso_gsl_read_clone() makes a new handle to the
+   same archive, sharing the table of contents with the original, so that each
+   thread can have its own handle to close when it is done with it. The archive
+   itself is closed when the last handle to it is closed. On systems without
+   pread(), the reads on all handles to an archive are made to take turns, and
+   pso_gsl_read_submit() must not be used while other threads are reading from
+   the same archive. */
+pso_gsl_read_t *pso_gsl_read_clone(pso_gsl_read_t *a, pso_error_t *err);
+
 uint32_t pso_gsl_file_count(pso_gsl_read_t *a);
 
 uint32_t pso_gsl_file_lookup(pso_gsl_read_t *a, const char *fn);
@@ -55,12 +67,52 @@ pso_error_t pso_gsl_file_name(pso_gsl_read_t *a, uint32_t hnd, char *fn,
 ssize_t pso_gsl_file_read(pso_gsl_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len);
 
+/* Queue up reads of several files at once on an I/O queue from
+   pso_io_queue_new(), and start them going. Each request reads up to len bytes
+   of file hnd into buf (len is cut down to the size of the file, if need be).
+   The requests must not be touched until they are handed back by
+   pso_io_queue_reap(), and the archive must stay open until then. If any of
+   the requests are bad, none of them are queued up. */
+pso_error_t pso_gsl_read_submit(pso_io_queue_t *q, pso_gsl_read_t *a,
+                                pso_read_req_t *reqs, size_t count);
+
+/* Extract every file in the archive into the directory dir (which is created if
+   it doesn't exist), using up to threads threads (or one per CPU, if threads is
+   0 or less). The files are read in the order that they are stored in the
+   archive. The flags parameter takes the PSO_EXTRACT_* flags, which can be used
+   to decompress the files on the way out. Files are named as they would be by
+   pso_gsl_file_name(), except that any slashes are replaced, and if several
+   files have the same name, all but the first have a number (normally their
+   handle) added to the end of the name, so that no two files get the same
+   name. Files that are already in dir are never overwritten, and
+   PSOARCHIVE_EFILE is returned if there are any in the way. */
+pso_error_t pso_gsl_extract_all(pso_gsl_read_t *a, const char *dir,
+                               uint32_t flags, int threads);
+
 /* Archive creation/writing functionality... */
 pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err);
 pso_gsl_write_t *pso_gsl_new_fd(int fd, uint32_t flags, pso_error_t *err);
 
 pso_error_t pso_gsl_write_close(pso_gsl_write_t *a);
 
+/* Open an existing archive to change it in place. Files can be replaced with
+   pso_gsl_write_replace(), and new files added to the end with the usual add
+   functions. Only the parts of the archive that change are written, so this is
+   much cheaper than building the archive again. New entries go in the unused
+   space in the file table; if there isn't any left, the first file in the
+   archive is moved to the end to make room. The endianness flags work the same
+   way as for pso_gsl_read_open(). */
+pso_gsl_write_t *pso_gsl_write_open(const char *fn, uint32_t flags,
+                                    pso_error_t *err);
+pso_gsl_write_t *pso_gsl_write_open_fd(int fd, uint32_t flags,
+                                       pso_error_t *err);
+
+/* Replace the data of file hnd in an archive opened with pso_gsl_write_open().
+   If the new data fits in the space the old data took up, it is written over
+   the old data, otherwise it is put at the end of the archive. */
+pso_error_t pso_gsl_write_replace(pso_gsl_write_t *a, uint32_t hnd,
+                                  const uint8_t *data, uint32_t len);
+
 /* Set the size of the file table. This is only valid on a newly created write
    structure. If you have already written files to this archive, this call will
    fail with PSOERROR_EFATAL. The ents parameter is rounded to the nearest block
@@ -79,5 +131,15 @@ pso_error_t pso_gsl_write_add_fd(pso_gsl_write_t *a, const char *fn, int fd,
 pso_error_t pso_gsl_write_add_file(pso_gsl_write_t *a, const char *afn,
                                    const char *fn);
 
+/* Add a whole batch of files to the archive, loading and compressing them (as
+   asked for in each item) on up to threads threads (or one per CPU, if threads
+   is 0 or less). The files are added in the order given, and the archive will
+   be exactly the same as if each one had been added by itself. No more than
+   about max_bytes of file data will be held in memory at once (or
+   PSO_BUILD_MAX_BYTES, if max_bytes is 0). */
+pso_error_t pso_gsl_write_add_batch(pso_gsl_write_t *a,
+                                   const pso_build_item_t *items, size_t count,
+                                   int threads, size_t max_bytes);
+
 
 #endif /* !PSOARCHIVE__GSL_H */
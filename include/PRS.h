@@ -43,6 +43,20 @@
 */
 int pso_prs_compress(const uint8_t *src, uint8_t **dst, size_t src_len);
 
+/* Compress a buffer with PRS compression into a preallocated buffer.
+
+   This function works exactly like pso_prs_compress, except that the output is
+   written into the buffer given, rather than a newly allocated one. A buffer of
+   the size returned by pso_prs_max_compressed_size will always be large enough,
+   but a smaller one may be used if you have some idea of how well the data will
+   compress (you will get an error if it turns out not to be big enough).
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the compressed output on success.
+*/
+int pso_prs_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                      size_t dst_len);
+
 /* Archive a buffer in PRS format.
 
    This function archives the data in the src buffer into a new buffer. This
@@ -135,4 +149,250 @@ int pso_prs_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
 */
 int pso_prs_decompress_size(const uint8_t *src, size_t src_len);
 
+/* Hash algorithms for the _verify functions. The CRC32C digest is returned in
+   the low 32 bits of the 64-bit digest value. */
+#define PSO_PRS_HASH_CRC32C     1
+#define PSO_PRS_HASH_XXH64      2
+
+/* Callback for the _verify_cb functions, called with each piece of the
+   decompressed output in order. */
+typedef void (*pso_prs_hash_cb_t)(void *udata, const uint8_t *data,
+                                  size_t len);
+
+/* Hash the decompressed contents of PRS-compressed data in a memory buffer.
+
+   This function decompresses the data in the src buffer, feeding the output
+   into the selected hash (one of the PSO_PRS_HASH_* values above) as it goes,
+   rather than writing it out anywhere. Only the last 8KiB of the output is
+   ever kept in memory, no matter how large the decompressed data is.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success,
+   with the digest stored in *digest.
+*/
+int pso_prs_verify(const uint8_t *src, size_t src_len, int hash,
+                   uint64_t *digest);
+
+/* Pass the decompressed contents of PRS-compressed data to a callback.
+
+   This function works like pso_prs_verify, except that each piece of output is
+   passed to the callback given (with udata as its first argument), so you can
+   compute whatever hash you like over it. The pieces are no more than 8KiB in
+   length, and the data passed in is only valid until the callback returns.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prs_verify_cb(const uint8_t *src, size_t src_len,
+                      pso_prs_hash_cb_t cb, void *udata);
+
+/* One item of work for the batch decompression functions. */
+typedef struct pso_prs_batch_item {
+    const uint8_t *src;         /* Compressed data */
+    size_t src_len;             /* Length of compressed data */
+    uint8_t *dst;               /* Preallocated output buffer */
+    size_t dst_len;             /* Length of output buffer */
+    int result;                 /* Filled in with the result for this item */
+} pso_prs_batch_item_t;
+
+/* Decompress a batch of PRS-compressed buffers on multiple threads.
+
+   This function decompresses each item in the array as if by calling
+   pso_prs_decompress_buf2 on it, spreading the work over the given number of
+   threads (or one per CPU if threads is 0). Idle threads pick up the next
+   unclaimed item, so a few large items won't hold up the rest of the batch.
+   No memory is allocated for each item.
+
+   The result of each item (the size of the decompressed output, or a negative
+   error code from psoarchive-error.h) is stored in its result field.
+
+   Returns PSOARCHIVE_OK if the batch was run (even if some items in it failed)
+   or a negative value from psoarchive-error.h if it could not be.
+*/
+int pso_prs_decompress_batch(pso_prs_batch_item_t *items, size_t count,
+                             int threads);
+
+/* Decompress a batch of PRS-compressed buffers on the calling thread.
+
+   This function decompresses each item in the array as if by calling
+   pso_prs_decompress_buf2 on it, but rather than doing them one after another,
+   it works on up to eight of them at once, decoding one token from each in
+   turn. The decoding of any one stream is a long chain of steps that each
+   depend on the last, so interleaving independent streams gives the CPU other
+   work to do while it waits on each step. This is most useful when there are
+   many small items and few cores to spread them over.
+
+   The result of each item (the size of the decompressed output, or a negative
+   error code from psoarchive-error.h) is stored in its result field.
+
+   Returns PSOARCHIVE_OK if the batch was run (even if some items in it failed)
+   or a negative value from psoarchive-error.h if it could not be.
+*/
+int pso_prs_decompress_interleaved(pso_prs_batch_item_t *items, size_t count);
+
+/* Opaque streaming decompression context. */
+struct pso_prs_stream;
+typedef struct pso_prs_stream pso_prs_stream_t;
+
+/* Returned by pso_prs_stream_decompress when the end of the compressed stream
+   has been reached. */
+#define PSO_PRS_STREAM_END      1
+
+/* Create a new streaming decompression context.
+
+   This function allocates a context for use with pso_prs_stream_decompress.
+   The context holds only the last 8KiB of output (which is as far back as PRS
+   ever looks for a match) and the state of the decoder, so its size does not
+   depend on the size of the data being decompressed.
+
+   It is the caller's responsibility to free the context with
+   pso_prs_stream_free when it is no longer in use.
+
+   Returns NULL on failure, setting err (if non-NULL) to an error code from
+   psoarchive-error.h.
+*/
+pso_prs_stream_t *pso_prs_stream_new(pso_error_t *err);
+
+/* Reset a streaming decompression context to decode a new stream. */
+pso_error_t pso_prs_stream_reset(pso_prs_stream_t *s);
+
+/* Free a streaming decompression context. */
+pso_error_t pso_prs_stream_free(pso_prs_stream_t *s);
+
+/* Decompress PRS-compressed data incrementally.
+
+   This function decodes as much of the input in *src as it can into the output
+   buffer at *dst. On return, *src and *dst are advanced past the data that was
+   consumed and produced, and *src_len and *dst_len are reduced to match. Input
+   and output can be given in pieces of any size (including a single byte), and
+   the decoder will happily stop in the middle of a token when either runs out,
+   picking back up where it left off on the next call.
+
+   Returns PSOARCHIVE_OK when more input or more output space is needed to make
+   further progress, PSO_PRS_STREAM_END once the end of the compressed stream
+   has been reached (all output has been produced at that point), or a negative
+   value (from psoarchive-error.h) on failure. After a failure, the context
+   must be reset before it can be used again.
+*/
+int pso_prs_stream_decompress(pso_prs_stream_t *s, const uint8_t **src,
+                              size_t *src_len, uint8_t **dst, size_t *dst_len);
+
+/* Opaque seek index for PRS-compressed data. */
+struct pso_prs_index;
+typedef struct pso_prs_index pso_prs_index_t;
+
+/* Default spacing of checkpoints in a seek index, in decompressed bytes. */
+#define PSO_PRS_INDEX_INTERVAL  0x10000
+
+/* Build a seek index for PRS-compressed data.
+
+   This function decompresses the data in the src buffer once, saving the state
+   of the decoder (a "checkpoint") every interval bytes of output. Each
+   checkpoint holds the position in the input, the state of the flag bits, and
+   the last 8KiB of output, so decoding can later be restarted from any of them
+   with pso_prs_decompress_range or spread across multiple threads with
+   pso_prs_decompress_parallel. If interval is 0, PSO_PRS_INDEX_INTERVAL will
+   be used. Smaller intervals make for faster lookups at the cost of a larger
+   index (up to 8KiB + 16 bytes per checkpoint).
+
+   It is the caller's responsibility to free the index with pso_prs_index_free
+   when it is no longer in use.
+
+   Returns NULL on failure, setting err (if non-NULL) to an error code from
+   psoarchive-error.h.
+*/
+pso_prs_index_t *pso_prs_index_build(const uint8_t *src, size_t src_len,
+                                     size_t interval, pso_error_t *err);
+
+/* Save a seek index to a file, so it can be loaded later with
+   pso_prs_index_load instead of being rebuilt. */
+pso_error_t pso_prs_index_save(const pso_prs_index_t *idx, const char *fn);
+
+/* Load a seek index from a file previously written by pso_prs_index_save.
+
+   Returns NULL on failure, setting err (if non-NULL) to an error code from
+   psoarchive-error.h.
+*/
+pso_prs_index_t *pso_prs_index_load(const char *fn, pso_error_t *err);
+
+/* Free a seek index. */
+pso_error_t pso_prs_index_free(pso_prs_index_t *idx);
+
+/* Return the decompressed size of the data a seek index was built from. */
+int pso_prs_index_size(const pso_prs_index_t *idx);
+
+/* Decompress part of a PRS-compressed buffer using a seek index.
+
+   This function decompresses len bytes of the data starting at the given
+   offset in the decompressed output, writing them into the buffer at dst. It
+   starts from the closest checkpoint in the index before the offset, so at
+   most one interval's worth of data is decoded and thrown away. The index must
+   have been built from the same data as is given in src.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the number of bytes written to dst on success,
+   which will be less than len if the range runs off the end of the data.
+*/
+int pso_prs_decompress_range(const uint8_t *src, size_t src_len,
+                             const pso_prs_index_t *idx, size_t offset,
+                             uint8_t *dst, size_t len);
+
+/* Decompress PRS-compressed data on multiple threads using a seek index.
+
+   This function decompresses all of the data in src into the previously
+   allocated buffer dst, which must be at least pso_prs_index_size bytes long.
+   The stretch of output between each pair of checkpoints in the index is
+   decoded independently, spread over the given number of threads (or one per
+   CPU if threads is 0).
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prs_decompress_parallel(const uint8_t *src, size_t src_len,
+                                const pso_prs_index_t *idx, uint8_t *dst,
+                                size_t dst_len, int threads);
+
+/* Number of buckets in each of the histograms in the analysis statistics.
+   Bucket n counts values v where 2^n <= v < 2^(n+1). */
+#define PSO_PRS_STATS_BUCKETS   14
+
+/* Kinds of copies from earlier in the output that PRS can encode. */
+#define PSO_PRS_COPY_SHORT      0   /* 1 byte offset, 2-5 bytes long */
+#define PSO_PRS_COPY_LONG       1   /* 13 bit offset, 3-9 bytes long */
+#define PSO_PRS_COPY_EXTENDED   2   /* 13 bit offset, 1-256 bytes long */
+#define PSO_PRS_COPY_KINDS      3
+
+/* Statistics for one kind of copy. Offsets are counted as the distance back
+   from the current position in the output (so they're always positive). */
+typedef struct pso_prs_copy_stats {
+    size_t count;               /* Number of copies of this kind */
+    size_t bytes;               /* Total bytes of output they produced */
+    size_t length[PSO_PRS_STATS_BUCKETS];
+    size_t offset[PSO_PRS_STATS_BUCKETS];
+} pso_prs_copy_stats_t;
+
+/* Statistics about the contents of a PRS-compressed stream. */
+typedef struct pso_prs_stats {
+    size_t compressed_size;     /* Bytes of input consumed */
+    size_t decompressed_size;   /* Bytes of output produced */
+    size_t literals;            /* Bytes copied straight from the input */
+    size_t flag_bytes;          /* Bytes of input used for flag bits */
+    size_t flag_bits;           /* Flag bits actually used (including EOF) */
+    pso_prs_copy_stats_t copies[PSO_PRS_COPY_KINDS];
+} pso_prs_stats_t;
+
+/* Analyze the contents of PRS-compressed data in a memory buffer.
+
+   This function walks through the PRS-compressed data in the src buffer
+   without writing any output (like pso_prs_decompress_size does), recording
+   what each part of the compressed stream was used for in the stats structure
+   given. This is mainly useful for seeing how well the data was compressed and
+   where the space in the compressed data is going.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prs_analyze(const uint8_t *src, size_t src_len,
+                    pso_prs_stats_t *stats);
+
 #endif /* !PSOARCHIVE__PRS_H */
@@ -25,6 +25,19 @@
 #include <sys/types.h>
 
 #include "psoarchive-error.h"
+#include "PRS.h"
+
+/* Opaque keystream object. This holds the encryption state for a key, set up
+   and ready to use. */
+struct pso_prsd_key;
+typedef struct pso_prsd_key pso_prsd_key_t;
+
+/* Opaque cache of keystream objects. */
+struct pso_prsd_key_cache;
+typedef struct pso_prsd_key_cache pso_prsd_key_cache_t;
+
+/* Default number of keys kept in a key cache. */
+#define PSO_PRSD_KEY_CACHE_SIZE 16
 
 /* Compress a buffer with PRSD compression and encryption.
 
@@ -40,6 +53,32 @@
 int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
                       uint32_t key);
 
+/* Compress a buffer with PRSD compression and encryption into a preallocated
+   buffer.
+
+   This function works exactly like pso_prsd_compress, except that the output is
+   written into the buffer given, rather than a newly allocated one. A buffer of
+   the size returned by pso_prsd_max_compressed_size will always be large
+   enough, but a smaller one may be used (you will get an error if it turns out
+   not to be big enough). The data is compressed and encrypted in one pass.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the compressed output on success.
+*/
+int pso_prsd_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                       size_t dst_len, uint32_t key);
+
+/* Compress a buffer with PRSD compression and encryption, using a keystream
+   object that has already been set up for the key.
+
+   This function works exactly like pso_prsd_compress, except that the key is
+   taken from the keystream object given, and the encryption state is copied
+   from it rather than being set up from scratch. The keystream object is not
+   modified, so it may be used again (even by several threads at once).
+*/
+int pso_prsd_compress_key(const uint8_t *src, uint8_t **dst, size_t src_len,
+                          const pso_prsd_key_t *key);
+
 /* Archive and encrypt a buffer in PRSD format.
 
    This function archives the data in the src buffer into a new buffer. This
@@ -101,6 +140,22 @@ int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len);
 int pso_prsd_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
                              size_t dst_len);
 
+/* Decompress PRSD-compressed data from a memory buffer, using a keystream
+   object for the key.
+
+   These functions work exactly like pso_prsd_decompress_buf and
+   pso_prsd_decompress_buf2, except that if the key in the header of the data
+   matches the key of the keystream object given, the encryption state is
+   copied from it rather than being set up from scratch. If the key doesn't
+   match (or key is NULL), the key in the header is used as usual. The
+   keystream object is not modified.
+*/
+int pso_prsd_decompress_buf_key(const uint8_t *src, uint8_t **dst,
+                                size_t src_len, const pso_prsd_key_t *key);
+int pso_prsd_decompress_buf2_key(const uint8_t *src, uint8_t *dst,
+                                 size_t src_len, size_t dst_len,
+                                 const pso_prsd_key_t *key);
+
 /* Determine the size that the PRSD-compressed data in a buffer will expand to.
 
    This function examines the header from the PRSD data to determine the
@@ -111,4 +166,209 @@ int pso_prsd_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
 */
 int pso_prsd_decompress_size(const uint8_t *src, size_t src_len);
 
+/* Hash the decompressed contents of PRSD-compressed data in a memory buffer.
+
+   This function decrypts and decompresses the data in the src buffer a small
+   piece at a time, feeding the output into the selected hash (one of the
+   PSO_PRS_HASH_* values from PRS.h) as it goes. Neither the decrypted data nor
+   the decompressed output is ever held in memory in full. The length of the
+   output is checked against the size in the header.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success,
+   with the digest stored in *digest.
+*/
+int pso_prsd_verify(const uint8_t *src, size_t src_len, int hash,
+                    uint64_t *digest);
+
+/* Pass the decompressed contents of PRSD-compressed data to a callback.
+
+   This function works like pso_prsd_verify, except that each piece of output
+   is passed to the callback given (with udata as its first argument). The
+   pieces are no more than 8KiB in length, and the data passed in is only valid
+   until the callback returns.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prsd_verify_cb(const uint8_t *src, size_t src_len,
+                       pso_prs_hash_cb_t cb, void *udata);
+
+/* Decompress a PRSD file from a file descriptor to another file descriptor.
+
+   This function reads PRSD data from in_fd (starting at its current position)
+   a chunk at a time, decrypting and decompressing it as it goes, and writing
+   the output to out_fd. Only a few tens of KiB of memory are used, no matter
+   how large the file is. The length of the output is checked against the size
+   in the header once the end of the data is reached.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prsd_decompress_fd(int in_fd, int out_fd);
+
+/* Decompress a PRSD file from a file descriptor, passing the output to a
+   callback.
+
+   This function works like pso_prsd_decompress_fd, except that each piece of
+   output is passed to the callback given (with udata as its first argument)
+   instead of being written to a file. The pieces are no more than 8KiB in
+   length, and the data passed in is only valid until the callback returns.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prsd_decompress_fd_cb(int fd, pso_prs_hash_cb_t cb, void *udata);
+
+/* Decompress a batch of PRSD-compressed buffers on multiple threads.
+
+   This function decompresses each item in the array as if by calling
+   pso_prsd_decompress_buf2 on it, spreading the work over the given number of
+   threads (or one per CPU if threads is 0).
+
+   The result of each item (the size of the decompressed output, or a negative
+   error code from psoarchive-error.h) is stored in its result field.
+
+   Returns PSOARCHIVE_OK if the batch was run (even if some items in it failed)
+   or a negative value from psoarchive-error.h if it could not be.
+*/
+int pso_prsd_decompress_batch(pso_prs_batch_item_t *items, size_t count,
+                              int threads);
+
+/* Decrypt part of the data in a PRSD file without decompressing it.
+
+   This function decrypts len bytes of the encrypted (PRS-compressed) data that
+   follows the 8-byte PRSD header in the src buffer, starting at the given
+   offset into that data (not counting the header), storing the result in dst.
+   The offset must be a multiple of 4 bytes. The encryption is not run from the
+   start of the data to get to the offset, so this takes about the same amount
+   of time no matter where in the data the offset is.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the number of bytes decrypted on success, which
+   will be less than len if the data ends before that.
+*/
+int pso_prsd_decrypt_range(const uint8_t *src, size_t src_len, size_t offset,
+                           uint8_t *dst, size_t len);
+
+/* Decrypt all of the data in a PRSD file without decompressing it.
+
+   This function decrypts all of the data that follows the 8-byte PRSD header in
+   the src buffer into dst, which must be at least src_len - 8 bytes long. The
+   result is plain PRS-compressed data, which can be passed to any of the PRS
+   decompression functions. Large buffers are split into pieces that are
+   decrypted at the same time on the given number of threads (or one per CPU if
+   threads is 0).
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the number of bytes decrypted on success.
+*/
+int pso_prsd_decrypt(const uint8_t *src, size_t src_len, uint8_t *dst,
+                     size_t dst_len, int threads);
+
+/* Decrypt the data in a PRSD file in place.
+
+   This function decrypts the data that follows the 8-byte PRSD header in the
+   buffer given, overwriting the encrypted data with the decrypted data. The
+   header itself is left alone. Afterwards, buf + 8 holds plain PRS-compressed
+   data, which can be passed to any of the PRS decompression functions. The
+   buffer does not need to be padded out to a multiple of 4 bytes.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the number of bytes decrypted on success.
+*/
+int pso_prsd_decrypt_inplace(uint8_t *buf, size_t len);
+
+/* Decompress PRSD-compressed data, decrypting it in place first.
+
+   This function works like pso_prsd_decompress_buf2, except that the data is
+   decrypted in the src buffer itself (as with pso_prsd_decrypt_inplace) before
+   it is decompressed. This is useful when the caller already owns a copy of the
+   data that it won't need again. Once decompression has been attempted, the
+   contents of the src buffer after the header will have been decrypted,
+   whether it was successful or not. If the arguments are bad or dst is too
+   small for the decompressed data (PSOARCHIVE_EFAULT, PSOARCHIVE_EBADMSG or
+   PSOARCHIVE_ENOSPC), nothing is attempted and src is left untouched.
+
+   Returns a negative value on failure (specifically something from
+   psoarchive-error.h). Returns the size of the decompressed output on success.
+*/
+int pso_prsd_decompress_inplace(uint8_t *src, size_t src_len, uint8_t *dst,
+                                size_t dst_len);
+
+/* One buffer to be encrypted (or decrypted) by pso_prsd_crypt_batch. */
+typedef struct pso_prsd_crypt_item {
+    uint8_t *data;              /* Data to encrypt (in place) */
+    size_t len;                 /* Length of the data */
+    uint32_t key;               /* Key to encrypt it with */
+} pso_prsd_crypt_item_t;
+
+/* Encrypt or decrypt a batch of buffers, each with its own key.
+
+   This function runs the PRSD encryption over the data in each of the items
+   given, in place, exactly as pso_prsd_compress does to the compressed data
+   (the encryption is its own inverse, so this will decrypt data as well). The
+   data should not include the 8-byte PRSD header. The buffers do not need to be
+   padded out to a multiple of 4 bytes.
+
+   Rather than doing one buffer after another, up to eight buffers are done at
+   a time, with the encryption state for all of them set up and updated side by
+   side. This is much faster than doing them one at a time when there are a lot
+   of small buffers. It works best if buffers of similar sizes are next to each
+   other in the array.
+
+   Returns PSOARCHIVE_OK on success or a negative value from psoarchive-error.h
+   on failure.
+*/
+int pso_prsd_crypt_batch(pso_prsd_crypt_item_t *items, size_t count);
+
+/* Create a keystream object for the given key.
+
+   The object holds the encryption state for the key, set up and ready to use.
+   Passing it to the _key versions of the PRSD functions saves them from having
+   to set up the encryption state for the key themselves each time.
+
+   Returns NULL on failure, setting err (if not NULL) to the error code.
+*/
+pso_prsd_key_t *pso_prsd_key_new(uint32_t key, pso_error_t *err);
+
+/* Make a copy of a keystream object. This is just a copy of a small block of
+   memory, so it is much cheaper than making a new object for the key. */
+pso_prsd_key_t *pso_prsd_key_clone(const pso_prsd_key_t *k, pso_error_t *err);
+
+/* Free a keystream object. */
+pso_error_t pso_prsd_key_free(pso_prsd_key_t *k);
+
+/* Retrieve the key that a keystream object was created for. */
+uint32_t pso_prsd_key_value(const pso_prsd_key_t *k);
+
+/* Create a cache of keystream objects.
+
+   The cache holds up to size keystream objects (or PSO_PRSD_KEY_CACHE_SIZE if
+   size is 0), throwing out the least recently used one when a new key needs to
+   be added to a full cache.
+
+   The cache does no locking of its own. If you want to share one between
+   threads, you must make sure only one thread is using it at a time (and that
+   nobody is still using a key from it while another thread looks up a key).
+
+   Returns NULL on failure, setting err (if not NULL) to the error code.
+*/
+pso_prsd_key_cache_t *pso_prsd_key_cache_new(int size, pso_error_t *err);
+
+/* Free a cache of keystream objects, along with all of the objects in it. */
+pso_error_t pso_prsd_key_cache_free(pso_prsd_key_cache_t *c);
+
+/* Look up the keystream object for a key in a cache, creating it if needed.
+
+   The object returned belongs to the cache, and must not be freed. It is only
+   valid until the next lookup on the same cache (which might throw it out to
+   make room for another key). Use pso_prsd_key_clone if you need to keep it
+   around for longer than that.
+
+   Returns NULL if c is NULL.
+*/
+const pso_prsd_key_t *pso_prsd_key_cache_get(pso_prsd_key_cache_t *c,
+                                             uint32_t key);
+
 #endif /* !PSOARCHIVE__PRS_H */
@@ -0,0 +1,60 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__BUILD_H
+#define PSOARCHIVE__BUILD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* What to do to a file's data on its way into an archive built with the
+   pso_afs_write_add_batch() or pso_gsl_write_add_batch() functions. */
+#define PSO_BUILD_COPY      0       /* Store the data as-is. */
+#define PSO_BUILD_PRS       1       /* PRS compress the data. */
+#define PSO_BUILD_PRSD      2       /* PRSD compress the data with key. */
+
+/* A file to be added to an archive with the batch functions. The data comes
+   from the file named by path if it is non-NULL, otherwise it is the len bytes
+   at data. The data buffer must stay valid until the batch function returns.
+   For AFS archives with a filename table, files from a path get the path's
+   modification time, and files from data get mtime (or the time the batch was
+   started, if mtime is 0). */
+typedef struct pso_build_item {
+    const char *name;
+    const char *path;
+    const uint8_t *data;
+    uint32_t len;
+
+    int transform;
+    uint32_t key;
+    time_t mtime;
+} pso_build_item_t;
+
+/* The default limit on how much data the batch functions will hold in memory
+   at once (if 0 is passed as the limit). */
+#define PSO_BUILD_MAX_BYTES 0x10000000
+
+/* Flags for the pso_afs_extract_all() and pso_gsl_extract_all() functions.
+   These decompress every file in the archive as PRS (or PRSD) data on the way
+   out. Any file that doesn't decompress cleanly is written out as it is. */
+#define PSO_EXTRACT_PRS     (1 << 0)
+#define PSO_EXTRACT_PRSD    (1 << 1)
+
+#endif /* !PSOARCHIVE__BUILD_H */
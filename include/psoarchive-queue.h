@@ -0,0 +1,66 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSOARCHIVE__QUEUE_H
+#define PSOARCHIVE__QUEUE_H
+
+#include "psoarchive-error.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Opaque I/O queue structure. */
+struct pso_io_queue;
+typedef struct pso_io_queue pso_io_queue_t;
+
+/* A request to read a file from an archive, for the pso_afs_read_submit() and
+   pso_gsl_read_submit() functions. At most len bytes are read into buf (which
+   must stay valid until the request is handed back by pso_io_queue_reap()).
+   When the request is done, result is set to the number of bytes read, or -1
+   on error. The udata field is not touched by the library. */
+typedef struct pso_read_req {
+    uint32_t hnd;
+    uint8_t *buf;
+    size_t len;
+    ssize_t result;
+    void *udata;
+} pso_read_req_t;
+
+/* Create a queue for reading files asynchronously. Where io_uring is available,
+   requests are handed to the kernel and the reads are done in the background,
+   with up to depth of them in flight at once. Otherwise, the reads are spread
+   over a pool of threads when they are submitted, and are already done by the
+   time the submit function returns. */
+pso_io_queue_t *pso_io_queue_new(unsigned int depth, pso_error_t *err);
+
+/* Free a queue, first waiting for any reads that are still in flight. */
+pso_error_t pso_io_queue_free(pso_io_queue_t *q);
+
+/* Collect up to max requests that have been completed, storing pointers to them
+   in done. If wait is non-zero and nothing is done yet, this will block until
+   at least one request is done (unless there is nothing left in flight).
+   Returns the number of requests stored in done. */
+size_t pso_io_queue_reap(pso_io_queue_t *q, pso_read_req_t **done, size_t max,
+                         int wait);
+
+/* Returns non-zero if the queue is using io_uring. */
+int pso_io_queue_async(pso_io_queue_t *q);
+
+#endif /* !PSOARCHIVE__QUEUE_H */
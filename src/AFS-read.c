@@ -24,24 +24,81 @@
 
 #include <fcntl.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #ifndef _WIN32
 #include <unistd.h>
 #include <inttypes.h>
 #endif
 
 #include "AFS.h"
+#include "io-common.h"
+#include "extract-common.h"
+
+#ifdef HAVE_PTHREAD_H
+#define LOCK_INIT(s)    pthread_mutex_init(&(s)->lock, NULL)
+#define LOCK_FREE(s)    pthread_mutex_destroy(&(s)->lock)
+#define LOCK(s)         pthread_mutex_lock(&(s)->lock)
+#define UNLOCK(s)       pthread_mutex_unlock(&(s)->lock)
+#else
+#define LOCK_INIT(s)    0
+#define LOCK_FREE(s)    (void)0
+#define LOCK(s)         (void)0
+#define UNLOCK(s)       (void)0
+#endif
+
+#if defined(__BIG_ENDIAN__) || defined(WORDS_BIGENDIAN)
+#define LE32(x) (((x >> 24) & 0x00FF) | \
+                 ((x >>  8) & 0xFF00) | \
+                 ((x & 0xFF00) <<  8) | \
+                 ((x & 0x00FF) << 24))
+#else
+#define LE32(x) x
+#endif
+
+/* Each entry in the filename table is 48 bytes long: the name, the date and
+   time (as six 16-bit values), and the size of the file. */
+#define NAME_ENTRY_LEN  0x30
+#define NAME_LEN        32
 
 struct afs_file {
     uint32_t offset;
     uint32_t size;
 };
 
+/* The parts of an open archive that are shared between a handle and all of
+   its clones. The last handle to be closed cleans up the archive. The
+   filename table is read in the first time it is needed, with the lock
+   held. */
+struct afs_shared {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+    int refs;
+
+    int names_loaded;
+    char *names;
+    uint32_t *index;
+    uint32_t index_mask;
+};
+
+/* Everything in here is set up when the archive is opened and never changed
+   afterwards, which is what makes reading from one handle (or its clones) on
+   several threads at once safe. */
 struct pso_afs_read {
     int fd;
     struct afs_file *files;
+    struct pso_io_map map;
+    struct afs_shared *shared;
 
     uint32_t file_count;
     uint32_t flags;
+    uint32_t len;
+
+    uint32_t names_pos;
+    uint32_t names_len;
 };
 
 pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
@@ -50,10 +107,12 @@ pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
     pso_error_t erv = PSOARCHIVE_EFATAL;
     uint32_t i, files;
     uint8_t buf[8];
+    size_t toc_len;
+    int advice = PSO_IO_NORMAL;
 
     /* Read the beginning of the file to make sure it is an AFS archive and to
        get the number of files... */
-    if(read(fd, buf, 8) != 8) {
+    if(pso_io_pread(fd, buf, 8, 0) != 8) {
         erv = PSOARCHIVE_NOARCHIVE;
         goto ret_err;
     }
@@ -76,36 +135,79 @@ pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
         goto ret_err;
     }
 
-    /* Allocate some file handles... */
-    rv->files = (struct afs_file *)malloc(sizeof(struct afs_file) * files);
-    if(!rv->files) {
+    if(!(rv->shared = (struct afs_shared *)malloc(sizeof(struct afs_shared)))) {
         erv = PSOARCHIVE_EMEM;
         goto ret_handle;
     }
 
-    /* Read each file's metadata in. */
-    for(i = 0; i < files; ++i) {
-        if(read(fd, buf, 8) != 8) {
-            erv = PSOARCHIVE_EIO;
-            goto ret_files;
-        }
+    if(LOCK_INIT(rv->shared)) {
+        erv = PSOARCHIVE_EFATAL;
+        goto ret_shared;
+    }
+
+    rv->shared->refs = 1;
+    rv->shared->names_loaded = 0;
+    rv->shared->names = NULL;
+    rv->shared->index = NULL;
+    rv->shared->index_mask = 0;
+
+    /* Allocate some file handles. There's one extra at the end for the
+       position and length of the filename table, which immediately follows
+       the table of contents (if there is a filename table). */
+    rv->files = (struct afs_file *)malloc(sizeof(struct afs_file) *
+                                          (files + 1));
+    if(!rv->files) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_lock;
+    }
+
+    memset(&rv->files[files], 0, sizeof(struct afs_file));
+
+    /* The table of contents is laid out on disk exactly like our array of
+       afs_file structures (aside from endianness), so read the whole thing
+       straight into the array in one go. */
+    toc_len = sizeof(struct afs_file) * files;
+    if(pso_io_pread(fd, rv->files, toc_len + sizeof(struct afs_file), 8) <
+       (ssize_t)toc_len) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_files;
+    }
 
-        rv->files[i].offset = buf[0] | (buf[1] << 8) | (buf[2] << 16) |
-            (buf[3] << 24);
-        rv->files[i].size = buf[4] | (buf[5] << 8) | (buf[6] << 16) |
-            (buf[7] << 24);
+    rv->names_pos = LE32(rv->files[files].offset);
+    rv->names_len = LE32(rv->files[files].size);
+
+    for(i = 0; i < files; ++i) {
+        rv->files[i].offset = LE32(rv->files[i].offset);
+        rv->files[i].size = LE32(rv->files[i].size);
 
         /* Make sure it looks sane... */
-        if(rv->files[i].offset + rv->files[i].size > len) {
+        if(rv->files[i].offset > len ||
+           rv->files[i].size > len - rv->files[i].offset) {
             erv = PSOARCHIVE_ERANGE;
             goto ret_files;
         }
     }
 
+    if((flags & PSO_AFS_SEQUENTIAL))
+        advice = PSO_IO_SEQUENTIAL;
+    else if((flags & PSO_AFS_RANDOM))
+        advice = PSO_IO_RANDOM;
+
+    /* Map the archive, if the user asked us to. If we can't, then just read
+       from the file like normal. */
+    memset(&rv->map, 0, sizeof(struct pso_io_map));
+
+    if(!(flags & PSO_AFS_MMAP) ||
+       pso_io_mmap(fd, (size_t)len, advice, &rv->map) != PSOARCHIVE_OK) {
+        flags &= ~PSO_AFS_MMAP;
+        pso_io_advise(fd, advice);
+    }
+
     /* Set the file count in the handle and shrink the files array... */
     rv->fd = fd;
     rv->file_count = files;
     rv->flags = flags;
+    rv->len = len;
 
     /* We're done, return... */
     if(err)
@@ -115,6 +217,10 @@ pso_afs_read_t *pso_afs_read_open_fd(int fd, uint32_t len, uint32_t flags,
 
 ret_files:
     free(rv->files);
+ret_lock:
+    LOCK_FREE(rv->shared);
+ret_shared:
+    free(rv->shared);
 ret_handle:
     free(rv);
 ret_err:
@@ -132,7 +238,7 @@ pso_afs_read_t *pso_afs_read_open(const char *fn, uint32_t flags,
     pso_afs_read_t *rv;
 
     /* Open the file... */
-    if(!(fd = open(fn, O_RDONLY))) {
+    if((fd = open(fn, O_RDONLY)) < 0) {
         erv = PSOARCHIVE_EFILE;
         goto ret_err;
     }
@@ -166,12 +272,58 @@ ret_err:
     return NULL;
 }
 
+pso_afs_read_t *pso_afs_read_clone(pso_afs_read_t *a, pso_error_t *err) {
+    pso_afs_read_t *rv;
+
+    if(!a) {
+        if(err)
+            *err = PSOARCHIVE_EFATAL;
+
+        return NULL;
+    }
+
+    if(!(rv = (pso_afs_read_t *)malloc(sizeof(pso_afs_read_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    /* The clone shares everything with the original, so all we have to do is
+       copy the handle and take another reference to the archive. */
+    memcpy(rv, a, sizeof(pso_afs_read_t));
+
+    LOCK(a->shared);
+    ++a->shared->refs;
+    UNLOCK(a->shared);
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
 pso_error_t pso_afs_read_close(pso_afs_read_t *a) {
+    int refs;
+
     if(!a || a->fd < 0 || !a->files)
         return PSOARCHIVE_EFATAL;
 
-    close(a->fd);
-    free(a->files);
+    LOCK(a->shared);
+    refs = --a->shared->refs;
+    UNLOCK(a->shared);
+
+    /* Only clean up the archive itself once the last handle to it goes. */
+    if(!refs) {
+        LOCK_FREE(a->shared);
+        free(a->shared->index);
+        free(a->shared->names);
+        free(a->shared);
+        pso_io_unmap(&a->map);
+        close(a->fd);
+        free(a->files);
+    }
+
     free(a);
 
     return PSOARCHIVE_OK;
@@ -184,18 +336,162 @@ uint32_t pso_afs_file_count(pso_afs_read_t *a) {
     return a->file_count;
 }
 
+static uint32_t hash_name(const char *fn) {
+    uint32_t h = 0x811C9DC5;
+
+    /* FNV-1a. */
+    while(*fn) {
+        h ^= (uint8_t)*fn++;
+        h *= 0x01000193;
+    }
+
+    return h;
+}
+
+static void load_names(pso_afs_read_t *a) {
+    struct afs_shared *s = a->shared;
+    uint32_t pos = a->names_pos, len = a->names_len, i, h, size;
+    uint8_t *buf, tmp[8];
+    const uint8_t *tbl;
+
+    /* Some archives have the filename table's position at the end of the
+       space reserved for the table of contents, rather than right after it. */
+    if(!pos && !len && a->file_count && a->files[0].offset >= 16 &&
+       a->files[0].offset - 8 >= 8 + 8 * a->file_count) {
+        if(pso_io_pread(a->fd, tmp, 8, a->files[0].offset - 8) != 8)
+            return;
+
+        pos = tmp[0] | (tmp[1] << 8) | (tmp[2] << 16) | (tmp[3] << 24);
+        len = tmp[4] | (tmp[5] << 8) | (tmp[6] << 16) | (tmp[7] << 24);
+    }
+
+    /* Make sure there's a table and that it makes sense... */
+    size = a->file_count * NAME_ENTRY_LEN;
+    if(!pos || !a->file_count || len < size || pos > a->len ||
+       size > a->len - pos)
+        return;
+
+    /* Read it in, unless we've got the whole archive mapped already. */
+    if((a->flags & PSO_AFS_MMAP)) {
+        buf = NULL;
+        tbl = a->map.data + pos;
+    }
+    else {
+        if(!(buf = (uint8_t *)malloc(size)))
+            return;
+
+        if(pso_io_pread(a->fd, buf, size, (off_t)pos) != (ssize_t)size) {
+            free(buf);
+            return;
+        }
+
+        tbl = buf;
+    }
+
+    /* Make the hash table at least twice as big as the number of files, so
+       that the chains stay short. */
+    for(h = 16; h < a->file_count * 2; h <<= 1) ;
+
+    s->names = (char *)malloc(a->file_count * (NAME_LEN + 1));
+    s->index = (uint32_t *)malloc(h * sizeof(uint32_t));
+
+    if(!s->names || !s->index) {
+        free(s->names);
+        free(s->index);
+        s->names = NULL;
+        s->index = NULL;
+        free(buf);
+        return;
+    }
+
+    s->index_mask = h - 1;
+    memset(s->index, 0xFF, h * sizeof(uint32_t));
+
+    /* Copy out the names and put them in the hash table. Since the table is
+       filled in order, the first file with any given name is always the one
+       found by a lookup. */
+    for(i = 0; i < a->file_count; ++i) {
+        memcpy(s->names + i * (NAME_LEN + 1), tbl + i * NAME_ENTRY_LEN,
+               NAME_LEN);
+        s->names[i * (NAME_LEN + 1) + NAME_LEN] = 0;
+
+        h = hash_name(s->names + i * (NAME_LEN + 1)) & s->index_mask;
+        while(s->index[h] != PSOARCHIVE_HND_INVALID)
+            h = (h + 1) & s->index_mask;
+
+        s->index[h] = i;
+    }
+
+    free(buf);
+}
+
+static const char *file_names(pso_afs_read_t *a) {
+    const char *rv;
+
+    LOCK(a->shared);
+
+    if(!a->shared->names_loaded) {
+        load_names(a);
+        a->shared->names_loaded = 1;
+    }
+
+    rv = a->shared->names;
+    UNLOCK(a->shared);
+
+    return rv;
+}
+
 uint32_t pso_afs_file_lookup(pso_afs_read_t *a, const char *fn) {
-    (void)a;
-    (void)fn;
+    const char *names;
+    uint32_t h, i;
+    char tmp[16];
+    char *end;
+    unsigned long hnd;
+
+    /* Make sure we've got sane arguments... */
+    if(!a || !fn)
+        return PSOARCHIVE_HND_INVALID;
+
+    /* If the archive doesn't have a filename table, then the only names that
+       files have are the ones pso_afs_file_name() makes up for them. */
+    if(!(names = file_names(a))) {
+        hnd = strtoul(fn, &end, 10);
+
+        if(end == fn || hnd >= a->file_count)
+            return PSOARCHIVE_HND_INVALID;
+
+        pso_afs_file_name(a, (uint32_t)hnd, tmp, sizeof(tmp));
+        return strcmp(fn, tmp) ? PSOARCHIVE_HND_INVALID : (uint32_t)hnd;
+    }
+
+    h = hash_name(fn) & a->shared->index_mask;
+
+    while((i = a->shared->index[h]) != PSOARCHIVE_HND_INVALID) {
+        if(!strcmp(fn, names + i * (NAME_LEN + 1)))
+            return i;
+
+        h = (h + 1) & a->shared->index_mask;
+    }
+
+    /* Didn't find it, bail out. */
     return PSOARCHIVE_HND_INVALID;
 }
 
 pso_error_t pso_afs_file_name(pso_afs_read_t *a, uint32_t hnd, char *fn,
                               size_t len) {
+    const char *names;
+
     /* Make sure the arguments are sane... */
     if(!a || hnd >= a->file_count)
         return PSOARCHIVE_EFATAL;
 
+    /* Use the real name of the file, if the archive has them. Otherwise, make
+       one up from the file's position in the archive. */
+    if((names = file_names(a))) {
+        snprintf(fn, len, "%s", names + hnd * (NAME_LEN + 1));
+        return PSOARCHIVE_OK;
+    }
+
 #ifndef _WIN32
     snprintf(fn, len, "%05" PRIu32 ".bin", hnd);
 #else
@@ -215,20 +511,116 @@ ssize_t pso_afs_file_size(pso_afs_read_t *a, uint32_t hnd) {
 
 ssize_t pso_afs_file_read(pso_afs_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len) {
-    /* Make sure the arguments are sane... */
-    if(!a || hnd > a->file_count || !buf || !len)
-        return -1;
+    ssize_t rv;
 
-    /* Seek to the appropriate position in the file. */
-    if(lseek(a->fd, a->files[hnd].offset, SEEK_SET) == (off_t) -1)
+    /* Make sure the arguments are sane... */
+    if(!a || hnd >= a->file_count || !buf || !len)
         return -1;
 
     /* Figure out how much we're going to read... */
     if(a->files[hnd].size < len)
         len = a->files[hnd].size;
 
-    if(read(a->fd, buf, len) != len)
+    /* If the archive is mapped, then just copy it out of the mapping. */
+    if((a->flags & PSO_AFS_MMAP)) {
+        memcpy(buf, a->map.data + a->files[hnd].offset, len);
+        return (ssize_t)len;
+    }
+
+    /* Read from the file at the right position. With pread(), this doesn't
+       touch the file position, so other threads can be reading at the same
+       time. Without it, every handle to the archive shares the position, so
+       they have to take turns. */
+#ifndef HAVE_PREAD
+    LOCK(a->shared);
+#endif
+
+    rv = pso_io_pread(a->fd, buf, len, (off_t)a->files[hnd].offset);
+
+#ifndef HAVE_PREAD
+    UNLOCK(a->shared);
+#endif
+
+    if(rv != (ssize_t)len)
         return -1;
 
     return (ssize_t)len;
 }
+
+pso_error_t pso_afs_file_map(pso_afs_read_t *a, uint32_t hnd,
+                             const uint8_t **ptr, size_t *len) {
+    /* Make sure the arguments are sane... */
+    if(!a || hnd >= a->file_count || !ptr || !len)
+        return PSOARCHIVE_EFATAL;
+
+    if(!(a->flags & PSO_AFS_MMAP))
+        return PSOARCHIVE_ENOTSUPP;
+
+    *ptr = a->map.data + a->files[hnd].offset;
+    *len = a->files[hnd].size;
+
+    return PSOARCHIVE_OK;
+}
+
+static int submit_info(void *d, uint32_t hnd, off_t *off, uint32_t *size) {
+    pso_afs_read_t *a = (pso_afs_read_t *)d;
+
+    if(hnd >= a->file_count)
+        return -1;
+
+    *off = (off_t)a->files[hnd].offset;
+    *size = a->files[hnd].size;
+    return 0;
+}
+
+pso_error_t pso_afs_read_submit(pso_io_queue_t *q, pso_afs_read_t *a,
+                                pso_read_req_t *reqs, size_t count) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return pso_io_queue_read_files(q, a->fd, reqs, count, &submit_info, a);
+}
+
+static ssize_t extract_read(void *a, uint32_t hnd, uint8_t *buf, size_t len) {
+    return pso_afs_file_read((pso_afs_read_t *)a, hnd, buf, len);
+}
+
+static const uint8_t *extract_map(void *d, uint32_t hnd) {
+    pso_afs_read_t *a = (pso_afs_read_t *)d;
+
+    if(!(a->flags & PSO_AFS_MMAP))
+        return NULL;
+
+    return a->map.data + a->files[hnd].offset;
+}
+
+static pso_error_t extract_name(void *a, uint32_t hnd, char *fn, size_t len) {
+    return pso_afs_file_name((pso_afs_read_t *)a, hnd, fn, len);
+}
+
+pso_error_t pso_afs_extract_all(pso_afs_read_t *a, const char *dir,
+                               uint32_t flags, int threads) {
+    struct pso_extract_ent *ents;
+    uint32_t i;
+    pso_error_t rv;
+
+    if(!a || !dir)
+        return PSOARCHIVE_EFATAL;
+
+    ents = (struct pso_extract_ent *)malloc(sizeof(struct pso_extract_ent) *
+                                            (a->file_count + 1));
+    if(!ents)
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < a->file_count; ++i) {
+        ents[i].hnd = i;
+        ents[i].offset = a->files[i].offset;
+        ents[i].size = a->files[i].size;
+    }
+
+    rv = pso_extract_run(ents, a->file_count, dir, flags, threads,
+                         &extract_read, &extract_map, &extract_name, a);
+
+    free(ents);
+    return rv;
+}
@@ -22,13 +22,52 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <time.h>
+
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #ifndef _WIN32
 #include <unistd.h>
 #endif
 
 #include "AFS.h"
+#include "io-common.h"
+#include "build-common.h"
+#include "update-common.h"
+
+/* Each entry in the filename table is 48 bytes long: the name, the date and
+   time (as six 16-bit values), and the size of the file. */
+#define NAME_ENTRY_LEN  0x30
+#define NAME_LEN        32
+
+/* The table of contents (and the position of the filename table) have to fit
+   before the first file's data. */
+#define DATA_START      0x80000
+
+/* The most files that can be put in an archive. */
+#define MAX_FILES       65535
+
+/* How much of the archive is buffered up at a time when writing it out in one
+   pass (with PSO_AFS_BUILD). */
+#define OUT_CHUNK       0x100000
+
+#define ALIGN(x)        (((x) + 2047) & ~((off_t)2047))
+
+/* A file that has been added to an archive with PSO_AFS_BUILD, but not written
+   out yet. Either data holds a copy of the file, or path is the name of the
+   file to read it from. */
+struct afs_entry {
+    uint8_t *data;
+    char *path;
+    uint32_t len;
+};
+
+struct out_buf {
+    int fd;
+    uint8_t *buf;
+    size_t used;
+};
 
 struct pso_afs_write {
     int fd;
@@ -39,6 +78,17 @@ struct pso_afs_write {
 
     off_t ftab_pos;
     off_t data_pos;
+
+    uint8_t *names;
+    int names_allocd;
+
+    struct afs_entry *ents;
+    int ents_allocd;
+
+    pso_io_queue_t *q;
+
+    /* Only used when updating an existing archive (aside from data_start). */
+    struct pso_update up;
 };
 
 static off_t pad_file(int fd, int boundary) {
@@ -60,6 +110,595 @@ static off_t pad_file(int fd, int boundary) {
     return pos;
 }
 
+/* Write the table of contents entry for a file, the file's data, and the
+   padding after it all at once on the writer's I/O queue, rather than seeking
+   around and writing them one by one. */
+static pso_error_t write_entry(pso_afs_write_t *a, uint8_t *hdr,
+                               size_t hdr_len, const uint8_t *data,
+                               uint32_t len) {
+    off_t end;
+    pso_error_t rv;
+
+    rv = pso_io_queue_write_file(&a->q, a->fd, hdr, hdr_len, a->ftab_pos,
+                                 data, len, a->data_pos, &end);
+    if(rv != PSOARCHIVE_OK)
+        return rv;
+
+    a->ftab_pos += hdr_len;
+    a->data_pos = end;
+    ++a->ftab_used;
+
+    return PSOARCHIVE_OK;
+}
+
+/* Fill in the date and size in a filename table entry. */
+static void set_name_info(uint8_t *ent, uint32_t len, time_t mtime) {
+    struct tm *t;
+#ifndef _WIN32
+    struct tm tmbuf;
+#endif
+
+    memset(ent + NAME_LEN, 0, NAME_ENTRY_LEN - NAME_LEN);
+
+#ifndef _WIN32
+    t = localtime_r(&mtime, &tmbuf);
+#else
+    t = localtime(&mtime);
+#endif
+
+    if(t) {
+        ent[32] = (uint8_t)(t->tm_year + 1900);
+        ent[33] = (uint8_t)((t->tm_year + 1900) >> 8);
+        ent[34] = (uint8_t)(t->tm_mon + 1);
+        ent[36] = (uint8_t)(t->tm_mday);
+        ent[38] = (uint8_t)(t->tm_hour);
+        ent[40] = (uint8_t)(t->tm_min);
+        ent[42] = (uint8_t)(t->tm_sec);
+    }
+
+    ent[44] = (uint8_t)(len);
+    ent[45] = (uint8_t)(len >> 8);
+    ent[46] = (uint8_t)(len >> 16);
+    ent[47] = (uint8_t)(len >> 24);
+}
+
+static pso_error_t add_name(pso_afs_write_t *a, const char *fn, uint32_t len,
+                            time_t mtime) {
+    uint8_t *ent;
+    void *tmp;
+    int allocd;
+
+    if(!(a->flags & PSO_AFS_NAME_TABLE))
+        return PSOARCHIVE_OK;
+
+    /* Make sure we have space in the array... */
+    if(a->ftab_used == a->names_allocd) {
+        allocd = a->names_allocd ? a->names_allocd * 2 : 256;
+
+        if(!(tmp = realloc(a->names, allocd * NAME_ENTRY_LEN)))
+            return PSOARCHIVE_EMEM;
+
+        a->names = (uint8_t *)tmp;
+        a->names_allocd = allocd;
+    }
+
+    ent = a->names + a->ftab_used * NAME_ENTRY_LEN;
+    memset(ent, 0, NAME_ENTRY_LEN);
+
+    if(fn)
+        strncpy((char *)ent, fn, NAME_LEN);
+
+    set_name_info(ent, len, mtime);
+
+    return PSOARCHIVE_OK;
+}
+
+static pso_error_t write_names(pso_afs_write_t *a) {
+    uint8_t buf[8];
+    size_t len = a->ftab_used * NAME_ENTRY_LEN;
+
+    /* There's no room to say where the table is if the table of contents is
+       completely full. */
+    if(a->ftab_pos + 8 > a->up.data_start)
+        return PSOARCHIVE_OK;
+
+    /* If files were added to an existing archive without a filename table,
+       whatever was after the old table of contents must not look like the
+       position of one. */
+    if(!a->names) {
+        if(!a->up.toc)
+            return PSOARCHIVE_OK;
+
+        memset(buf, 0, 8);
+        return pso_io_pwrite(a->fd, buf, 8, a->ftab_pos);
+    }
+
+    /* The table goes after the last file... */
+    if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    if(write(a->fd, a->names, len) != (ssize_t)len)
+        return PSOARCHIVE_EIO;
+
+    if(pad_file(a->fd, 2048) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    /* ... and where it is goes right after the table of contents. */
+    if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    buf[0] = (uint8_t)(a->data_pos);
+    buf[1] = (uint8_t)(a->data_pos >> 8);
+    buf[2] = (uint8_t)(a->data_pos >> 16);
+    buf[3] = (uint8_t)(a->data_pos >> 24);
+    buf[4] = (uint8_t)(len);
+    buf[5] = (uint8_t)(len >> 8);
+    buf[6] = (uint8_t)(len >> 16);
+    buf[7] = (uint8_t)(len >> 24);
+
+    if(write(a->fd, buf, 8) != 8)
+        return PSOARCHIVE_EIO;
+
+    return PSOARCHIVE_OK;
+}
+
+/****** One-pass archive building (PSO_AFS_BUILD) ******/
+
+static pso_error_t add_entry(pso_afs_write_t *a, uint8_t *data, char *path,
+                             uint32_t len) {
+    void *tmp;
+    int allocd;
+
+    if(a->ftab_used >= MAX_FILES)
+        return PSOARCHIVE_ENOSPC;
+
+    /* Make sure we have space in the array... */
+    if(a->ftab_used == a->ents_allocd) {
+        allocd = a->ents_allocd ? a->ents_allocd * 2 : 256;
+
+        if(!(tmp = realloc(a->ents, allocd * sizeof(struct afs_entry))))
+            return PSOARCHIVE_EMEM;
+
+        a->ents = (struct afs_entry *)tmp;
+        a->ents_allocd = allocd;
+    }
+
+    a->ents[a->ftab_used].data = data;
+    a->ents[a->ftab_used].path = path;
+    a->ents[a->ftab_used].len = len;
+    ++a->ftab_used;
+
+    return PSOARCHIVE_OK;
+}
+
+static void free_entries(pso_afs_write_t *a) {
+    int i;
+
+    for(i = 0; i < a->ftab_used && a->ents; ++i) {
+        free(a->ents[i].data);
+        free(a->ents[i].path);
+    }
+
+    free(a->ents);
+    a->ents = NULL;
+}
+
+static pso_error_t out_flush(struct out_buf *o) {
+    pso_error_t rv;
+
+    if(!o->used)
+        return PSOARCHIVE_OK;
+
+    rv = pso_io_write(o->fd, o->buf, o->used);
+    o->used = 0;
+    return rv;
+}
+
+static pso_error_t out_data(struct out_buf *o, const uint8_t *data,
+                            size_t len) {
+    pso_error_t rv;
+    size_t amt;
+
+    /* Big things go straight out, rather than through the buffer. */
+    if(len >= OUT_CHUNK) {
+        if((rv = out_flush(o)) != PSOARCHIVE_OK)
+            return rv;
+
+        return pso_io_write(o->fd, data, len);
+    }
+
+    while(len) {
+        if(o->used == OUT_CHUNK && (rv = out_flush(o)) != PSOARCHIVE_OK)
+            return rv;
+
+        amt = OUT_CHUNK - o->used;
+        if(amt > len)
+            amt = len;
+
+        if(data) {
+            memcpy(o->buf + o->used, data, amt);
+            data += amt;
+        }
+        else {
+            memset(o->buf + o->used, 0, amt);
+        }
+
+        o->used += amt;
+        len -= amt;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+static pso_error_t out_file(struct out_buf *o, const char *fn, uint32_t len) {
+    int fd;
+    size_t amt;
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    if((fd = open(fn, O_RDONLY)) < 0)
+        return PSOARCHIVE_EFILE;
+
+    pso_io_advise(fd, PSO_IO_SEQUENTIAL);
+
+    /* Read the file straight into the output buffer. */
+    while(len) {
+        if(o->used == OUT_CHUNK && (rv = out_flush(o)) != PSOARCHIVE_OK)
+            break;
+
+        amt = OUT_CHUNK - o->used;
+        if(amt > len)
+            amt = len;
+
+        /* The file shouldn't have gotten any shorter since it was added. */
+        if(pso_io_read(fd, o->buf + o->used, amt) != (ssize_t)amt) {
+            rv = PSOARCHIVE_EIO;
+            break;
+        }
+
+        o->used += amt;
+        len -= (uint32_t)amt;
+    }
+
+    close(fd);
+    return rv;
+}
+
+static void put32(uint8_t *buf, uint32_t val) {
+    buf[0] = (uint8_t)(val);
+    buf[1] = (uint8_t)(val >> 8);
+    buf[2] = (uint8_t)(val >> 16);
+    buf[3] = (uint8_t)(val >> 24);
+}
+
+/* Write out the whole archive front to back. Since we know the size of every
+   file up front, the table of contents only has to be as big as it needs to
+   be, and we never have to seek. */
+static pso_error_t build_archive(pso_afs_write_t *a) {
+    struct out_buf o;
+    uint8_t buf[8];
+    off_t pos, names_pos = 0, toc_len;
+    size_t names_len = 0;
+    int i;
+    pso_error_t rv;
+
+    /* There's always a slot after the table of contents for the position of
+       the filename table. It's left zeroed if there isn't one, so that readers
+       don't take the start of the first file for it. */
+    toc_len = 8 + 8 * (a->ftab_used + 1);
+
+    if(a->names)
+        names_len = a->ftab_used * NAME_ENTRY_LEN;
+
+    /* Figure out where everything goes, and make sure it all fits... */
+    pos = ALIGN(toc_len);
+
+    for(i = 0; i < a->ftab_used; ++i)
+        pos = ALIGN(pos + a->ents[i].len);
+
+    if(a->names) {
+        names_pos = pos;
+        pos = ALIGN(pos + names_len);
+    }
+
+    if(pos > (off_t)0xFFFFFFFF)
+        return PSOARCHIVE_ERANGE;
+
+    o.fd = a->fd;
+    o.used = 0;
+
+    if(!(o.buf = (uint8_t *)malloc(OUT_CHUNK)))
+        return PSOARCHIVE_EMEM;
+
+    /* Header and table of contents... */
+    buf[0] = 0x41;
+    buf[1] = 0x46;
+    buf[2] = 0x53;
+    buf[3] = 0x00;
+    put32(buf + 4, (uint32_t)a->ftab_used);
+
+    if((rv = out_data(&o, buf, 8)) != PSOARCHIVE_OK)
+        goto out;
+
+    pos = ALIGN(toc_len);
+
+    for(i = 0; i < a->ftab_used; ++i) {
+        put32(buf, (uint32_t)pos);
+        put32(buf + 4, a->ents[i].len);
+
+        if((rv = out_data(&o, buf, 8)) != PSOARCHIVE_OK)
+            goto out;
+
+        pos = ALIGN(pos + a->ents[i].len);
+    }
+
+    put32(buf, (uint32_t)names_pos);
+    put32(buf + 4, (uint32_t)names_len);
+
+    if((rv = out_data(&o, buf, 8)) != PSOARCHIVE_OK)
+        goto out;
+
+    pos = toc_len;
+
+    /* ... then the files themselves, padded out to 2048 byte boundaries... */
+    for(i = 0; i < a->ftab_used; ++i) {
+        if((rv = out_data(&o, NULL, ALIGN(pos) - pos)) != PSOARCHIVE_OK)
+            goto out;
+
+        pos = ALIGN(pos);
+
+        if(a->ents[i].path)
+            rv = out_file(&o, a->ents[i].path, a->ents[i].len);
+        else
+            rv = out_data(&o, a->ents[i].data, a->ents[i].len);
+
+        if(rv != PSOARCHIVE_OK)
+            goto out;
+
+        pos += a->ents[i].len;
+    }
+
+    /* ... and the filename table at the end, if there is one. */
+    if(a->names) {
+        if((rv = out_data(&o, NULL, ALIGN(pos) - pos)) != PSOARCHIVE_OK)
+            goto out;
+
+        pos = ALIGN(pos);
+
+        if((rv = out_data(&o, a->names, names_len)) != PSOARCHIVE_OK)
+            goto out;
+
+        pos += names_len;
+    }
+
+    if((rv = out_data(&o, NULL, ALIGN(pos) - pos)) != PSOARCHIVE_OK)
+        goto out;
+
+    rv = out_flush(&o);
+
+out:
+    free(o.buf);
+    return rv;
+}
+
+/****** Updating existing archives (pso_afs_write_open()) ******/
+
+static void encode_toc(uint8_t *buf, uint32_t offset, uint32_t size,
+                       uint32_t flags) {
+    (void)flags;
+    put32(buf, offset);
+    put32(buf + 4, size);
+}
+
+/* Make sure there's room for one more entry in the table of contents, along
+   with the position of the filename table after it. */
+static pso_error_t toc_room(pso_afs_write_t *a) {
+    if(!a->up.toc)
+        return PSOARCHIVE_OK;
+
+    if(a->ftab_used >= MAX_FILES)
+        return PSOARCHIVE_ENOSPC;
+
+    return pso_update_room(&a->up, a->fd, a->ftab_used, a->ftab_pos + 16,
+                           &a->data_pos);
+}
+
+/* Remember where the file about to be added is going. */
+static void toc_add(pso_afs_write_t *a, uint32_t len) {
+    if(a->up.toc)
+        pso_update_add(&a->up, a->ftab_used, a->data_pos, len);
+}
+
+static void load_names(pso_afs_write_t *a, off_t len, uint32_t pos,
+                       uint32_t size) {
+    uint8_t buf[8];
+    size_t want = a->ftab_used * NAME_ENTRY_LEN;
+
+    /* Some archives have the filename table's position at the end of the
+       space reserved for the table of contents, rather than right after it. */
+    if(!pos && !size && a->ftab_used && a->up.data_start >= 16 &&
+       a->up.data_start - 8 >= a->ftab_pos) {
+        if(pso_io_pread(a->fd, buf, 8, a->up.data_start - 8) != 8)
+            return;
+
+        pos = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+        size = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+    }
+
+    if(!pos || !a->ftab_used || size < want || pos > len ||
+       (off_t)want > len - pos)
+        return;
+
+    if(!(a->names = (uint8_t *)malloc(want)))
+        return;
+
+    if(pso_io_pread(a->fd, a->names, want, pos) != (ssize_t)want) {
+        free(a->names);
+        a->names = NULL;
+        return;
+    }
+
+    a->names_allocd = a->ftab_used;
+}
+
+pso_afs_write_t *pso_afs_write_open_fd(int fd, uint32_t flags,
+                                       pso_error_t *err) {
+    pso_afs_write_t *rv;
+    pso_error_t erv = PSOARCHIVE_EFATAL;
+    uint8_t *toc, buf[8];
+    uint32_t i, files, offset, size;
+    off_t len, end = 0;
+
+    /* This only makes sense on an archive that's already been written. */
+    if((flags & PSO_AFS_BUILD))
+        goto ret_err;
+
+    if((len = lseek(fd, 0, SEEK_END)) == (off_t)-1) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_err;
+    }
+
+    /* Make sure it is an AFS archive, and get the number of files... */
+    if(pso_io_pread(fd, buf, 8, 0) != 8 || buf[0] != 0x41 || buf[1] != 0x46 ||
+       buf[2] != 0x53 || buf[3] != 0x00) {
+        erv = PSOARCHIVE_NOARCHIVE;
+        goto ret_err;
+    }
+
+    files = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+    if(files > MAX_FILES)
+        goto ret_err;
+
+    /* Allocate space for our write context. */
+    if(!(rv = (pso_afs_write_t *)malloc(sizeof(pso_afs_write_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    rv->up.ent_pos = 8;
+    rv->up.ent_len = 8;
+    rv->up.flags = 0;
+    rv->up.encode = &encode_toc;
+    pso_update_alloc(&rv->up, files);
+    toc = (uint8_t *)malloc(8 * (files + 1));
+
+    if(!rv->up.toc || !toc) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_toc;
+    }
+
+    /* Read the table of contents, along with the position of the filename
+       table right after it. */
+    memset(toc, 0, 8 * (files + 1));
+
+    if(pso_io_pread(fd, toc, 8 * (files + 1), 8) < (ssize_t)(8 * files)) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_toc;
+    }
+
+    for(i = 0; i < files; ++i) {
+        offset = toc[i * 8] | (toc[i * 8 + 1] << 8) |
+            (toc[i * 8 + 2] << 16) | ((uint32_t)toc[i * 8 + 3] << 24);
+        size = toc[i * 8 + 4] | (toc[i * 8 + 5] << 8) |
+            (toc[i * 8 + 6] << 16) | ((uint32_t)toc[i * 8 + 7] << 24);
+
+        /* Make sure it looks sane... */
+        if(offset > len || size > len - offset) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_toc;
+        }
+
+        rv->up.toc[i].offset = offset;
+        rv->up.toc[i].size = size;
+
+        if((off_t)offset + size > end)
+            end = (off_t)offset + size;
+    }
+
+    /* New files go after the last one in the archive. */
+    rv->fd = fd;
+    rv->ftab_used = (int)files;
+    rv->ftab_pos = 8 + 8 * (off_t)files;
+    rv->data_pos = ALIGN(end);
+    pso_update_loaded(&rv->up, (int)files, rv->data_pos);
+    rv->names = NULL;
+    rv->names_allocd = 0;
+    rv->ents = NULL;
+    rv->ents_allocd = 0;
+    rv->q = NULL;
+
+    /* If there aren't any files with data in them, start the data where a new
+       archive would. */
+    if(rv->up.data_start == rv->data_pos && rv->data_pos < DATA_START)
+        rv->up.data_start = rv->data_pos = DATA_START;
+
+    /* Keep the filename table, if there is one. It gets written back out after
+       the last file when the archive is closed. */
+    i = files * 8;
+    load_names(rv, len, toc[i] | (toc[i + 1] << 8) | (toc[i + 2] << 16) |
+               ((uint32_t)toc[i + 3] << 24), toc[i + 4] | (toc[i + 5] << 8) |
+               (toc[i + 6] << 16) | ((uint32_t)toc[i + 7] << 24));
+
+    if(rv->names)
+        rv->flags = flags | PSO_AFS_NAME_TABLE;
+    else
+        rv->flags = flags & ~PSO_AFS_NAME_TABLE;
+
+    free(toc);
+
+    /* We're done, return success. */
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_toc:
+    free(toc);
+    pso_update_free(&rv->up);
+    free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_afs_write_t *pso_afs_write_open(const char *fn, uint32_t flags,
+                                    pso_error_t *err) {
+    pso_afs_write_t *rv;
+    int fd;
+
+    /* Open the file... */
+    if((fd = open(fn, O_RDWR)) < 0) {
+        if(err)
+            *err = PSOARCHIVE_EFILE;
+
+        return NULL;
+    }
+
+    if(!(rv = pso_afs_write_open_fd(fd, flags, err)))
+        close(fd);
+
+    return rv;
+}
+
+pso_error_t pso_afs_write_replace(pso_afs_write_t *a, uint32_t hnd,
+                                  const uint8_t *data, uint32_t len) {
+    pso_error_t rv;
+
+    if(!a || !a->up.toc || hnd >= (uint32_t)a->ftab_used || (!data && len))
+        return PSOARCHIVE_EFATAL;
+
+    rv = pso_update_replace(&a->up, &a->q, a->fd, a->ftab_used, &a->data_pos,
+                            hnd, data, len);
+    if(rv != PSOARCHIVE_OK)
+        return rv;
+
+    if(a->names)
+        set_name_info(a->names + hnd * NAME_ENTRY_LEN, len, time(NULL));
+
+    return PSOARCHIVE_OK;
+}
+
 pso_afs_write_t *pso_afs_new(const char *fn, uint32_t flags, pso_error_t *err) {
     pso_afs_write_t *rv;
     pso_error_t erv = PSOARCHIVE_OK;
@@ -79,8 +718,15 @@ pso_afs_write_t *pso_afs_new(const char *fn, uint32_t flags, pso_error_t *err) {
     /* Fill in the base structure with our defaults. */
     rv->ftab_used = 0;
     rv->ftab_pos = 8;
-    rv->data_pos = 0x80000;
+    rv->data_pos = DATA_START;
     rv->flags = flags;
+    rv->names = NULL;
+    rv->names_allocd = 0;
+    rv->ents = NULL;
+    rv->q = NULL;
+    rv->up.toc = NULL;
+    rv->up.data_start = DATA_START;
+    rv->ents_allocd = 0;
 
     /* We're done, return success. */
     if(err)
@@ -111,8 +757,15 @@ pso_afs_write_t *pso_afs_new_fd(int fd, uint32_t flags, pso_error_t *err) {
     rv->fd = fd;
     rv->ftab_used = 0;
     rv->ftab_pos = 8;
-    rv->data_pos = 0x80000;
+    rv->data_pos = DATA_START;
     rv->flags = flags;
+    rv->names = NULL;
+    rv->names_allocd = 0;
+    rv->ents = NULL;
+    rv->q = NULL;
+    rv->up.toc = NULL;
+    rv->up.data_start = DATA_START;
+    rv->ents_allocd = 0;
 
     /* We're done, return success. */
     if(err)
@@ -129,10 +782,29 @@ ret_err:
 
 pso_error_t pso_afs_write_close(pso_afs_write_t *a) {
     uint8_t buf[8];
+    pso_error_t rv;
 
     if(!a || a->fd < 0)
         return PSOARCHIVE_EFATAL;
 
+    /* If we've been collecting everything up to write at the end, then now is
+       the time to do it. */
+    if((a->flags & PSO_AFS_BUILD)) {
+        if((rv = build_archive(a)) != PSOARCHIVE_OK)
+            return rv;
+
+        close(a->fd);
+        free_entries(a);
+        free(a->names);
+        free(a);
+
+        return PSOARCHIVE_OK;
+    }
+
+    /* Write the filename table out, if we're making one. */
+    if((rv = write_names(a)) != PSOARCHIVE_OK)
+        return rv;
+
     /* Put the header at the beginning of the file. */
     if(lseek(a->fd, 0, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
@@ -149,24 +821,43 @@ pso_error_t pso_afs_write_close(pso_afs_write_t *a) {
     if(write(a->fd, buf, 8) != 8)
         return PSOARCHIVE_EIO;
 
+    if(a->q)
+        pso_io_queue_free(a->q);
+
     close(a->fd);
+    free(a->names);
+    pso_update_free(&a->up);
     free(a);
 
     return PSOARCHIVE_OK;
 }
 
-pso_error_t pso_afs_write_add(pso_afs_write_t *a, const char *fn,
-                              const uint8_t *data, uint32_t len) {
+static pso_error_t add_data(pso_afs_write_t *a, const char *fn,
+                            const uint8_t *data, uint32_t len, time_t mtime) {
     uint8_t buf[8];
+    uint8_t *copy;
+    pso_error_t rv;
 
-    (void)fn;
+    if((rv = add_name(a, fn, len, mtime)) != PSOARCHIVE_OK)
+        return rv;
 
-    if(!a)
-        return PSOARCHIVE_EFATAL;
+    /* Hang onto a copy of the data until the archive gets written out. */
+    if((a->flags & PSO_AFS_BUILD)) {
+        if(!(copy = (uint8_t *)malloc(len ? len : 1)))
+            return PSOARCHIVE_EMEM;
 
-    /* Go to where we'll be writing into the file table... */
-    if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
+        memcpy(copy, data, len);
+
+        if((rv = add_entry(a, copy, NULL, len)) != PSOARCHIVE_OK)
+            free(copy);
+
+        return rv;
+    }
+
+    if((rv = toc_room(a)) != PSOARCHIVE_OK)
+        return rv;
+
+    toc_add(a, len);
 
     /* Copy the file data into the buffer... */
     buf[0] = (uint8_t)(a->data_pos);
@@ -178,38 +869,58 @@ pso_error_t pso_afs_write_add(pso_afs_write_t *a, const char *fn,
     buf[6] = (uint8_t)(len >> 16);
     buf[7] = (uint8_t)(len >> 24);
 
-    /* Write out the header... */
-    if(write(a->fd, buf, 8) != 8)
-        return PSOARCHIVE_EIO;
-
-    a->ftab_pos += 8;
-    ++a->ftab_used;
-
-    /* Seek to where the file data goes... */
-    if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
-
-    /* Write the file data out. */
-    if(write(a->fd, data, len) != (ssize_t)len)
-        return PSOARCHIVE_EIO;
+    /* Write out the header and the data. */
+    return write_entry(a, buf, 8, data, len);
+}
 
-    /* Pad the data position out to where the next file will start. */
-    a->data_pos = pad_file(a->fd, 2048);
+pso_error_t pso_afs_write_add(pso_afs_write_t *a, const char *fn,
+                              const uint8_t *data, uint32_t len) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
 
-    /* Done. */
-    return PSOARCHIVE_OK;
+    return add_data(a, fn, data, len, time(NULL));
 }
 
 pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
                                  uint32_t len) {
-    uint8_t buf[512];
-    ssize_t bytes;
-
-    (void)fn;
+    uint8_t buf[8];
+    uint8_t *copy;
+    struct stat st;
+    pso_error_t rv;
 
     if(!a)
         return PSOARCHIVE_EFATAL;
 
+    /* Use the modification time of the file for the filename table, if we can
+       figure it out. */
+    if(fstat(fd, &st))
+        st.st_mtime = time(NULL);
+
+    if((rv = add_name(a, fn, len, st.st_mtime)) != PSOARCHIVE_OK)
+        return rv;
+
+    /* The fd might not be around by the time the archive gets written out, so
+       read the whole file in now. */
+    if((a->flags & PSO_AFS_BUILD)) {
+        if(!(copy = (uint8_t *)malloc(len ? len : 1)))
+            return PSOARCHIVE_EMEM;
+
+        if(pso_io_read(fd, copy, len) != (ssize_t)len) {
+            free(copy);
+            return PSOARCHIVE_EIO;
+        }
+
+        if((rv = add_entry(a, copy, NULL, len)) != PSOARCHIVE_OK)
+            free(copy);
+
+        return rv;
+    }
+
+    if((rv = toc_room(a)) != PSOARCHIVE_OK)
+        return rv;
+
+    toc_add(a, len);
+
     /* Go to where we'll be writing into the file table... */
     if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
@@ -235,19 +946,9 @@ pso_error_t pso_afs_write_add_fd(pso_afs_write_t *a, const char *fn, int fd,
     if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
 
-    /* While there's still data to be read from the file, read it into our
-       buffer and write it out to the file. */
-    while(len) {
-        bytes = len > 512 ? 512 : len;
-
-        if(read(fd, buf, bytes) != bytes)
-            return PSOARCHIVE_EIO;
-
-        if(write(a->fd, buf, bytes) != bytes)
-            return PSOARCHIVE_EIO;
-
-        len -= bytes;
-    }
+    /* Copy the data over from the file. */
+    if((rv = pso_io_copy(a->fd, fd, len)) != PSOARCHIVE_OK)
+        return rv;
 
     /* Pad the data position out to where the next file will start. */
     a->data_pos = pad_file(a->fd, 2048);
@@ -261,6 +962,31 @@ pso_error_t pso_afs_write_add_file(pso_afs_write_t *a, const char *afn,
     int fd;
     pso_error_t err;
     off_t len;
+    struct stat st;
+    char *path;
+
+    /* When building the archive in one go, don't read the file until it is
+       time to write it out. */
+    if(a && (a->flags & PSO_AFS_BUILD)) {
+        if(stat(fn, &st))
+            return PSOARCHIVE_EFILE;
+
+        if(st.st_size > (off_t)0xFFFFFFFF)
+            return PSOARCHIVE_ERANGE;
+
+        if(!(path = strdup(fn)))
+            return PSOARCHIVE_EMEM;
+
+        err = add_name(a, afn, (uint32_t)st.st_size, st.st_mtime);
+
+        if(err == PSOARCHIVE_OK)
+            err = add_entry(a, NULL, path, (uint32_t)st.st_size);
+
+        if(err != PSOARCHIVE_OK)
+            free(path);
+
+        return err;
+    }
 
     /* Open the file. */
     if((fd = open(fn, O_RDONLY)) < 0)
@@ -284,3 +1010,22 @@ pso_error_t pso_afs_write_add_file(pso_afs_write_t *a, const char *afn,
     close(fd);
     return err;
 }
+
+static pso_error_t batch_add(void *a, const char *fn, const uint8_t *data,
+                             uint32_t len, time_t mtime) {
+    return add_data((pso_afs_write_t *)a, fn, data, len, mtime);
+}
+
+static pso_error_t batch_add_file(void *a, const char *afn, const char *fn) {
+    return pso_afs_write_add_file((pso_afs_write_t *)a, afn, fn);
+}
+
+pso_error_t pso_afs_write_add_batch(pso_afs_write_t *a,
+                                   const pso_build_item_t *items, size_t count,
+                                   int threads, size_t max_bytes) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return pso_build_run(items, count, threads, max_bytes, &batch_add,
+                         &batch_add_file, a);
+}
@@ -24,26 +24,71 @@
 
 #include <fcntl.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 #ifndef _WIN32
 #include <unistd.h>
 #endif
 
 #include "GSL-common.h"
+#include "io-common.h"
+#include "extract-common.h"
+
+#ifdef HAVE_PTHREAD_H
+#define LOCK_INIT(s)    pthread_mutex_init(&(s)->lock, NULL)
+#define LOCK_FREE(s)    pthread_mutex_destroy(&(s)->lock)
+#define LOCK(s)         pthread_mutex_lock(&(s)->lock)
+#define UNLOCK(s)       pthread_mutex_unlock(&(s)->lock)
+#else
+#define LOCK_INIT(s)    0
+#define LOCK_FREE(s)    (void)0
+#define LOCK(s)         (void)0
+#define UNLOCK(s)       (void)0
+#endif
+
+/* How much of the start of the archive to read in at first when looking for
+   the table of contents. If the table is bigger than this, the amount read is
+   doubled until it all fits. */
+#define TOC_CHUNK   0x800
+
+/* The parts of an open archive that are shared between a handle and all of
+   its clones. The last handle to be closed cleans up the archive. */
+struct gsl_shared {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+    int refs;
+};
 
+/* Everything in here is set up when the archive is opened and never changed
+   afterwards, so one handle (or its clones) can be read on several threads at
+   once. */
 struct pso_gsl_read {
     int fd;
     struct gsl_file *files;
+    struct gsl_shared *shared;
 
     uint32_t file_count;
     uint32_t flags;
 };
 
+static uint32_t get32(const uint8_t *buf, uint32_t flags) {
+    if((flags & PSO_GSL_BIG_ENDIAN))
+        return (buf[3]) | (buf[2] << 8) | (buf[1] << 16) | (buf[0] << 24);
+    else
+        return (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | (buf[0]);
+}
+
 pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
                                      pso_error_t *err) {
     pso_gsl_read_t *rv;
     pso_error_t erv = PSOARCHIVE_EFATAL;
-    uint32_t i, allocd = 256, offset, size, maxfiles;
-    uint8_t buf[48];
+    uint32_t i, count, offset, size, maxfiles;
+    uint8_t *toc, *ent;
+    size_t allocd = TOC_CHUNK, have, want;
+    ssize_t bytes;
     void *tmp;
 
     /* Allocate our archive handle... */
@@ -52,103 +97,119 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
         goto ret_err;
     }
 
-    /* Allocate some file handles... */
-    rv->files = (struct gsl_file *)malloc(sizeof(struct gsl_file) * 256);
-    if(!rv->files) {
+    if(!(rv->shared = (struct gsl_shared *)malloc(sizeof(struct gsl_shared)))) {
         erv = PSOARCHIVE_EMEM;
         goto ret_handle;
     }
 
-    /* Read the first header in... */
-    if(read(fd, buf, 48) != 48) {
+    if(LOCK_INIT(rv->shared)) {
+        erv = PSOARCHIVE_EFATAL;
+        goto ret_shared;
+    }
+
+    rv->shared->refs = 1;
+
+    /* Read the start of the file in. In most archives, the whole table of
+       contents will fit in this. */
+    if(!(toc = (uint8_t *)malloc(allocd))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_lock;
+    }
+
+    if((bytes = pso_io_pread(fd, toc, allocd, 0)) < 48) {
         erv = PSOARCHIVE_NOARCHIVE;
-        goto ret_files;
+        goto ret_toc;
     }
 
+    have = (size_t)bytes;
+
     /* Make sure there's at least one file... */
-    if(buf[0] == 0) {
+    if(toc[0] == 0) {
         erv = PSOARCHIVE_EMPTY;
-        goto ret_files;
+        goto ret_toc;
     }
 
     /* If the user hasn't specified the endianness, then try to guess. */
     if(!(flags & GSL_ENDIANNESS)) {
         /* Guess big endian first. */
-        offset = (buf[35]) | (buf[34] << 8) | (buf[33] << 16) | (buf[32] << 24);
-        size = (buf[39]) | (buf[38] << 8) | ( buf[37] << 16) | (buf[36] << 24);
+        offset = get32(toc + 32, PSO_GSL_BIG_ENDIAN);
+        size = get32(toc + 36, PSO_GSL_BIG_ENDIAN);
 
         flags |= PSO_GSL_BIG_ENDIAN;
 
         /* If the offset of the file is outside of the archive length, the
            we probably guessed wrong, try as little endian. */
         if(offset > len || offset * 2048 > len || size > len) {
-            offset = (buf[35] << 24) | (buf[34] << 16) | (buf[33] << 8) |
-                (buf[32]);
-            size = (buf[39] << 24) | (buf[38] << 16) | ( buf[37] << 8) |
-                (buf[36]);
-            flags |= PSO_GSL_LITTLE_ENDIAN;
+            offset = get32(toc + 32, PSO_GSL_LITTLE_ENDIAN);
+            size = get32(toc + 36, PSO_GSL_LITTLE_ENDIAN);
+            flags = (flags & ~PSO_GSL_BIG_ENDIAN) | PSO_GSL_LITTLE_ENDIAN;
 
             if(offset * 2048 > len || size > len) {
                 erv = PSOARCHIVE_ERANGE;
-                goto ret_files;
+                goto ret_toc;
             }
         }
     }
-    else if((flags & PSO_GSL_BIG_ENDIAN)) {
-        offset = (buf[35]) | (buf[34] << 8) | (buf[33] << 16) | (buf[32] << 24);
-        size = (buf[39]) | (buf[38] << 8) | ( buf[37] << 16) | (buf[36] << 24);
-    }
-    else /* if((flags & PSO_GSL_LITTLE_ENDIAN)) */ {
-        offset = (buf[35] << 24) | (buf[34] << 16) | (buf[33] << 8) | (buf[32]);
-        size = (buf[39] << 24) | (buf[38] << 16) | ( buf[37] << 8) | (buf[36]);
+    else {
+        offset = get32(toc + 32, flags);
     }
 
-    memcpy(rv->files[0].filename, buf, 32);
-    rv->files[0].offset = offset * 2048;
-    rv->files[0].size = size;
-    maxfiles = rv->files[0].offset / 48;
-
-    /* Read the headers for each file... */
-    for(i = 1; i < maxfiles; ++i) {
-        /* Read in the header... */
-        if(read(fd, buf, 48) != 48) {
-            erv = PSOARCHIVE_EIO;
-            goto ret_files;
-        }
+    maxfiles = offset * 2048 / 48;
+
+    /* Find the end of the file list, reading more of the table in if it didn't
+       all fit in what we read above. */
+    for(count = 1; count < maxfiles; ++count) {
+        if((count + 1) * 48 > have) {
+            /* If the last read came up short, we've hit the end of the file
+               in the middle of the list. */
+            if(have < allocd) {
+                erv = PSOARCHIVE_EIO;
+                goto ret_toc;
+            }
 
-        /* Did we hit the end of the file list? */
-        if(buf[0] == 0)
-            break;
+            want = allocd * 2;
+            if(want > (size_t)maxfiles * 48)
+                want = (size_t)maxfiles * 48;
 
-        /* Parse out the size/offset. */
-        if((flags & PSO_GSL_BIG_ENDIAN)) {
-            offset = (buf[35]) | (buf[34] << 8) | (buf[33] << 16) |
-                (buf[32] << 24);
-            size = (buf[39]) | (buf[38] << 8) | ( buf[37] << 16) |
-                (buf[36] << 24);
-        }
-        else /* if((flags & PSO_GSL_LITTLE_ENDIAN)) */ {
-            offset = (buf[35] << 24) | (buf[34] << 16) | (buf[33] << 8) |
-                (buf[32]);
-            size = (buf[39] << 24) | (buf[38] << 16) | ( buf[37] << 8) |
-                (buf[36]);
-        }
+            if(!(tmp = realloc(toc, want))) {
+                erv = PSOARCHIVE_EMEM;
+                goto ret_toc;
+            }
 
-        /* Make sure we have space in the array... */
-        if(i == allocd) {
-            allocd *= 2;
+            toc = (uint8_t *)tmp;
+            allocd = want;
 
-            if(!(tmp = realloc(rv->files, allocd * sizeof(struct gsl_file)))) {
-                erv = PSOARCHIVE_EMEM;
-                goto ret_files;
+            if((bytes = pso_io_pread(fd, toc + have, allocd - have,
+                                     (off_t)have)) < 0) {
+                erv = PSOARCHIVE_EIO;
+                goto ret_toc;
             }
 
-            rv->files = (struct gsl_file *)tmp;
+            have += (size_t)bytes;
+
+            if((count + 1) * 48 > have) {
+                erv = PSOARCHIVE_EIO;
+                goto ret_toc;
+            }
         }
 
-        memcpy(rv->files[i].filename, buf, 32);
-        rv->files[i].offset = offset * 2048;
-        rv->files[i].size = size;
+        /* Did we hit the end of the file list? */
+        if(toc[count * 48] == 0)
+            break;
+    }
+
+    /* Now that we know how many files there are, allocate the file handles and
+       parse the whole table out in one pass. */
+    rv->files = (struct gsl_file *)malloc(sizeof(struct gsl_file) * count);
+    if(!rv->files) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_toc;
+    }
+
+    for(i = 0, ent = toc; i < count; ++i, ent += 48) {
+        memcpy(rv->files[i].filename, ent, 32);
+        rv->files[i].offset = get32(ent + 32, flags) * 2048;
+        rv->files[i].size = get32(ent + 36, flags);
 
         /* Sanity check... */
         if(rv->files[i].offset + rv->files[i].size > len) {
@@ -157,19 +218,13 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
         }
     }
 
-    /* Set the file count in the handle and shrink the files array... */
+    free(toc);
+
+    /* Set the file count in the handle... */
     rv->fd = fd;
-    rv->file_count = i;
+    rv->file_count = count;
     rv->flags = flags;
 
-    if(i != allocd) {
-        /* Don't fail if we can't do the realloc... It'll just waste a bit of
-           memory... Won't really hurt anything, though... */
-        if((tmp = realloc(rv->files, i * sizeof(struct gsl_file))))
-            rv->files = (struct gsl_file *)tmp;
-
-    }
-
     /* We're done, return... */
     if(err)
         *err = PSOARCHIVE_OK;
@@ -178,6 +233,12 @@ pso_gsl_read_t *pso_gsl_read_open_fd(int fd, uint32_t len, uint32_t flags,
 
 ret_files:
     free(rv->files);
+ret_toc:
+    free(toc);
+ret_lock:
+    LOCK_FREE(rv->shared);
+ret_shared:
+    free(rv->shared);
 ret_handle:
     free(rv);
 ret_err:
@@ -195,7 +256,7 @@ pso_gsl_read_t *pso_gsl_read_open(const char *fn, uint32_t flags,
     pso_gsl_read_t *rv;
 
     /* Open the file... */
-    if(!(fd = open(fn, O_RDONLY))) {
+    if((fd = open(fn, O_RDONLY)) < 0) {
         erv = PSOARCHIVE_EFILE;
         goto ret_err;
     }
@@ -229,12 +290,55 @@ ret_err:
     return NULL;
 }
 
+pso_gsl_read_t *pso_gsl_read_clone(pso_gsl_read_t *a, pso_error_t *err) {
+    pso_gsl_read_t *rv;
+
+    if(!a) {
+        if(err)
+            *err = PSOARCHIVE_EFATAL;
+
+        return NULL;
+    }
+
+    if(!(rv = (pso_gsl_read_t *)malloc(sizeof(pso_gsl_read_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    /* The clone shares everything with the original, so all we have to do is
+       copy the handle and take another reference to the archive. */
+    memcpy(rv, a, sizeof(pso_gsl_read_t));
+
+    LOCK(a->shared);
+    ++a->shared->refs;
+    UNLOCK(a->shared);
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
 pso_error_t pso_gsl_read_close(pso_gsl_read_t *a) {
+    int refs;
+
     if(!a || a->fd < 0 || !a->files)
         return PSOARCHIVE_EFATAL;
 
-    close(a->fd);
-    free(a->files);
+    LOCK(a->shared);
+    refs = --a->shared->refs;
+    UNLOCK(a->shared);
+
+    /* Only clean up the archive itself once the last handle to it goes. */
+    if(!refs) {
+        LOCK_FREE(a->shared);
+        free(a->shared);
+        close(a->fd);
+        free(a->files);
+    }
+
     free(a);
 
     return PSOARCHIVE_OK;
@@ -284,20 +388,86 @@ ssize_t pso_gsl_file_size(pso_gsl_read_t *a, uint32_t hnd) {
 
 ssize_t pso_gsl_file_read(pso_gsl_read_t *a, uint32_t hnd, uint8_t *buf,
                           size_t len) {
-    /* Make sure the arguments are sane... */
-    if(!a || hnd > a->file_count || !buf || !len)
-        return -1;
+    ssize_t rv;
 
-    /* Seek to the appropriate position in the file. */
-    if(lseek(a->fd, a->files[hnd].offset, SEEK_SET) == (off_t) -1)
+    /* Make sure the arguments are sane... */
+    if(!a || hnd >= a->file_count || !buf || !len)
         return -1;
 
     /* Figure out how much we're going to read... */
     if(a->files[hnd].size < len)
         len = a->files[hnd].size;
 
-    if(read(a->fd, buf, len) != len)
+    /* Read from the file at the right position. With pread(), this doesn't
+       touch the file position, so other threads can be reading at the same
+       time. Without it, every handle to the archive shares the position, so
+       they have to take turns. */
+#ifndef HAVE_PREAD
+    LOCK(a->shared);
+#endif
+
+    rv = pso_io_pread(a->fd, buf, len, (off_t)a->files[hnd].offset);
+
+#ifndef HAVE_PREAD
+    UNLOCK(a->shared);
+#endif
+
+    if(rv != (ssize_t)len)
         return -1;
 
     return (ssize_t)len;
 }
+
+static int submit_info(void *d, uint32_t hnd, off_t *off, uint32_t *size) {
+    pso_gsl_read_t *a = (pso_gsl_read_t *)d;
+
+    if(hnd >= a->file_count)
+        return -1;
+
+    *off = (off_t)a->files[hnd].offset;
+    *size = a->files[hnd].size;
+    return 0;
+}
+
+pso_error_t pso_gsl_read_submit(pso_io_queue_t *q, pso_gsl_read_t *a,
+                                pso_read_req_t *reqs, size_t count) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return pso_io_queue_read_files(q, a->fd, reqs, count, &submit_info, a);
+}
+
+static ssize_t extract_read(void *a, uint32_t hnd, uint8_t *buf, size_t len) {
+    return pso_gsl_file_read((pso_gsl_read_t *)a, hnd, buf, len);
+}
+
+static pso_error_t extract_name(void *a, uint32_t hnd, char *fn, size_t len) {
+    return pso_gsl_file_name((pso_gsl_read_t *)a, hnd, fn, len);
+}
+
+pso_error_t pso_gsl_extract_all(pso_gsl_read_t *a, const char *dir,
+                               uint32_t flags, int threads) {
+    struct pso_extract_ent *ents;
+    uint32_t i;
+    pso_error_t rv;
+
+    if(!a || !dir)
+        return PSOARCHIVE_EFATAL;
+
+    ents = (struct pso_extract_ent *)malloc(sizeof(struct pso_extract_ent) *
+                                            (a->file_count + 1));
+    if(!ents)
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < a->file_count; ++i) {
+        ents[i].hnd = i;
+        ents[i].offset = a->files[i].offset;
+        ents[i].size = a->files[i].size;
+    }
+
+    rv = pso_extract_run(ents, a->file_count, dir, flags, threads,
+                         &extract_read, NULL, &extract_name, a);
+
+    free(ents);
+    return rv;
+}
@@ -29,6 +29,12 @@
 #endif
 
 #include "GSL-common.h"
+#include "io-common.h"
+#include "build-common.h"
+#include "update-common.h"
+
+/* The most files that can be put in an archive being updated. */
+#define MAX_FILES       65535
 
 struct pso_gsl_write {
     int fd;
@@ -40,6 +46,11 @@ struct pso_gsl_write {
 
     off_t ftab_pos;
     off_t data_pos;
+
+    pso_io_queue_t *q;
+
+    /* Only used when updating an existing archive. */
+    struct pso_update up;
 };
 
 static off_t pad_file(int fd, int boundary) {
@@ -61,6 +72,234 @@ static off_t pad_file(int fd, int boundary) {
     return pos;
 }
 
+/* Write the file table entry for a file, the file's data, and the padding
+   after it all at once on the writer's I/O queue, rather than seeking around
+   and writing them one by one. */
+static pso_error_t write_entry(pso_gsl_write_t *a, uint8_t *hdr,
+                               size_t hdr_len, const uint8_t *data,
+                               uint32_t len) {
+    off_t end;
+    pso_error_t rv;
+
+    rv = pso_io_queue_write_file(&a->q, a->fd, hdr, hdr_len, a->ftab_pos,
+                                 data, len, a->data_pos, &end);
+    if(rv != PSOARCHIVE_OK)
+        return rv;
+
+    a->ftab_pos += hdr_len;
+    a->data_pos = end;
+    ++a->ftab_used;
+
+    return PSOARCHIVE_OK;
+}
+
+static uint32_t get32(const uint8_t *buf, uint32_t flags) {
+    if((flags & PSO_GSL_BIG_ENDIAN))
+        return (buf[3]) | (buf[2] << 8) | (buf[1] << 16) |
+            ((uint32_t)buf[0] << 24);
+    else
+        return ((uint32_t)buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) |
+            (buf[0]);
+}
+
+static void put32(uint8_t *buf, uint32_t val, uint32_t flags) {
+    if((flags & PSO_GSL_BIG_ENDIAN)) {
+        buf[0] = (uint8_t)(val >> 24);
+        buf[1] = (uint8_t)(val >> 16);
+        buf[2] = (uint8_t)(val >> 8);
+        buf[3] = (uint8_t)(val);
+    }
+    else {
+        buf[0] = (uint8_t)(val);
+        buf[1] = (uint8_t)(val >> 8);
+        buf[2] = (uint8_t)(val >> 16);
+        buf[3] = (uint8_t)(val >> 24);
+    }
+}
+
+/****** Updating existing archives (pso_gsl_write_open()) ******/
+
+/* Put where a file is into its file table entry. The name is left alone. */
+static void encode_toc(uint8_t *buf, uint32_t offset, uint32_t size,
+                       uint32_t flags) {
+    put32(buf, offset >> 11, flags);
+    put32(buf + 4, size, flags);
+}
+
+/* Make sure there's room for one more entry in the file table, along with the
+   empty entry that marks the end of it. */
+static pso_error_t toc_room(pso_gsl_write_t *a) {
+    pso_error_t rv;
+
+    if(!a->up.toc)
+        return PSOARCHIVE_OK;
+
+    if(a->ftab_used >= MAX_FILES)
+        return PSOARCHIVE_ENOSPC;
+
+    rv = pso_update_room(&a->up, a->fd, a->ftab_used, a->ftab_pos + 96,
+                         &a->data_pos);
+    a->ftab_entries = (int)(a->up.data_start / 48);
+
+    return rv;
+}
+
+/* Remember where the file about to be added is going. */
+static void toc_add(pso_gsl_write_t *a, uint32_t len) {
+    if(a->up.toc)
+        pso_update_add(&a->up, a->ftab_used, a->data_pos, len);
+}
+
+pso_gsl_write_t *pso_gsl_write_open_fd(int fd, uint32_t flags,
+                                       pso_error_t *err) {
+    pso_gsl_write_t *rv;
+    pso_error_t erv = PSOARCHIVE_EFATAL;
+    uint8_t *toc, buf[48];
+    uint32_t i, count, maxfiles, offset, size;
+    off_t len, end = 0;
+
+    if((flags & GSL_ENDIANNESS) == GSL_ENDIANNESS)
+        goto ret_err;
+
+    if((len = lseek(fd, 0, SEEK_END)) == (off_t)-1) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_err;
+    }
+
+    if(pso_io_pread(fd, buf, 48, 0) != 48) {
+        erv = PSOARCHIVE_NOARCHIVE;
+        goto ret_err;
+    }
+
+    /* Figure out the endianness the same way the reader does, if the user
+       didn't say which it is. */
+    if(buf[0] == 0) {
+        erv = PSOARCHIVE_EMPTY;
+        goto ret_err;
+    }
+
+    if(!(flags & GSL_ENDIANNESS)) {
+        offset = get32(buf + 32, PSO_GSL_BIG_ENDIAN);
+        size = get32(buf + 36, PSO_GSL_BIG_ENDIAN);
+        flags |= PSO_GSL_BIG_ENDIAN;
+
+        if(offset > len || offset * 2048 > len || size > len) {
+            flags = (flags & ~PSO_GSL_BIG_ENDIAN) | PSO_GSL_LITTLE_ENDIAN;
+        }
+    }
+
+    /* The file table runs up to where the first file starts. */
+    maxfiles = get32(buf + 32, flags) * 2048 / 48;
+
+    if(!maxfiles || (off_t)maxfiles * 48 > len) {
+        erv = PSOARCHIVE_ERANGE;
+        goto ret_err;
+    }
+
+    /* Allocate space for our write context. */
+    if(!(rv = (pso_gsl_write_t *)malloc(sizeof(pso_gsl_write_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    rv->up.toc = NULL;
+
+    if(!(toc = (uint8_t *)malloc(maxfiles * 48))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_mem;
+    }
+
+    if(pso_io_pread(fd, toc, maxfiles * 48, 0) != (ssize_t)maxfiles * 48) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_toc;
+    }
+
+    for(count = 1; count < maxfiles && toc[count * 48]; ++count) ;
+
+    if(pso_update_alloc(&rv->up, count) != PSOARCHIVE_OK) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_toc;
+    }
+
+    for(i = 0; i < count; ++i) {
+        offset = get32(toc + i * 48 + 32, flags);
+        size = get32(toc + i * 48 + 36, flags);
+
+        /* Make sure it looks sane... */
+        if(offset > len / 2048 || size > len - (off_t)offset * 2048) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_toc;
+        }
+
+        rv->up.toc[i].offset = offset * 2048;
+        rv->up.toc[i].size = size;
+
+        if((off_t)offset * 2048 + size > end)
+            end = (off_t)offset * 2048 + size;
+    }
+
+    free(toc);
+
+    /* New files go after the last one in the archive. */
+    rv->fd = fd;
+    rv->ftab_used = (int)count;
+    rv->ftab_pos = 48 * (off_t)count;
+    rv->data_pos = (end + 2047) & ~(off_t)2047;
+    rv->up.ent_pos = 32;
+    rv->up.ent_len = 48;
+    rv->up.flags = flags;
+    rv->up.encode = &encode_toc;
+    pso_update_loaded(&rv->up, (int)count, rv->data_pos);
+    rv->ftab_entries = (int)(rv->up.data_start / 48);
+    rv->flags = flags;
+    rv->q = NULL;
+
+    /* We're done, return success. */
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_toc:
+    free(toc);
+    pso_update_free(&rv->up);
+ret_mem:
+    free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_gsl_write_t *pso_gsl_write_open(const char *fn, uint32_t flags,
+                                    pso_error_t *err) {
+    pso_gsl_write_t *rv;
+    int fd;
+
+    /* Open the file... */
+    if((fd = open(fn, O_RDWR)) < 0) {
+        if(err)
+            *err = PSOARCHIVE_EFILE;
+
+        return NULL;
+    }
+
+    if(!(rv = pso_gsl_write_open_fd(fd, flags, err)))
+        close(fd);
+
+    return rv;
+}
+
+pso_error_t pso_gsl_write_replace(pso_gsl_write_t *a, uint32_t hnd,
+                                  const uint8_t *data, uint32_t len) {
+    if(!a || !a->up.toc || hnd >= (uint32_t)a->ftab_used || (!data && len))
+        return PSOARCHIVE_EFATAL;
+
+    return pso_update_replace(&a->up, &a->q, a->fd, a->ftab_used,
+                              &a->data_pos, hnd, data, len);
+}
+
 pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err) {
     pso_gsl_write_t *rv;
     pso_error_t erv = PSOARCHIVE_OK;
@@ -90,6 +329,8 @@ pso_gsl_write_t *pso_gsl_new(const char *fn, uint32_t flags, pso_error_t *err) {
     rv->ftab_pos = 0;
     rv->data_pos = 256 * 48;
     rv->flags = flags;
+    rv->q = NULL;
+    rv->up.toc = NULL;
 
     /* We're done, return success. */
     if(err)
@@ -130,6 +371,8 @@ pso_gsl_write_t *pso_gsl_new_fd(int fd, uint32_t flags, pso_error_t *err) {
     rv->ftab_pos = 0;
     rv->data_pos = 256 * 48;
     rv->flags = flags;
+    rv->q = NULL;
+    rv->up.toc = NULL;
 
     /* We're done, return success. */
     if(err)
@@ -147,17 +390,32 @@ ret_err:
 }
 
 pso_error_t pso_gsl_write_close(pso_gsl_write_t *a) {
+    uint8_t buf[48];
+
     if(!a || a->fd < 0)
         return PSOARCHIVE_EFATAL;
 
+    /* If we've been updating an existing archive, make sure the end of the
+       file table is marked, in case files were added to it. */
+    if(a->up.toc && a->ftab_pos + 48 <= a->up.data_start) {
+        memset(buf, 0, 48);
+
+        if(pso_io_pwrite(a->fd, buf, 48, a->ftab_pos) != PSOARCHIVE_OK)
+            return PSOARCHIVE_EIO;
+    }
+
+    if(a->q)
+        pso_io_queue_free(a->q);
+
     close(a->fd);
+    pso_update_free(&a->up);
     free(a);
 
     return PSOARCHIVE_OK;
 }
 
 pso_error_t pso_gsl_write_set_ftab_size(pso_gsl_write_t *a, uint32_t ents) {
-    if(!a || a->ftab_used)
+    if(!a || a->ftab_used || a->up.toc)
         return PSOARCHIVE_EFATAL;
 
     if(ents < 256)
@@ -179,17 +437,19 @@ pso_error_t pso_gsl_write_add(pso_gsl_write_t *a, const char *fn,
                               const uint8_t *data, uint32_t len) {
     uint8_t buf[48];
     uint32_t tmp;
+    pso_error_t rv;
 
     if(!a)
         return PSOARCHIVE_EFATAL;
 
+    if((rv = toc_room(a)) != PSOARCHIVE_OK)
+        return rv;
+
     /* XXXX: Support extending the file table... */
     if(a->ftab_used == a->ftab_entries - 1)
         return PSOARCHIVE_EFATAL;
 
-    /* Go to where we'll be writing into the file table... */
-    if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
+    toc_add(a, len);
 
     /* Copy the file data into the buffer... */
     strncpy((char *)buf, fn, 32);
@@ -219,41 +479,28 @@ pso_error_t pso_gsl_write_add(pso_gsl_write_t *a, const char *fn,
     buf[40] = buf[41] = buf[42] = buf[43] = 0;
     buf[44] = buf[45] = buf[46] = buf[47] = 0;
 
-    /* Write out the header... */
-    if(write(a->fd, buf, 48) != 48)
-        return PSOARCHIVE_EIO;
-
-    a->ftab_pos += 48;
-    ++a->ftab_used;
-
-    /* Seek to where the file data goes... */
-    if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
-        return PSOARCHIVE_EIO;
-
-    /* Write the file data out. */
-    if(write(a->fd, data, len) != (ssize_t)len)
-        return PSOARCHIVE_EIO;
-
-    /* Pad the data position out to where the next file will start. */
-    a->data_pos = pad_file(a->fd, 2048);
-
-    /* Done. */
-    return PSOARCHIVE_OK;
+    /* Write out the header and the data. */
+    return write_entry(a, buf, 48, data, len);
 }
 
 pso_error_t pso_gsl_write_add_fd(pso_gsl_write_t *a, const char *fn, int fd,
                                  uint32_t len) {
-    uint8_t buf[512];
+    uint8_t buf[48];
     uint32_t tmp;
-    ssize_t bytes;
+    pso_error_t rv;
 
     if(!a)
         return PSOARCHIVE_EFATAL;
 
+    if((rv = toc_room(a)) != PSOARCHIVE_OK)
+        return rv;
+
     /* XXXX: Support extending the file table... */
     if(a->ftab_used == a->ftab_entries - 1)
         return PSOARCHIVE_EFATAL;
 
+    toc_add(a, len);
+
     /* Go to where we'll be writing into the file table... */
     if(lseek(a->fd, a->ftab_pos, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
@@ -297,19 +544,9 @@ pso_error_t pso_gsl_write_add_fd(pso_gsl_write_t *a, const char *fn, int fd,
     if(lseek(a->fd, a->data_pos, SEEK_SET) == (off_t)-1)
         return PSOARCHIVE_EIO;
 
-    /* While there's still data to be read from the file, read it into our
-       buffer and write it out to the file. */
-    while(len) {
-        bytes = len > 512 ? 512 : len;
-
-        if(read(fd, buf, bytes) != bytes)
-            return PSOARCHIVE_EIO;
-
-        if(write(a->fd, buf, bytes) != bytes)
-            return PSOARCHIVE_EIO;
-
-        len -= bytes;
-    }
+    /* Copy the data over from the file. */
+    if((rv = pso_io_copy(a->fd, fd, len)) != PSOARCHIVE_OK)
+        return rv;
 
     /* Pad the data position out to where the next file will start. */
     a->data_pos = pad_file(a->fd, 2048);
@@ -346,3 +583,23 @@ pso_error_t pso_gsl_write_add_file(pso_gsl_write_t *a, const char *afn,
     close(fd);
     return err;
 }
+
+static pso_error_t batch_add(void *a, const char *fn, const uint8_t *data,
+                             uint32_t len, time_t mtime) {
+    (void)mtime;
+    return pso_gsl_write_add((pso_gsl_write_t *)a, fn, data, len);
+}
+
+static pso_error_t batch_add_file(void *a, const char *afn, const char *fn) {
+    return pso_gsl_write_add_file((pso_gsl_write_t *)a, afn, fn);
+}
+
+pso_error_t pso_gsl_write_add_batch(pso_gsl_write_t *a,
+                                   const pso_build_item_t *items, size_t count,
+                                   int threads, size_t max_bytes) {
+    if(!a)
+        return PSOARCHIVE_EFATAL;
+
+    return pso_build_run(items, count, threads, max_bytes, &batch_add,
+                         &batch_add_file, a);
+}
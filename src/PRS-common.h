@@ -0,0 +1,60 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "PRS.h"
+
+/* The largest offset a PRS copy can reference is 8KiB back in the output, so
+   this is all the history a decoder ever needs to keep around. */
+#define PRS_WINDOW_SIZE     0x2000
+#define PRS_WINDOW_MASK     (PRS_WINDOW_SIZE - 1)
+
+/* Decoder states. Each one of these is a point where the streaming decoder can
+   be suspended waiting for more input (or more space for output). */
+enum prs_stream_state {
+    PRS_ST_FLAG = 0,
+    PRS_ST_LITERAL,
+    PRS_ST_CMD,
+    PRS_ST_SHORT_SZ1,
+    PRS_ST_SHORT_SZ2,
+    PRS_ST_SHORT_OFF,
+    PRS_ST_LONG_LO,
+    PRS_ST_LONG_HI,
+    PRS_ST_LONG_SZ,
+    PRS_ST_COPY,
+    PRS_ST_END,
+    PRS_ST_ERROR
+};
+
+struct pso_prs_stream {
+    uint8_t window[PRS_WINDOW_SIZE];
+
+    int state;
+    int bit_pos;
+    uint8_t flags;
+
+    int tmp;
+    int copy_len;
+    int offset;
+
+    size_t total_in;
+    size_t total_out;
+};
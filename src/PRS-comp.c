@@ -36,6 +36,7 @@
 
 #include "psoarchive-error.h"
 #include "PRS.h"
+#include "PRSD-common.h"
 
 #define MAX_WINDOW   0x2000
 #define WINDOW_MASK  (MAX_WINDOW - 1)
@@ -69,6 +70,10 @@ struct prs_comp_cxt {
     size_t dst_len;
     size_t src_pos;
     size_t dst_pos;
+
+    /* If set, the output is encrypted (for PRSD) as it is written. */
+    struct prsd_crypt_cxt *ccxt;
+    size_t crypt_pos;
 };
 
 struct prs_hash_cxt {
@@ -106,6 +111,34 @@ size_t pso_prs_max_compressed_size(size_t len) {
     return len + (len >> 3) + ((len & 0x07) ? 1 : 0);
 }
 
+/* Encrypt all of the whole words of output before the given position that
+   haven't been encrypted yet. */
+static void crypt_output(struct prs_comp_cxt *cxt, size_t pos) {
+    size_t len = (pos - cxt->crypt_pos) & ~(size_t)3;
+
+    if(len) {
+        pso_prsd_crypt(cxt->ccxt, cxt->dst + cxt->crypt_pos, (uint32_t)len);
+        cxt->crypt_pos += len;
+    }
+}
+
+/* Encrypt whatever is left of the output at the end. The last word might not
+   be complete, so do it outside of the output buffer so we don't write past the
+   end of it. */
+static void crypt_final(struct prs_comp_cxt *cxt) {
+    uint32_t tail = 0;
+    size_t left;
+
+    crypt_output(cxt, cxt->dst_pos);
+
+    if((left = cxt->dst_pos - cxt->crypt_pos)) {
+        memcpy(&tail, cxt->dst + cxt->crypt_pos, left);
+        pso_prsd_crypt(cxt->ccxt, &tail, 4);
+        memcpy(cxt->dst + cxt->crypt_pos, &tail, left);
+        cxt->crypt_pos += left;
+    }
+}
+
 static int set_bit(struct prs_comp_cxt *cxt, int value) {
     if(!cxt->bits_left--) {
         if(cxt->dst_pos >= cxt->dst_len)
@@ -116,6 +149,11 @@ static int set_bit(struct prs_comp_cxt *cxt, int value) {
         *cxt->flag_ptr = cxt->flags;
         cxt->flag_ptr = cxt->dst + cxt->dst_pos++;
         cxt->bits_left = 7;
+
+        /* Everything before the new flag byte is done, so if we're encrypting
+           the output, we can do that now while it's still in the cache. */
+        if(cxt->ccxt)
+            crypt_output(cxt, (size_t)(cxt->flag_ptr - cxt->dst));
     }
 
     cxt->flags >>= 1;
@@ -215,8 +253,11 @@ static int find_longest_match(struct prs_comp_cxt *cxt, struct prs_hash_cxt *hc,
     /* Make sure our initial match isn't outside the window. */
     diff = (uintptr_t)ent - (uintptr_t)cxt->src;
 
-    /* If we'd go outside the window, truncate the hash chain now. */
-    if(cxt->src_pos - diff > MAX_WINDOW) {
+    /* If we'd go outside the window, truncate the hash chain now. Note that
+       while an offset of 8KiB can be encoded with a long copy of up to 9 bytes,
+       it can't be with a longer copy (it would look like the end of the data),
+       so stop just short of that. */
+    if(cxt->src_pos - diff >= MAX_WINDOW) {
         hc->ENT(hash) = NULL;
         if(!lazy)
             ADD_TO_HASH(hc, cxt->src + cxt->src_pos, hash);
@@ -239,7 +280,7 @@ static int find_longest_match(struct prs_comp_cxt *cxt, struct prs_hash_cxt *hc,
             diff = (uintptr_t)ent2 - (uintptr_t)cxt->src;
 
             /* If we'd go outside the window, truncate the hash chain now. */
-            if(cxt->src_pos - diff > MAX_WINDOW) {
+            if(cxt->src_pos - diff >= MAX_WINDOW) {
                 hc->PREV(ent) = NULL;
                 ent2 = NULL;
             }
@@ -353,8 +394,14 @@ int pso_prs_archive2(const uint8_t *src, uint8_t *dst, size_t src_len,
     This function compresses a buffer of data with PRS compression. This
     function will never produce output larger than that of the prs_archive
     function, and will usually produce output that is significantly smaller.
+
+    All of the real work is done by prs_compress_crypt, which compresses into
+    a buffer that has already been allocated, and can encrypt the output as it
+    goes for PRSD (so that the PRSD compressor doesn't need to make another pass
+    over the output, or copy it anywhere).
  ******************************************************************************/
-int pso_prs_compress(const uint8_t *src, uint8_t **dst, size_t src_len) {
+int pso_prs_compress_crypt(const uint8_t *src, uint8_t *dst, size_t src_len,
+                           size_t dst_len, struct prsd_crypt_cxt *ccxt) {
     struct prs_comp_cxt cxt;
     struct prs_hash_cxt *hcxt;
     int rv, mlen, mlen2;
@@ -366,32 +413,37 @@ int pso_prs_compress(const uint8_t *src, uint8_t **dst, size_t src_len) {
     if(!src || !dst)
         return PSOARCHIVE_EFAULT;
 
-    if(!src_len)
+    if(!src_len || !dst_len)
         return PSOARCHIVE_EINVAL;
 
+    /* Clear the contexts and fill in what we need to do our job. */
+    memset(&cxt, 0, sizeof(cxt));
+    cxt.src = src;
+    cxt.src_len = src_len;
+    cxt.dst_len = dst_len;
+    cxt.dst = dst;
+    cxt.flag_ptr = cxt.dst;
+    cxt.ccxt = ccxt;
+
     /* Meh. Don't feel like dealing with it here, since it's not compressible
        at all anyway. */
-    if(src_len <= 3)
-        return pso_prs_archive(src, dst, src_len);
+    if(src_len <= 3) {
+        if((rv = pso_prs_archive2(src, dst, src_len, dst_len)) < 0)
+            return rv;
+
+        if(ccxt) {
+            cxt.dst_pos = (size_t)rv;
+            crypt_final(&cxt);
+        }
+
+        return rv;
+    }
 
     /* Allocate the hash context. */
     if(!(hcxt = (struct prs_hash_cxt *)malloc(sizeof(struct prs_hash_cxt))))
         return PSOARCHIVE_EMEM;
 
-    /* Clear the contexts and fill in what we need to do our job. */
-    memset(&cxt, 0, sizeof(cxt));
     memset(hcxt, 0, sizeof(struct prs_hash_cxt));
-    cxt.src = src;
-    cxt.src_len = src_len;
-    cxt.dst_len = pso_prs_max_compressed_size(src_len);
-
-    /* Allocate our "compressed" buffer. */
-    if(!(cxt.dst = (uint8_t *)malloc(cxt.dst_len))) {
-        free(hcxt);
-        return PSOARCHIVE_EMEM;
-    }
-
-    cxt.flag_ptr = cxt.dst;
 
     /* Add the first two "strings" to the hash table. */
     INIT_ADD_HASH(hcxt, src, tmp);
@@ -535,17 +587,48 @@ blergh:
     if((rv = write_eof(&cxt)))
         goto out;
 
+    /* Encrypt whatever we haven't already. */
+    if(ccxt)
+        crypt_final(&cxt);
+
+    rv = (int)cxt.dst_pos;
+
+out:
     free(hcxt);
+    return rv;
+}
+
+int pso_prs_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                      size_t dst_len) {
+    return pso_prs_compress_crypt(src, dst, src_len, dst_len, NULL);
+}
+
+int pso_prs_compress(const uint8_t *src, uint8_t **dst, size_t src_len) {
+    size_t dl;
+    uint8_t *db;
+    int rv;
+
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    /* Allocate our "compressed" buffer. */
+    dl = pso_prs_max_compressed_size(src_len);
+
+    if(!(db = (uint8_t *)malloc(dl)))
+        return PSOARCHIVE_EMEM;
+
+    if((rv = pso_prs_compress2(src, db, src_len, dl)) < 0) {
+        free(db);
+        return rv;
+    }
 
     /* Resize the output (if realloc fails to resize it, then just use the
        unshortened buffer). */
-    if(!(*dst = realloc(cxt.dst, cxt.dst_pos)))
-        *dst = cxt.dst;
+    if(!(*dst = realloc(db, rv)))
+        *dst = db;
 
-    return (int)cxt.dst_pos;
-
-out:
-    free(cxt.dst);
-    free(hcxt);
     return rv;
 }
@@ -21,8 +21,14 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "psoarchive-error.h"
+#include "io-common.h"
+#include "hash-common.h"
+#include "thread-pool.h"
+#include "PRS-common.h"
+#include "PRSD-common.h"
 
 struct prs_dec_cxt {
     uint8_t flags;
@@ -42,88 +48,111 @@ struct prs_dec_cxt {
     int (*fetch_bit)(struct prs_dec_cxt *cxt);
     int (*fetch_byte)(struct prs_dec_cxt *cxt);
     int (*fetch_short)(struct prs_dec_cxt *cxt);
+
+    /* Called (if set) for each copy, before any of the data is copied. */
+    void (*copy_token)(struct prs_dec_cxt *cxt, int kind, int offset,
+                       int size);
 };
 
 /******************************************************************************
-    PRS Decompression Function
+    PRS Decompression Functions
 
-    This function does the real work of decompressing whatever you throw at it.
-    It uses a bunch of callbacks in the context provided to read the compressed
-    data and do whatever is needed with it.
+    These functions do the real work of decompressing whatever you throw at
+    them. They use a bunch of callbacks in the context provided to read the
+    compressed data and do whatever is needed with it. decode_step handles one
+    token at a time, so that the interleaved decoder can take turns between
+    several streams with it. do_decompress just runs it until the end.
  ******************************************************************************/
-static int do_decompress(struct prs_dec_cxt *cxt) {
-    int flag, size;
+
+/* Decode one token. Returns 0 if there's more to do, 1 at the end of the
+   data, or a negative error code. */
+static int decode_step(struct prs_dec_cxt *cxt) {
+    int flag, size, kind;
     int32_t offset;
 
-    for(;;) {
-        /* Read the flag bit for this pass. */
-        if((flag = cxt->fetch_bit(cxt)) < 0)
+    /* Read the flag bit for this pass. */
+    if((flag = cxt->fetch_bit(cxt)) < 0)
+        return flag;
+
+    /* Flag bit = 1 -> Simple byte copy from src to dst. */
+    if(flag) {
+        if((flag = cxt->copy_byte(cxt)) < 0)
             return flag;
 
-        /* Flag bit = 1 -> Simple byte copy from src to dst. */
-        if(flag) {
-            if((flag = cxt->copy_byte(cxt)) < 0)
-                return flag;
+        return 0;
+    }
+
+    /* The flag starts with a zero, so it isn't just a simple byte copy. Read
+       the next bit to see what we have left to do. */
+    if((flag = cxt->fetch_bit(cxt)) < 0)
+        return flag;
+
+    /* Flag bit = 1 -> Either long copy or end of file. */
+    if(flag) {
+        if((offset = cxt->fetch_short(cxt)) < 0)
+            return offset;
+
+        /* Two zero bytes implies that this is the end of the file. */
+        if(!offset)
+            return 1;
 
-            continue;
+        /* Do we need to read a size byte, or is it encoded in what we already
+           got? */
+        size = offset & 0x0007;
+        offset >>= 3;
+
+        if(!size) {
+            if((size = cxt->fetch_byte(cxt)) < 0)
+                return size;
+
+            ++size;
+            kind = PSO_PRS_COPY_EXTENDED;
+        }
+        else {
+            size += 2;
+            kind = PSO_PRS_COPY_LONG;
         }
 
-        /* The flag starts with a zero, so it isn't just a simple byte copy.
-           Read the next bit to see what we have left to do. */
+        offset |= 0xFFFFE000;
+    }
+    /* Flag bit = 0 -> short copy. */
+    else {
+        /* Fetch the two bits needed to determine the size. */
         if((flag = cxt->fetch_bit(cxt)) < 0)
             return flag;
 
-        /* Flag bit = 1 -> Either long copy or end of file. */
-        if(flag) {
-            if((offset = cxt->fetch_short(cxt)) < 0)
-                return offset;
-
-            /* Two zero bytes implies that this is the end of the file. Return
-               the length of the file. */
-            if(!offset)
-                return (int)cxt->dst_pos;
+        if((size = cxt->fetch_bit(cxt)) < 0)
+            return size;
 
-            /* Do we need to read a size byte, or is it encoded in what we
-               already got? */
-            size = offset & 0x0007;
-            offset >>= 3;
+        size = (size | (flag << 1)) + 2;
 
-            if(!size) {
-                if((size = cxt->fetch_byte(cxt)) < 0)
-                    return size;
+        /* Fetch the offset byte. */
+        if((offset = cxt->fetch_byte(cxt)) < 0)
+            return offset;
 
-                ++size;
-            }
-            else {
-                size += 2;
-            }
+        offset |= 0xFFFFFF00;
+        kind = PSO_PRS_COPY_SHORT;
+    }
 
-            offset |= 0xFFFFE000;
-        }
-        /* Flag bit = 0 -> short copy. */
-        else {
-            /* Fetch the two bits needed to determine the size. */
-            if((flag = cxt->fetch_bit(cxt)) < 0)
-                return flag;
+    if(cxt->copy_token)
+        cxt->copy_token(cxt, kind, offset, size);
 
-            if((size = cxt->fetch_bit(cxt)) < 0)
-                return size;
+    /* Copy the data. */
+    while(size--) {
+        if((flag = cxt->offset_copy(cxt, offset)) < 0)
+            return flag;
+    }
 
-            size = (size | (flag << 1)) + 2;
+    return 0;
+}
 
-            /* Fetch the offset byte. */
-            if((offset = cxt->fetch_byte(cxt)) < 0)
-                return offset;
+/* Decode everything, returning the length of the output or an error code. */
+static int do_decompress(struct prs_dec_cxt *cxt) {
+    int rv;
 
-            offset |= 0xFFFFFF00;
-        }
+    while(!(rv = decode_step(cxt))) ;
 
-        /* Copy the data. */
-        while(size--) {
-            if((flag = cxt->offset_copy(cxt, offset)) < 0)
-                return flag;
-        }
-    }
+    return rv < 0 ? rv : (int)cxt->dst_pos;
 }
 
 /******************************************************************************
@@ -246,38 +275,31 @@ static int offset_nocopy(struct prs_dec_cxt *cxt, int offset) {
     return PSOARCHIVE_OK;
 }
 
-static int file_bit(struct prs_dec_cxt *cxt) {
-    int rv;
+static int offset_copy_alloc(struct prs_dec_cxt *cxt, int offset) {
+    int tmp = (int)cxt->dst_pos + offset;
+    void *tmp2;
 
-    /* Did we finish with a full byte last time we were in here? */
-    if(!cxt->bit_pos) {
-        /* Make sure we won't fall off the end of the file by reading the byte
-           from it. */
-        if(cxt->src_pos >= cxt->src_len)
-            return PSOARCHIVE_EBADMSG;
+    /* Make sure the offset is valid. */
+    if(tmp < 0)
+        return PSOARCHIVE_EBADMSG;
 
-        /* Read the next byte from the file. */
-        if((rv = fgetc((FILE *)cxt->udata)) == EOF) {
-            if(ferror((FILE *)cxt->udata))
-                return PSOARCHIVE_EIO;
-            return PSOARCHIVE_EBADMSG;
-        }
+    /* Make sure we have space left in the destination buffer. */
+    if(cxt->dst_pos >= cxt->dst_len) {
+        if(!(tmp2 = realloc(cxt->dst, cxt->dst_len * 2)))
+            return PSOARCHIVE_EMEM;
 
-        cxt->flags = (uint8_t)rv;
-        ++cxt->src_pos;
-        cxt->bit_pos = 8;
+        cxt->dst = (uint8_t *)tmp2;
+        cxt->dst_len *= 2;
     }
 
-    /* Fetch the bit and shift it off the end of the byte. */
-    rv = cxt->flags & 1;
-    cxt->flags >>= 1;
-    --cxt->bit_pos;
+    /* Copy the byte and increment all the counters/pointers. */
+    *(cxt->dst + cxt->dst_pos) = *(cxt->dst + cxt->dst_pos + offset);
+    ++cxt->dst_pos;
 
-    return rv;
+    return PSOARCHIVE_OK;
 }
 
-static int copy_fbyte(struct prs_dec_cxt *cxt) {
-    int b;
+static int copy_abyte(struct prs_dec_cxt *cxt) {
     void *tmp;
 
     /* Make sure we still have data left in the input file. */
@@ -293,87 +315,177 @@ static int copy_fbyte(struct prs_dec_cxt *cxt) {
         cxt->dst_len *= 2;
     }
 
-    /* Read the next byte from the file. */
-    if((b = fgetc((FILE *)cxt->udata)) == EOF) {
-        if(ferror((FILE *)cxt->udata))
-            return PSOARCHIVE_EIO;
-        return PSOARCHIVE_EBADMSG;
-    }
-
     /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = (uint8_t)b;
+    *(cxt->dst + cxt->dst_pos) = *cxt->src++;
     ++cxt->src_pos;
     ++cxt->dst_pos;
 
     return PSOARCHIVE_OK;
 }
 
-static int file_byte(struct prs_dec_cxt *cxt) {
-    int rv;
+/* Decompression into a rolling window, rather than a full output buffer. The
+   window is handed off to a callback each time it fills up. */
+struct verify_cxt {
+    uint8_t window[PRS_WINDOW_SIZE];
+    size_t flushed;
 
-    /* Make sure we still have data left in the input file. */
+    pso_prs_hash_cb_t cb;
+    void *udata;
+};
+
+static void flush_window(struct prs_dec_cxt *cxt) {
+    struct verify_cxt *v = (struct verify_cxt *)cxt->udata;
+
+    if(cxt->dst_pos > v->flushed) {
+        v->cb(v->udata, v->window, cxt->dst_pos - v->flushed);
+        v->flushed = cxt->dst_pos;
+    }
+}
+
+static int copy_wbyte(struct prs_dec_cxt *cxt) {
+    struct verify_cxt *v = (struct verify_cxt *)cxt->udata;
+
+    /* Make sure we still have data left in the input buffer. */
     if(cxt->src_pos >= cxt->src_len)
         return PSOARCHIVE_EBADMSG;
 
-    /* Read the next byte from the file. */
-    if((rv = fgetc((FILE *)cxt->udata)) == EOF) {
-        if(ferror((FILE *)cxt->udata))
-            return PSOARCHIVE_EIO;
+    /* Copy the byte into the window and increment the counters/pointers. */
+    v->window[cxt->dst_pos & PRS_WINDOW_MASK] = *cxt->src++;
+    ++cxt->src_pos;
+    ++cxt->dst_pos;
+
+    /* If we've filled the window, pass it on before we start overwriting it. */
+    if(!(cxt->dst_pos & PRS_WINDOW_MASK))
+        flush_window(cxt);
+
+    return PSOARCHIVE_OK;
+}
+
+static int offset_wcopy(struct prs_dec_cxt *cxt, int offset) {
+    struct verify_cxt *v = (struct verify_cxt *)cxt->udata;
+    int tmp = (int)cxt->dst_pos + offset;
+
+    /* Make sure the offset is valid. */
+    if(tmp < 0)
         return PSOARCHIVE_EBADMSG;
-    }
 
-    ++cxt->src_pos;
+    /* Copy the byte within the window and increment the counter. */
+    v->window[cxt->dst_pos & PRS_WINDOW_MASK] =
+        v->window[tmp & PRS_WINDOW_MASK];
+    ++cxt->dst_pos;
 
-    return (int)rv;
+    /* If we've filled the window, pass it on before we start overwriting it. */
+    if(!(cxt->dst_pos & PRS_WINDOW_MASK))
+        flush_window(cxt);
+
+    return PSOARCHIVE_OK;
 }
 
-static int file_short(struct prs_dec_cxt *cxt) {
-    uint16_t rv;
-    uint8_t b[2];
+/* Statistics collection, for prs_analyze. This is used along with the nocopy
+   functions, so nothing actually gets written anywhere. */
+static int stats_bucket(unsigned int v) {
+    int rv = 0;
 
-    /* Make sure we still have data left in the input file. */
-    if(cxt->src_pos + 1 >= cxt->src_len)
+    while(v >>= 1)
+        ++rv;
+
+    return rv < PSO_PRS_STATS_BUCKETS ? rv : PSO_PRS_STATS_BUCKETS - 1;
+}
+
+static void stats_copy(struct prs_dec_cxt *cxt, int kind, int offset,
+                       int size) {
+    pso_prs_stats_t *st = (pso_prs_stats_t *)cxt->udata;
+    pso_prs_copy_stats_t *c = &st->copies[kind];
+
+    ++c->count;
+    c->bytes += size;
+    ++c->length[stats_bucket((unsigned int)size)];
+    ++c->offset[stats_bucket((unsigned int)-offset)];
+}
+
+/* Decoding of encrypted (PRSD) data. Rather than decrypting a copy of all of
+   the data before decoding it, the data is decrypted a small piece at a time
+   just ahead of where the decoder is reading, so the encrypted data is only
+   read once and only a tiny buffer is needed. The piece size must be a
+   multiple of 4 bytes (and a power of two). */
+#define CRYPT_PIECE     256
+
+struct crypt_src {
+    struct prsd_crypt_cxt *ccxt;
+    uint32_t buf[CRYPT_PIECE / 4];
+};
+
+static inline int crypt_byte(struct prs_dec_cxt *cxt) {
+    struct crypt_src *cs = (struct crypt_src *)cxt->udata;
+    size_t amt;
+
+    /* Make sure we still have data left in the input buffer. */
+    if(cxt->src_pos >= cxt->src_len)
         return PSOARCHIVE_EBADMSG;
 
-    /* Read the next two bytes from the file. */
-    if(fread(b, 1, 2, (FILE *)cxt->udata) != 2)
-        return PSOARCHIVE_EIO;
+    /* If we've used up the last piece, decrypt the next one. The data is
+       encrypted as if it were padded out to a multiple of 4 bytes, so the last
+       word of the last piece might not be all there. */
+    if(!(cxt->src_pos & (CRYPT_PIECE - 1))) {
+        amt = cxt->src_len - cxt->src_pos;
 
-    /* Combine the bytes into the 16-bit value we're looking for. */
-    rv = b[0] | (b[1] << 8);
-    cxt->src_pos += 2;
+        if(amt > CRYPT_PIECE)
+            amt = CRYPT_PIECE;
 
-    return (int)rv;
+        cs->buf[(amt - 1) >> 2] = 0;
+        memcpy(cs->buf, cxt->src, amt);
+        pso_prsd_crypt(cs->ccxt, cs->buf, (uint32_t)amt);
+    }
+
+    ++cxt->src;
+    return ((uint8_t *)cs->buf)[cxt->src_pos++ & (CRYPT_PIECE - 1)];
 }
 
-static int offset_copy_alloc(struct prs_dec_cxt *cxt, int offset) {
-    int tmp = (int)cxt->dst_pos + offset;
-    void *tmp2;
+static int fetch_cbit(struct prs_dec_cxt *cxt) {
+    int rv;
 
-    /* Make sure the offset is valid. */
-    if(tmp < 0)
+    /* Did we finish with a full byte last time we were in here? */
+    if(!cxt->bit_pos) {
+        if((rv = crypt_byte(cxt)) < 0)
+            return rv;
+
+        cxt->flags = (uint8_t)rv;
+        cxt->bit_pos = 8;
+    }
+
+    /* Fetch the bit and shift it off the end of the byte. */
+    rv = cxt->flags & 1;
+    cxt->flags >>= 1;
+    --cxt->bit_pos;
+
+    return rv;
+}
+
+static int copy_cbyte(struct prs_dec_cxt *cxt) {
+    int rv;
+
+    /* Make sure we still have data left in the input buffer. */
+    if(cxt->src_pos >= cxt->src_len)
         return PSOARCHIVE_EBADMSG;
 
     /* Make sure we have space left in the destination buffer. */
-    if(cxt->dst_pos >= cxt->dst_len) {
-        if(!(tmp2 = realloc(cxt->dst, cxt->dst_len * 2)))
-            return PSOARCHIVE_EMEM;
+    if(cxt->dst_pos >= cxt->dst_len)
+        return PSOARCHIVE_ENOSPC;
 
-        cxt->dst = (uint8_t *)tmp2;
-        cxt->dst_len *= 2;
-    }
+    if((rv = crypt_byte(cxt)) < 0)
+        return rv;
 
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = *(cxt->dst + cxt->dst_pos + offset);
+    *cxt->dst++ = (uint8_t)rv;
     ++cxt->dst_pos;
 
     return PSOARCHIVE_OK;
 }
 
-static int copy_abyte(struct prs_dec_cxt *cxt) {
+static int copy_cabyte(struct prs_dec_cxt *cxt) {
     void *tmp;
+    int rv;
 
-    /* Make sure we still have data left in the input file. */
+    /* Make sure we still have data left in the input buffer. */
     if(cxt->src_pos >= cxt->src_len)
         return PSOARCHIVE_EBADMSG;
 
@@ -386,14 +498,28 @@ static int copy_abyte(struct prs_dec_cxt *cxt) {
         cxt->dst_len *= 2;
     }
 
-    /* Copy the byte and increment all the counters/pointers. */
-    *(cxt->dst + cxt->dst_pos) = *cxt->src++;
-    ++cxt->src_pos;
+    if((rv = crypt_byte(cxt)) < 0)
+        return rv;
+
+    *(cxt->dst + cxt->dst_pos) = (uint8_t)rv;
     ++cxt->dst_pos;
 
     return PSOARCHIVE_OK;
 }
 
+static int fetch_cshort(struct prs_dec_cxt *cxt) {
+    int lo, hi;
+
+    /* Make sure we still have data left in the input buffer. */
+    if(cxt->src_pos + 1 >= cxt->src_len)
+        return PSOARCHIVE_EBADMSG;
+
+    lo = crypt_byte(cxt);
+    hi = crypt_byte(cxt);
+
+    return lo | (hi << 8);
+}
+
 /******************************************************************************
     Public interface functions
 
@@ -420,6 +546,24 @@ static int copy_abyte(struct prs_dec_cxt *cxt) {
         memory buffer. It is the caller's responsibility to free the
         decompressed memory buffer when it is no longer needed.
 
+    prs_verify_cb:
+        Decompress data from a memory buffer through an 8KiB window, passing
+        each full window (and then whatever is left at the end) to a callback.
+        This is the same idea as prs_decompress_size, except that the output is
+        actually kept around long enough to do something with it.
+
+    prs_verify:
+        Decompress data from a memory buffer, hashing the output as it goes
+        rather than keeping it.
+
+    prs_analyze:
+        Walk through the compressed data in a memory buffer like
+        prs_decompress_size does, counting up what each token in it is.
+
+    prs_decompress_crypt/prs_decompress_crypt2:
+        Internal versions of prs_decompress_buf and prs_decompress_buf2 for
+        PRSD data, which decrypt the data as they go.
+
     All of these functions will return the size of the decompressed data on
     success, or a error code (from psoarchive-error) on error. Common error
     codes include the following:
@@ -430,11 +574,15 @@ static int copy_abyte(struct prs_dec_cxt *cxt) {
     In addition, prs_decompress_file may return many other error codes related
     to reading from a file. prs_decompress_file and prs_decompress_buf may also
     return errors related to memory allocation.
+
+    prs_decompress_file maps the file into memory (or reads it in, in large
+    chunks, where that isn't possible) and then decodes it with the same code
+    that prs_decompress_buf uses.
  ******************************************************************************/
 int pso_prs_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len) {
     struct prs_dec_cxt cxt =
         { 0, 0, src, NULL, NULL, src_len, src_len * 2, 0, 0, &copy_abyte,
-          &offset_copy_alloc, &fetch_bit, &fetch_byte, &fetch_short };
+          &offset_copy_alloc, &fetch_bit, &fetch_byte, &fetch_short, NULL };
     int rv;
 
     if(!src || !dst)
@@ -471,7 +619,7 @@ int pso_prs_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
                             size_t dst_len) {
     struct prs_dec_cxt cxt =
         { 0, 0, src, dst, NULL, src_len, dst_len, 0, 0, &copy_byte,
-          &offset_copy, &fetch_bit, &fetch_byte, &fetch_short };
+          &offset_copy, &fetch_bit, &fetch_byte, &fetch_short, NULL };
 
     if(!src || !dst)
         return PSOARCHIVE_EFAULT;
@@ -490,7 +638,7 @@ int pso_prs_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
 int pso_prs_decompress_size(const uint8_t *src, size_t src_len) {
     struct prs_dec_cxt cxt =
         { 0, 0, src, NULL, NULL, src_len, SIZE_MAX, 0, 0, &nocopy_byte,
-          &offset_nocopy, &fetch_bit, &fetch_byte, &fetch_short };
+          &offset_nocopy, &fetch_bit, &fetch_byte, &fetch_short, NULL };
 
     if(!src)
         return PSOARCHIVE_EFAULT;
@@ -506,64 +654,38 @@ int pso_prs_decompress_size(const uint8_t *src, size_t src_len) {
     return do_decompress(&cxt);
 }
 
-int pso_prs_decompress_file(const char *fn, uint8_t **dst) {
+int pso_prs_decompress_crypt(const uint8_t *src, uint8_t **dst,
+                             size_t src_len, struct prsd_crypt_cxt *ccxt) {
+    struct crypt_src cs;
     struct prs_dec_cxt cxt =
-        { 0, 0, NULL, NULL, NULL, 0, 0, 0, 0,
-          &copy_fbyte, &offset_copy_alloc, &file_bit, &file_byte, &file_short };
-    long len;
+        { 0, 0, src, NULL, &cs, src_len, src_len * 2, 0, 0, &copy_cabyte,
+          &offset_copy_alloc, &fetch_cbit, &crypt_byte, &fetch_cshort, NULL };
     int rv;
-    FILE *fp;
 
-    if(!fn || !dst)
+    if(!src || !dst || !ccxt)
         return PSOARCHIVE_EFAULT;
 
-    if(!(fp = fopen(fn, "rb")))
-        return PSOARCHIVE_EFILE;
-
-    cxt.udata = fp;
-
-    /* Figure out the length of the file. */
-    if(fseek(fp, 0, SEEK_END)) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    if((len = ftell(fp)) < 0) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    if(fseek(fp, 0, SEEK_SET)) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    cxt.src_len = (size_t)len;
-    cxt.dst_len = cxt.src_len * 2;
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
 
     /* The minimum length of a PRS compressed file (if you were to "compress" a
        zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
-    if(cxt.src_len < 3) {
-        fclose(fp);
+    if(cxt.src_len < 3)
         return PSOARCHIVE_EBADMSG;
-    }
+
+    cs.ccxt = ccxt;
 
     /* Allocate some space for the output. Start with two times the length of
        the input (we will resize this later, as needed). */
-    if(!(cxt.dst = (uint8_t *)malloc(cxt.dst_len))) {
-        fclose(fp);
+    if(!(cxt.dst = (uint8_t *)malloc(cxt.dst_len)))
         return PSOARCHIVE_EMEM;
-    }
 
     /* Do the decompression. */
     if((rv = do_decompress(&cxt)) < 0) {
         free(cxt.dst);
-        fclose(fp);
         return rv;
     }
 
-    fclose(fp);
-
     /* Resize the output (if realloc fails to resize it, then just use the
        unshortened buffer). */
     if(!(*dst = realloc(cxt.dst, rv)))
@@ -571,3 +693,261 @@ int pso_prs_decompress_file(const char *fn, uint8_t **dst) {
 
     return rv;
 }
+
+int pso_prs_decompress_crypt2(const uint8_t *src, uint8_t *dst,
+                              size_t src_len, size_t dst_len,
+                              struct prsd_crypt_cxt *ccxt) {
+    struct crypt_src cs;
+    struct prs_dec_cxt cxt =
+        { 0, 0, src, dst, &cs, src_len, dst_len, 0, 0, &copy_cbyte,
+          &offset_copy, &fetch_cbit, &crypt_byte, &fetch_cshort, NULL };
+
+    if(!src || !dst || !ccxt)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len || !dst_len)
+        return PSOARCHIVE_EINVAL;
+
+    /* The minimum length of a PRS compressed file (if you were to "compress" a
+       zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
+    if(cxt.src_len < 3)
+        return PSOARCHIVE_EBADMSG;
+
+    cs.ccxt = ccxt;
+
+    return do_decompress(&cxt);
+}
+
+int pso_prs_verify_cb(const uint8_t *src, size_t src_len,
+                      pso_prs_hash_cb_t cb, void *udata) {
+    struct verify_cxt v;
+    struct prs_dec_cxt cxt =
+        { 0, 0, src, NULL, &v, src_len, SIZE_MAX, 0, 0, &copy_wbyte,
+          &offset_wcopy, &fetch_bit, &fetch_byte, &fetch_short, NULL };
+    int rv;
+
+    if(!src || !cb)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    /* The minimum length of a PRS compressed file (if you were to "compress" a
+       zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
+    if(cxt.src_len < 3)
+        return PSOARCHIVE_EBADMSG;
+
+    v.flushed = 0;
+    v.cb = cb;
+    v.udata = udata;
+
+    if((rv = do_decompress(&cxt)) < 0)
+        return rv;
+
+    /* Pass on whatever is left in the window. */
+    flush_window(&cxt);
+
+    return rv;
+}
+
+int pso_prs_verify(const uint8_t *src, size_t src_len, int hash,
+                   uint64_t *digest) {
+    struct pso_hash_cxt h;
+    int rv;
+
+    if(!digest)
+        return PSOARCHIVE_EFAULT;
+
+    if((rv = pso_hash_init(&h, hash)))
+        return rv;
+
+    if((rv = pso_prs_verify_cb(src, src_len, &pso_hash_update, &h)) < 0)
+        return rv;
+
+    *digest = pso_hash_final(&h);
+    return rv;
+}
+
+int pso_prs_analyze(const uint8_t *src, size_t src_len,
+                    pso_prs_stats_t *stats) {
+    struct prs_dec_cxt cxt =
+        { 0, 0, src, NULL, stats, src_len, SIZE_MAX, 0, 0, &nocopy_byte,
+          &offset_nocopy, &fetch_bit, &fetch_byte, &fetch_short, &stats_copy };
+    const pso_prs_copy_stats_t *c = stats ? stats->copies : NULL;
+    int rv;
+
+    if(!src || !stats)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    /* The minimum length of a PRS compressed file (if you were to "compress" a
+       zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
+    if(cxt.src_len < 3)
+        return PSOARCHIVE_EBADMSG;
+
+    memset(stats, 0, sizeof(pso_prs_stats_t));
+
+    if((rv = do_decompress(&cxt)) < 0)
+        return rv;
+
+    /* Everything that wasn't part of a copy was a literal byte. */
+    stats->compressed_size = cxt.src_pos;
+    stats->decompressed_size = cxt.dst_pos;
+    stats->literals = cxt.dst_pos - c[PSO_PRS_COPY_SHORT].bytes -
+        c[PSO_PRS_COPY_LONG].bytes - c[PSO_PRS_COPY_EXTENDED].bytes;
+
+    /* Each literal takes one flag bit, short copies take four, and long copies
+       (and the end of stream marker) take two. Anything left in the input that
+       wasn't used by one of those must have been flag bytes. */
+    stats->flag_bits = stats->literals + 4 * c[PSO_PRS_COPY_SHORT].count +
+        2 * (c[PSO_PRS_COPY_LONG].count + c[PSO_PRS_COPY_EXTENDED].count + 1);
+    stats->flag_bytes = cxt.src_pos - stats->literals -
+        c[PSO_PRS_COPY_SHORT].count - 2 * c[PSO_PRS_COPY_LONG].count -
+        3 * c[PSO_PRS_COPY_EXTENDED].count - 2;
+
+    return rv;
+}
+
+int pso_prs_decompress_file(const char *fn, uint8_t **dst) {
+    struct pso_io_map m;
+    int rv;
+
+    if(!fn || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    /* Map the whole file (or read it in, if we can't), rather than reading it
+       from the file a byte at a time while we decode it. */
+    if((rv = pso_io_map_file(fn, &m)))
+        return rv;
+
+    /* The minimum length of a PRS compressed file (if you were to "compress" a
+       zero-byte file) is 3 bytes. If we don't have that, then bail out now. */
+    if(m.len < 3) {
+        pso_io_unmap(&m);
+        return PSOARCHIVE_EBADMSG;
+    }
+
+    /* Now that the data is in memory, decompress it like any other buffer. */
+    rv = pso_prs_decompress_buf(m.data, dst, m.len);
+
+    pso_io_unmap(&m);
+    return rv;
+}
+
+static void batch_item(void *d, size_t item, int worker) {
+    pso_prs_batch_item_t *it = (pso_prs_batch_item_t *)d + item;
+
+    (void)worker;
+    it->result = pso_prs_decompress_buf2(it->src, it->dst, it->src_len,
+                                         it->dst_len);
+}
+
+int pso_prs_decompress_batch(pso_prs_batch_item_t *items, size_t count,
+                             int threads) {
+    if(!items)
+        return PSOARCHIVE_EFAULT;
+
+    if(!count)
+        return PSOARCHIVE_OK;
+
+    return pso_pool_run(pso_pool_workers(threads, count), count, &batch_item,
+                        items);
+}
+
+/******************************************************************************
+    Interleaved decompression
+
+    Decoding a single PRS stream is one long chain of dependent loads and
+    branches, so a modern CPU spends most of its time waiting on the previous
+    step. By stepping several independent streams one token at a time in turn,
+    the CPU has the work from the other streams to overlap with each of those
+    waits. Each lane is decoded with decode_step, exactly as
+    pso_prs_decompress_buf2 would decode it.
+ ******************************************************************************/
+#define INTERLEAVE_LANES    8
+
+struct prs_lane {
+    struct prs_dec_cxt cxt;
+    pso_prs_batch_item_t *item;
+};
+
+/* Set up a lane to decode an item, or fill in the item's result right away if
+   there's something wrong with it. Returns non-zero if the lane is ready. */
+static int lane_start(struct prs_lane *l, pso_prs_batch_item_t *it) {
+    if(!it->src || !it->dst) {
+        it->result = PSOARCHIVE_EFAULT;
+        return 0;
+    }
+
+    if(!it->src_len || !it->dst_len) {
+        it->result = PSOARCHIVE_EINVAL;
+        return 0;
+    }
+
+    if(it->src_len < 3) {
+        it->result = PSOARCHIVE_EBADMSG;
+        return 0;
+    }
+
+    memset(&l->cxt, 0, sizeof(struct prs_dec_cxt));
+    l->cxt.src = it->src;
+    l->cxt.dst = it->dst;
+    l->cxt.src_len = it->src_len;
+    l->cxt.dst_len = it->dst_len;
+    l->cxt.copy_byte = &copy_byte;
+    l->cxt.offset_copy = &offset_copy;
+    l->cxt.fetch_bit = &fetch_bit;
+    l->cxt.fetch_byte = &fetch_byte;
+    l->cxt.fetch_short = &fetch_short;
+    l->item = it;
+
+    return 1;
+}
+
+int pso_prs_decompress_interleaved(pso_prs_batch_item_t *items, size_t count) {
+    struct prs_lane lanes[INTERLEAVE_LANES];
+    int active = 0, i, r;
+    size_t next = 0;
+
+    if(!items)
+        return PSOARCHIVE_EFAULT;
+
+    for(;;) {
+        /* Keep all the lanes full while there's still work to hand out. */
+        while(active < INTERLEAVE_LANES && next < count) {
+            if(lane_start(&lanes[active], &items[next++]))
+                ++active;
+        }
+
+        if(!active)
+            break;
+
+        /* Step each lane by one token. When a lane finishes, move the last
+           lane into its place and check the same slot again. */
+        for(i = 0; i < active;) {
+            if(!(r = decode_step(&lanes[i].cxt))) {
+                ++i;
+                continue;
+            }
+
+            if(r > 0)
+                r = (int)lanes[i].cxt.dst_pos;
+
+            lanes[i].item->result = r;
+            lanes[i] = lanes[--active];
+
+            /* Refill the lane right away so we don't run short of lanes
+               while draining the rest. */
+            while(next < count) {
+                if(lane_start(&lanes[active], &items[next++])) {
+                    ++active;
+                    break;
+                }
+            }
+        }
+    }
+
+    return PSOARCHIVE_OK;
+}
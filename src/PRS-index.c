@@ -0,0 +1,633 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    PRS Seek Index
+
+    A PRS stream can only be decoded from the beginning, since every match may
+    refer to anything in the 8KiB of output before it. However, the entire state
+    of the streaming decoder (see PRS-stream.c) at any point in the stream is
+    just its position in the input, the partially used flag byte, any match
+    that is part way through being copied, and the 8KiB window. By saving that
+    state every so often (a "checkpoint"), decoding can be restarted from any
+    of those points later on.
+
+    Checkpoints are taken at every multiple of the index interval in the
+    output, so finding the right one to start from for any offset is just a
+    matter of division. Since each checkpoint is independent of the others,
+    they also let us decode different parts of a stream on different threads.
+
+    The index can be saved to a file alongside the compressed data. All values
+    in the file are stored in little-endian byte order:
+        4 bytes - Magic number 'PRSI'
+        4 bytes - Version (currently 1)
+        4 bytes - Index interval
+        4 bytes - Number of checkpoints
+        4 bytes - Length of the compressed data
+        4 bytes - Length of the decompressed data
+    Followed by each checkpoint:
+        4 bytes - Offset in the compressed data
+        4 bytes - Offset in the decompressed data
+        1 byte  - Decoder state
+        1 byte  - Remaining flag bits
+        1 byte  - Number of remaining flag bits
+        1 byte  - Padding (always zero)
+        2 bytes - Length remaining of the match being copied
+        2 bytes - Distance back of the match being copied
+        n bytes - Window contents, where n is the smaller of the decompressed
+                  offset and 8192
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "PRS-common.h"
+#include "thread-pool.h"
+
+#define INDEX_VERSION   1
+#define CP_HDR_SIZE     16
+
+struct prs_checkpoint {
+    uint32_t in_off;
+    uint32_t out_off;
+    uint8_t state;
+    uint8_t flags;
+    uint8_t bit_pos;
+    uint16_t copy_len;
+    uint16_t back;
+    size_t win_off;
+};
+
+struct pso_prs_index {
+    uint32_t interval;
+    uint32_t count;
+    uint32_t src_len;
+    uint32_t out_len;
+
+    struct prs_checkpoint *cps;
+    uint8_t *windows;
+};
+
+#define WIN_LEN(cp) \
+    ((cp)->out_off < PRS_WINDOW_SIZE ? (cp)->out_off : PRS_WINDOW_SIZE)
+
+static void put32(uint8_t *b, uint32_t v) {
+    b[0] = (uint8_t)v;
+    b[1] = (uint8_t)(v >> 8);
+    b[2] = (uint8_t)(v >> 16);
+    b[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get32(const uint8_t *b) {
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static pso_error_t add_checkpoint(pso_prs_index_t *idx, size_t *allocd,
+                                  size_t *win_allocd, size_t *win_used,
+                                  const struct pso_prs_stream *s) {
+    struct prs_checkpoint *cp;
+    size_t wl;
+    void *tmp;
+
+    /* Make sure we have space for the checkpoint... */
+    if(idx->count == *allocd) {
+        tmp = realloc(idx->cps, *allocd * 2 * sizeof(struct prs_checkpoint));
+        if(!tmp)
+            return PSOARCHIVE_EMEM;
+
+        idx->cps = (struct prs_checkpoint *)tmp;
+        *allocd *= 2;
+    }
+
+    cp = &idx->cps[idx->count];
+    cp->in_off = (uint32_t)s->total_in;
+    cp->out_off = (uint32_t)s->total_out;
+    cp->state = (uint8_t)s->state;
+    cp->flags = s->flags;
+    cp->bit_pos = (uint8_t)s->bit_pos;
+    cp->copy_len = (uint16_t)(cp->state == PRS_ST_COPY ? s->copy_len : 0);
+    cp->back = (uint16_t)(cp->state == PRS_ST_COPY ? -s->offset : 0);
+    cp->win_off = *win_used;
+
+    /* ... and for its window. */
+    wl = WIN_LEN(cp);
+
+    while(*win_used + wl > *win_allocd) {
+        if(!(tmp = realloc(idx->windows, *win_allocd * 2)))
+            return PSOARCHIVE_EMEM;
+
+        idx->windows = (uint8_t *)tmp;
+        *win_allocd *= 2;
+    }
+
+    /* Until the window has been filled once, only the start of it is in use,
+       so there's no need to keep the rest of it. */
+    memcpy(idx->windows + *win_used, s->window, wl);
+    *win_used += wl;
+    ++idx->count;
+
+    return PSOARCHIVE_OK;
+}
+
+static void restore_checkpoint(struct pso_prs_stream *s,
+                               const pso_prs_index_t *idx,
+                               const struct prs_checkpoint *cp) {
+    pso_prs_stream_reset(s);
+
+    s->state = cp->state;
+    s->flags = cp->flags;
+    s->bit_pos = cp->bit_pos;
+    s->copy_len = cp->copy_len;
+    s->offset = -(int)cp->back;
+    s->total_in = cp->in_off;
+    s->total_out = cp->out_off;
+    memcpy(s->window, idx->windows + cp->win_off, WIN_LEN(cp));
+}
+
+pso_prs_index_t *pso_prs_index_build(const uint8_t *src, size_t src_len,
+                                     size_t interval, pso_error_t *err) {
+    pso_prs_index_t *rv;
+    struct pso_prs_stream s;
+    pso_error_t erv;
+    size_t allocd = 16, win_allocd = PRS_WINDOW_SIZE * 4, win_used = 0;
+    size_t next, amt, dl;
+    uint8_t buf[4096], *dp;
+    const uint8_t *sp = src;
+    size_t sl = src_len;
+    int r = PSOARCHIVE_OK;
+
+    if(!src) {
+        erv = PSOARCHIVE_EFAULT;
+        goto ret_err;
+    }
+
+    if(src_len < 3 || src_len > UINT32_MAX) {
+        erv = PSOARCHIVE_EINVAL;
+        goto ret_err;
+    }
+
+    if(!interval)
+        interval = PSO_PRS_INDEX_INTERVAL;
+
+    if(interval > UINT32_MAX) {
+        erv = PSOARCHIVE_EINVAL;
+        goto ret_err;
+    }
+
+    /* Allocate the index and some space for checkpoints in it. */
+    if(!(rv = (pso_prs_index_t *)malloc(sizeof(pso_prs_index_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_err;
+    }
+
+    rv->interval = (uint32_t)interval;
+    rv->count = 0;
+    rv->src_len = (uint32_t)src_len;
+    rv->out_len = 0;
+    rv->windows = NULL;
+
+    if(!(rv->cps = (struct prs_checkpoint *)
+         malloc(allocd * sizeof(struct prs_checkpoint)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_index;
+    }
+
+    if(!(rv->windows = (uint8_t *)malloc(win_allocd))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_index;
+    }
+
+    pso_prs_stream_reset(&s);
+    next = 0;
+
+    /* Decode the whole stream, stopping at each multiple of the interval to
+       save where we are. */
+    while(r != PSO_PRS_STREAM_END) {
+        if(s.total_out == next) {
+            if((erv = add_checkpoint(rv, &allocd, &win_allocd, &win_used, &s)))
+            goto ret_index;
+
+            next += interval;
+        }
+
+        amt = next - s.total_out;
+        dl = amt > sizeof(buf) ? sizeof(buf) : amt;
+        dp = buf;
+
+        if((r = pso_prs_stream_decompress(&s, &sp, &sl, &dp, &dl)) < 0) {
+            erv = (pso_error_t)r;
+            goto ret_index;
+        }
+
+        /* If we didn't fill up the output or reach the end, then we ran out of
+           input, and the stream is truncated. */
+        if(r != PSO_PRS_STREAM_END && dl) {
+            erv = PSOARCHIVE_EBADMSG;
+            goto ret_index;
+        }
+
+        if(s.total_out > INT32_MAX) {
+            erv = PSOARCHIVE_ERANGE;
+            goto ret_index;
+        }
+    }
+
+    rv->out_len = (uint32_t)s.total_out;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_index:
+    pso_prs_index_free(rv);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+pso_error_t pso_prs_index_free(pso_prs_index_t *idx) {
+    if(!idx)
+        return PSOARCHIVE_EFAULT;
+
+    free(idx->windows);
+    free(idx->cps);
+    free(idx);
+
+    return PSOARCHIVE_OK;
+}
+
+int pso_prs_index_size(const pso_prs_index_t *idx) {
+    if(!idx)
+        return PSOARCHIVE_EFAULT;
+
+    return (int)idx->out_len;
+}
+
+pso_error_t pso_prs_index_save(const pso_prs_index_t *idx, const char *fn) {
+    FILE *fp;
+    uint8_t buf[24];
+    uint32_t i;
+    const struct prs_checkpoint *cp;
+
+    if(!idx || !fn)
+        return PSOARCHIVE_EFAULT;
+
+    if(!(fp = fopen(fn, "wb")))
+        return PSOARCHIVE_EFILE;
+
+    buf[0] = 'P';
+    buf[1] = 'R';
+    buf[2] = 'S';
+    buf[3] = 'I';
+    put32(buf + 4, INDEX_VERSION);
+    put32(buf + 8, idx->interval);
+    put32(buf + 12, idx->count);
+    put32(buf + 16, idx->src_len);
+    put32(buf + 20, idx->out_len);
+
+    if(fwrite(buf, 1, 24, fp) != 24)
+        goto ret_io;
+
+    for(i = 0; i < idx->count; ++i) {
+        cp = &idx->cps[i];
+
+        put32(buf, cp->in_off);
+        put32(buf + 4, cp->out_off);
+        buf[8] = cp->state;
+        buf[9] = cp->flags;
+        buf[10] = cp->bit_pos;
+        buf[11] = 0;
+        buf[12] = (uint8_t)cp->copy_len;
+        buf[13] = (uint8_t)(cp->copy_len >> 8);
+        buf[14] = (uint8_t)cp->back;
+        buf[15] = (uint8_t)(cp->back >> 8);
+
+        if(fwrite(buf, 1, CP_HDR_SIZE, fp) != CP_HDR_SIZE)
+            goto ret_io;
+
+        if(fwrite(idx->windows + cp->win_off, 1, WIN_LEN(cp), fp) !=
+           WIN_LEN(cp))
+            goto ret_io;
+    }
+
+    if(fclose(fp))
+        return PSOARCHIVE_EIO;
+
+    return PSOARCHIVE_OK;
+
+ret_io:
+    fclose(fp);
+    return PSOARCHIVE_EIO;
+}
+
+pso_prs_index_t *pso_prs_index_load(const char *fn, pso_error_t *err) {
+    FILE *fp;
+    pso_prs_index_t *rv;
+    pso_error_t erv = PSOARCHIVE_EFATAL;
+    uint8_t buf[24];
+    uint32_t i;
+    size_t win_used = 0, win_len, wl;
+    long file_len;
+    struct prs_checkpoint *cp;
+
+    if(!fn) {
+        erv = PSOARCHIVE_EFAULT;
+        goto ret_err;
+    }
+
+    if(!(fp = fopen(fn, "rb"))) {
+        erv = PSOARCHIVE_EFILE;
+        goto ret_err;
+    }
+
+    /* Read the header and make sure it looks like one of ours. */
+    if(fread(buf, 1, 24, fp) != 24 || buf[0] != 'P' || buf[1] != 'R' ||
+       buf[2] != 'S' || buf[3] != 'I') {
+        erv = PSOARCHIVE_NOARCHIVE;
+        goto ret_file;
+    }
+
+    if(get32(buf + 4) != INDEX_VERSION) {
+        erv = PSOARCHIVE_ENOTSUPP;
+        goto ret_file;
+    }
+
+    if(!(rv = (pso_prs_index_t *)malloc(sizeof(pso_prs_index_t)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_file;
+    }
+
+    rv->interval = get32(buf + 8);
+    rv->count = get32(buf + 12);
+    rv->src_len = get32(buf + 16);
+    rv->out_len = get32(buf + 20);
+    rv->cps = NULL;
+    rv->windows = NULL;
+
+    /* There's always at least the checkpoint at the start of the stream, and
+       there's one for each interval's worth of output. */
+    if(!rv->interval || !rv->count || rv->out_len > INT32_MAX ||
+       rv->count - 1 > rv->out_len / rv->interval) {
+        erv = PSOARCHIVE_EBADMSG;
+        goto ret_index;
+    }
+
+    /* Make sure the file is actually big enough to hold all the checkpoints
+       before allocating anything based on the count. Each checkpoint's window
+       is as much of the output before it as fits in 8KiB. */
+    if(fseek(fp, 0, SEEK_END) || (file_len = ftell(fp)) < 24 ||
+       fseek(fp, 24, SEEK_SET)) {
+        erv = PSOARCHIVE_EIO;
+        goto ret_index;
+    }
+
+    if(rv->count > ((unsigned long)file_len - 24) / CP_HDR_SIZE) {
+        erv = PSOARCHIVE_EBADMSG;
+        goto ret_index;
+    }
+
+    win_len = 0;
+
+    for(i = 0; i < rv->count; ++i) {
+        wl = (size_t)i * rv->interval;
+        if(wl > PRS_WINDOW_SIZE)
+            wl = PRS_WINDOW_SIZE;
+
+        if(win_len > SIZE_MAX - wl) {
+            erv = PSOARCHIVE_EBADMSG;
+            goto ret_index;
+        }
+
+        win_len += wl;
+    }
+
+    if(win_len > (unsigned long)file_len - 24 -
+       (unsigned long)rv->count * CP_HDR_SIZE) {
+        erv = PSOARCHIVE_EBADMSG;
+        goto ret_index;
+    }
+
+    if(!(rv->cps = (struct prs_checkpoint *)
+         malloc(rv->count * sizeof(struct prs_checkpoint)))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_index;
+    }
+
+    if(!(rv->windows = (uint8_t *)malloc(win_len ? win_len : 1))) {
+        erv = PSOARCHIVE_EMEM;
+        goto ret_index;
+    }
+
+    for(i = 0; i < rv->count; ++i) {
+        cp = &rv->cps[i];
+
+        if(fread(buf, 1, CP_HDR_SIZE, fp) != CP_HDR_SIZE) {
+            erv = PSOARCHIVE_EIO;
+            goto ret_index;
+        }
+
+        cp->in_off = get32(buf);
+        cp->out_off = get32(buf + 4);
+        cp->state = buf[8];
+        cp->flags = buf[9];
+        cp->bit_pos = buf[10];
+        cp->copy_len = buf[12] | (buf[13] << 8);
+        cp->back = buf[14] | (buf[15] << 8);
+        cp->win_off = win_used;
+
+        /* Sanity check... Checkpoints are only ever taken at the start of the
+           stream or when the decoder is waiting for space to output into. */
+        if(cp->out_off != i * rv->interval || cp->in_off > rv->src_len ||
+           cp->out_off > rv->out_len || cp->bit_pos > 8 ||
+           cp->copy_len > 256 || cp->back > PRS_WINDOW_SIZE ||
+           (cp->state != PRS_ST_FLAG && cp->state != PRS_ST_LITERAL &&
+            cp->state != PRS_ST_COPY)) {
+            erv = PSOARCHIVE_EBADMSG;
+            goto ret_index;
+        }
+
+        wl = WIN_LEN(cp);
+
+        if(fread(rv->windows + win_used, 1, wl, fp) != wl) {
+            erv = PSOARCHIVE_EIO;
+            goto ret_index;
+        }
+
+        win_used += wl;
+    }
+
+    fclose(fp);
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+
+ret_index:
+    pso_prs_index_free(rv);
+ret_file:
+    fclose(fp);
+ret_err:
+    if(err)
+        *err = erv;
+
+    return NULL;
+}
+
+/* Decode len bytes (or until the end of the stream) into dst from wherever the
+   stream was left. */
+static int decode_from(struct pso_prs_stream *s, const uint8_t *src,
+                       size_t src_len, uint8_t *dst, size_t len) {
+    const uint8_t *sp = src + s->total_in;
+    size_t sl = src_len - s->total_in, dl = len;
+    int r;
+
+    if((r = pso_prs_stream_decompress(s, &sp, &sl, &dst, &dl)) < 0)
+        return r;
+
+    /* If we didn't fill up the output or reach the end, then we ran out of
+       input, and the stream is truncated. */
+    if(r != PSO_PRS_STREAM_END && dl)
+        return PSOARCHIVE_EBADMSG;
+
+    return (int)(len - dl);
+}
+
+int pso_prs_decompress_range(const uint8_t *src, size_t src_len,
+                             const pso_prs_index_t *idx, size_t offset,
+                             uint8_t *dst, size_t len) {
+    struct pso_prs_stream s;
+    uint32_t cpn;
+    size_t skip, amt;
+    int r;
+
+    if(!src || !idx || (len && !dst))
+        return PSOARCHIVE_EFAULT;
+
+    /* Make sure the index is for this data. */
+    if(src_len != idx->src_len)
+        return PSOARCHIVE_EINVAL;
+
+    if(offset > idx->out_len)
+        return PSOARCHIVE_ERANGE;
+
+    if(len > idx->out_len - offset)
+        len = idx->out_len - offset;
+
+    if(!len)
+        return 0;
+
+    /* Start from the closest checkpoint before the data we want. */
+    cpn = (uint32_t)(offset / idx->interval);
+
+    if(cpn >= idx->count)
+        cpn = idx->count - 1;
+
+    restore_checkpoint(&s, idx, &idx->cps[cpn]);
+
+    /* Decode and throw away anything between the checkpoint and the start of
+       what we want, using the caller's buffer as scratch space. */
+    skip = offset - idx->cps[cpn].out_off;
+
+    while(skip) {
+        amt = skip > len ? len : skip;
+
+        if((r = decode_from(&s, src, src_len, dst, amt)) < 0)
+            return r;
+        else if((size_t)r != amt)
+            return PSOARCHIVE_EBADMSG;
+
+        skip -= amt;
+    }
+
+    return decode_from(&s, src, src_len, dst, len);
+}
+
+struct par_cxt {
+    const uint8_t *src;
+    size_t src_len;
+    const pso_prs_index_t *idx;
+    uint8_t *dst;
+    int err;
+};
+
+static void par_segment(void *d, size_t item, int worker) {
+    struct par_cxt *c = (struct par_cxt *)d;
+    const struct prs_checkpoint *cp = &c->idx->cps[item];
+    struct pso_prs_stream s;
+    size_t end;
+    int r;
+
+    (void)worker;
+
+    /* Each segment runs from its checkpoint up to the next one. */
+    if(item + 1 < c->idx->count)
+        end = c->idx->cps[item + 1].out_off;
+    else
+        end = c->idx->out_len;
+
+    restore_checkpoint(&s, c->idx, cp);
+    r = decode_from(&s, c->src, c->src_len, c->dst + cp->out_off,
+                    end - cp->out_off);
+
+    if(r >= 0 && (size_t)r != end - cp->out_off)
+        r = PSOARCHIVE_EBADMSG;
+
+    /* Any error will do, so don't bother locking around this. */
+    if(r < 0)
+        c->err = r;
+}
+
+int pso_prs_decompress_parallel(const uint8_t *src, size_t src_len,
+                                const pso_prs_index_t *idx, uint8_t *dst,
+                                size_t dst_len, int threads) {
+    struct par_cxt c;
+    pso_error_t rv;
+
+    if(!src || !idx || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    /* Make sure the index is for this data. */
+    if(src_len != idx->src_len)
+        return PSOARCHIVE_EINVAL;
+
+    if(dst_len < idx->out_len)
+        return PSOARCHIVE_ENOSPC;
+
+    c.src = src;
+    c.src_len = src_len;
+    c.idx = idx;
+    c.dst = dst;
+    c.err = PSOARCHIVE_OK;
+
+    rv = pso_pool_run(pso_pool_workers(threads, idx->count), idx->count,
+                      &par_segment, &c);
+
+    if(rv)
+        return rv;
+    else if(c.err)
+        return c.err;
+
+    return (int)idx->out_len;
+}
@@ -0,0 +1,271 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    PRS Streaming Decompression
+
+    The decompressor in PRS-decomp.c needs to have either the whole output
+    buffer or the whole input file available to it, since matches are copied
+    directly out of the output that has already been written. This version of
+    the decoder instead keeps the last 8KiB of output in a ring buffer (which is
+    all that a PRS stream can ever refer back to) and keeps all of the rest of
+    its state in the stream context. That way, the caller can feed it input and
+    pull output in whatever sized pieces are convenient, and the decoder can be
+    suspended at any point (including in the middle of a token) when it runs out
+    of either.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PRS-common.h"
+
+pso_prs_stream_t *pso_prs_stream_new(pso_error_t *err) {
+    pso_prs_stream_t *rv;
+
+    if(!(rv = (pso_prs_stream_t *)malloc(sizeof(pso_prs_stream_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    pso_prs_stream_reset(rv);
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
+pso_error_t pso_prs_stream_reset(pso_prs_stream_t *s) {
+    if(!s)
+        return PSOARCHIVE_EFAULT;
+
+    /* The window doesn't need to be cleared, since any reference to data that
+       hasn't been written yet is rejected as invalid. */
+    s->state = PRS_ST_FLAG;
+    s->bit_pos = 0;
+    s->flags = 0;
+    s->tmp = 0;
+    s->copy_len = 0;
+    s->offset = 0;
+    s->total_in = 0;
+    s->total_out = 0;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_prs_stream_free(pso_prs_stream_t *s) {
+    if(!s)
+        return PSOARCHIVE_EFAULT;
+
+    free(s);
+    return PSOARCHIVE_OK;
+}
+
+/* Fetch the next flag bit into the variable v, suspending the decoder if there
+   isn't a flag byte available to read it from. */
+#define GET_BIT(v) { \
+    if(!bit_pos) { \
+        if(in == in_end) \
+            goto suspend; \
+        flags = *in++; \
+        bit_pos = 8; \
+    } \
+    v = flags & 1; \
+    flags >>= 1; \
+    --bit_pos; \
+}
+
+/* Suspend the decoder if there isn't an input byte available. */
+#define NEED_INPUT() { \
+    if(in == in_end) \
+        goto suspend; \
+}
+
+int pso_prs_stream_decompress(pso_prs_stream_t *s, const uint8_t **src,
+                              size_t *src_len, uint8_t **dst, size_t *dst_len) {
+    const uint8_t *in, *in_end;
+    uint8_t *out, *out_end;
+    uint8_t *win;
+    uint8_t flags, b;
+    int bit_pos, bit, state, copy_len, offset;
+    size_t pos;
+    int rv = PSOARCHIVE_OK;
+
+    if(!s || !src || !src_len || !dst || !dst_len)
+        return PSOARCHIVE_EFAULT;
+
+    if((*src_len && !*src) || (*dst_len && !*dst))
+        return PSOARCHIVE_EFAULT;
+
+    /* Don't go any further if we've already hit the end (or an error). */
+    if(s->state == PRS_ST_END)
+        return PSO_PRS_STREAM_END;
+    else if(s->state == PRS_ST_ERROR)
+        return PSOARCHIVE_EBADMSG;
+
+    /* Pull everything into locals while we work, and put it back into the
+       stream context whenever we have to stop. */
+    in = *src;
+    in_end = in + *src_len;
+    out = *dst;
+    out_end = out + *dst_len;
+    win = s->window;
+    flags = s->flags;
+    bit_pos = s->bit_pos;
+    state = s->state;
+    copy_len = s->copy_len;
+    offset = s->offset;
+    pos = s->total_out;
+
+    for(;;) {
+        switch(state) {
+            case PRS_ST_FLAG:
+                /* Flag bit = 1 -> Simple byte copy from src to dst. */
+                GET_BIT(bit);
+                state = bit ? PRS_ST_LITERAL : PRS_ST_CMD;
+                break;
+
+            case PRS_ST_LITERAL:
+                NEED_INPUT();
+
+                if(out == out_end)
+                    goto suspend;
+
+                b = *in++;
+                win[pos++ & PRS_WINDOW_MASK] = b;
+                *out++ = b;
+                state = PRS_ST_FLAG;
+                break;
+
+            case PRS_ST_CMD:
+                /* Flag bit = 1 -> Either long copy or end of file.
+                   Flag bit = 0 -> Short copy. */
+                GET_BIT(bit);
+                state = bit ? PRS_ST_LONG_LO : PRS_ST_SHORT_SZ1;
+                break;
+
+            case PRS_ST_SHORT_SZ1:
+                GET_BIT(bit);
+                s->tmp = bit << 1;
+                state = PRS_ST_SHORT_SZ2;
+                break;
+
+            case PRS_ST_SHORT_SZ2:
+                GET_BIT(bit);
+                copy_len = (s->tmp | bit) + 2;
+                state = PRS_ST_SHORT_OFF;
+                break;
+
+            case PRS_ST_SHORT_OFF:
+                NEED_INPUT();
+                offset = (int)*in++ - 0x100;
+                state = PRS_ST_COPY;
+                break;
+
+            case PRS_ST_LONG_LO:
+                NEED_INPUT();
+                s->tmp = *in++;
+                state = PRS_ST_LONG_HI;
+                break;
+
+            case PRS_ST_LONG_HI:
+                NEED_INPUT();
+                s->tmp |= *in++ << 8;
+
+                /* Two zero bytes implies that this is the end of the file. */
+                if(!s->tmp) {
+                    state = PRS_ST_END;
+                    rv = PSO_PRS_STREAM_END;
+                    goto suspend;
+                }
+
+                /* Do we need to read a size byte, or is it encoded in what we
+                   already got? */
+                copy_len = s->tmp & 0x0007;
+                offset = (s->tmp >> 3) - 0x2000;
+
+                if(!copy_len) {
+                    state = PRS_ST_LONG_SZ;
+                }
+                else {
+                    copy_len += 2;
+                    state = PRS_ST_COPY;
+                }
+                break;
+
+            case PRS_ST_LONG_SZ:
+                NEED_INPUT();
+                copy_len = *in++ + 1;
+                state = PRS_ST_COPY;
+                break;
+
+            case PRS_ST_COPY:
+                /* Make sure the offset is valid. */
+                if((size_t)-offset > pos) {
+                    state = PRS_ST_ERROR;
+                    rv = PSOARCHIVE_EBADMSG;
+                    goto suspend;
+                }
+
+                /* Copy the data (or at least as much as we have room for). */
+                while(copy_len && out != out_end) {
+                    b = win[(pos + offset) & PRS_WINDOW_MASK];
+                    win[pos++ & PRS_WINDOW_MASK] = b;
+                    *out++ = b;
+                    --copy_len;
+                }
+
+                if(copy_len)
+                    goto suspend;
+
+                state = PRS_ST_FLAG;
+                break;
+
+            case PRS_ST_END:
+                rv = PSO_PRS_STREAM_END;
+                goto suspend;
+
+            default:
+                state = PRS_ST_ERROR;
+                rv = PSOARCHIVE_EBADMSG;
+                goto suspend;
+        }
+    }
+
+suspend:
+    /* Save our state for the next time we're called and tell the caller how
+       much of each buffer we used up. */
+    s->flags = flags;
+    s->bit_pos = bit_pos;
+    s->state = state;
+    s->copy_len = copy_len;
+    s->offset = offset;
+    s->total_out = pos;
+    s->total_in += (size_t)(in - *src);
+
+    *src_len -= (size_t)(in - *src);
+    *src = in;
+    *dst_len -= (size_t)(out - *dst);
+    *dst = out;
+
+    return rv;
+}
@@ -17,14 +17,48 @@
     License along with this library. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "PRSD.h"
+
 struct prsd_crypt_cxt {
     uint32_t stream[56];
     uint32_t key;
     uint32_t pos;
 };
 
+/* A keystream object is just a context that has been set up for a key, but
+   not used for anything yet. */
+struct pso_prsd_key {
+    struct prsd_crypt_cxt cxt;
+};
+
 /* These functions are all for internal use only. */
 void pso_prsd_crypt_init(struct prsd_crypt_cxt *cxt, uint32_t key);
 void pso_prsd_crypt(struct prsd_crypt_cxt *cxt, void *d, uint32_t len);
+
+/* Move the context to the given word (4-byte) offset from the start of the
+   data, as if that many words had already been run through pso_prsd_crypt. The
+   context must have already been initialized with the key. */
+void pso_prsd_crypt_seek(struct prsd_crypt_cxt *cxt, uint32_t word);
+
+/* Set up a context for the given key, copying it from the keystream object if
+   one is given for the same key (or setting it up from scratch otherwise). */
+void pso_prsd_key_setup(struct prsd_crypt_cxt *cxt, uint32_t key,
+                        const struct pso_prsd_key *k);
+
+/* Decompress PRS data that is still encrypted, decrypting it as it is read with
+   the context given (which must be set up for the start of the data). These
+   work just like pso_prs_decompress_buf and pso_prs_decompress_buf2. */
+int pso_prs_decompress_crypt(const uint8_t *src, uint8_t **dst,
+                             size_t src_len, struct prsd_crypt_cxt *ccxt);
+int pso_prs_decompress_crypt2(const uint8_t *src, uint8_t *dst,
+                              size_t src_len, size_t dst_len,
+                              struct prsd_crypt_cxt *ccxt);
+
+/* Compress data with PRS compression into a preallocated buffer, encrypting the
+   output as it goes with the context given (if not NULL). This works just like
+   pso_prs_compress2. */
+int pso_prs_compress_crypt(const uint8_t *src, uint8_t *dst, size_t src_len,
+                           size_t dst_len, struct prsd_crypt_cxt *ccxt);
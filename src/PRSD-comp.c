@@ -37,7 +37,18 @@
 #include "PRS.h"
 
 size_t pso_prsd_max_compressed_size(size_t len) {
-    return pso_prsd_max_compressed_size(len) + 8;
+    return pso_prs_max_compressed_size(len) + 8;
+}
+
+static void write_header(uint8_t *db, size_t src_len, uint32_t key) {
+    db[0] = (uint8_t)src_len;
+    db[1] = (uint8_t)(src_len >> 8);
+    db[2] = (uint8_t)(src_len >> 16);
+    db[3] = (uint8_t)(src_len >> 24);
+    db[4] = (uint8_t)key;
+    db[5] = (uint8_t)(key >> 8);
+    db[6] = (uint8_t)(key >> 16);
+    db[7] = (uint8_t)(key >> 24);
 }
 
 int pso_prsd_archive(const uint8_t *src, uint8_t **dst, size_t src_len,
@@ -69,25 +80,20 @@ int pso_prsd_archive(const uint8_t *src, uint8_t **dst, size_t src_len,
     pso_prsd_crypt(&ccxt, db + 8, dl - 8);
 
     /* Fill in the header. */
-    db[0] = (uint8_t)src_len;
-    db[1] = (uint8_t)(src_len >> 8);
-    db[2] = (uint8_t)(src_len >> 16);
-    db[3] = (uint8_t)(src_len >> 24);
-    db[4] = (uint8_t)key;
-    db[5] = (uint8_t)(key >> 8);
-    db[6] = (uint8_t)(key >> 16);
-    db[7] = (uint8_t)(key >> 24);
+    write_header(db, src_len, key);
 
     /* We're done, return the length of the full buffer. */
     *dst = db;
     return rv + 8;
 }
 
-int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
-                      uint32_t key) {
-    uint8_t *db, *db2;
-    int rv;
+/* Compress the data straight into the buffer after the space for the header,
+   encrypting the output as the compressor finishes with it. */
+static int compress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                         size_t dst_len, uint32_t key,
+                         const pso_prsd_key_t *k) {
     struct prsd_crypt_cxt ccxt;
+    int rv;
 
     if(!src || !dst)
         return PSOARCHIVE_EFAULT;
@@ -95,37 +101,70 @@ int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
     if(!src_len)
         return PSOARCHIVE_EINVAL;
 
-    /* Ugly... But it'll work...
-       Compress the data into a temporary destination buffer. */
-    if((rv = pso_prs_compress(src, &db, src_len)) < 0)
+    /* Make sure we at least have room for the header and the smallest possible
+       PRS stream. */
+    if(dst_len < 11)
+        return PSOARCHIVE_ENOSPC;
+
+    pso_prsd_key_setup(&ccxt, key, k);
+
+    if((rv = pso_prs_compress_crypt(src, dst + 8, src_len, dst_len - 8,
+                                    &ccxt)) < 0)
         return rv;
 
-    /* Now that we know the full length, allocate space for the whole thing,
-       copy the compressed data over to the new buffer, and clean up the other
-       one. */
-    if(!(db2 = (uint8_t *)malloc((rv + 3) & 0xFFFFFFFC))) {
-        free(db);
+    /* Fill in the header. */
+    write_header(dst, src_len, key);
+
+    /* We're done, return the length of the full buffer. */
+    return rv + 8;
+}
+
+static int compress_buf(const uint8_t *src, uint8_t **dst, size_t src_len,
+                        uint32_t key, const pso_prsd_key_t *k) {
+    size_t dl;
+    uint8_t *db;
+    int rv;
+
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(!src_len)
+        return PSOARCHIVE_EINVAL;
+
+    /* Allocate enough space for the worst case, then shrink it down once we
+       know how big the output actually is. */
+    dl = pso_prsd_max_compressed_size(src_len);
+
+    if(!(db = (uint8_t *)malloc(dl)))
         return PSOARCHIVE_EMEM;
+
+    if((rv = compress_buf2(src, db, src_len, dl, key, k)) < 0) {
+        free(db);
+        return rv;
     }
 
-    memcpy(db2 + 8, db, rv);
-    free(db);
+    /* Resize the output (if realloc fails to resize it, then just use the
+       unshortened buffer). */
+    if(!(*dst = realloc(db, rv)))
+        *dst = db;
 
-    /* Encrypt the compressed data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, db2 + 8, rv);
+    return rv;
+}
 
-    /* Fill in the header. */
-    db2[0] = (uint8_t)src_len;
-    db2[1] = (uint8_t)(src_len >> 8);
-    db2[2] = (uint8_t)(src_len >> 16);
-    db2[3] = (uint8_t)(src_len >> 24);
-    db2[4] = (uint8_t)key;
-    db2[5] = (uint8_t)(key >> 8);
-    db2[6] = (uint8_t)(key >> 16);
-    db2[7] = (uint8_t)(key >> 24);
+int pso_prsd_compress(const uint8_t *src, uint8_t **dst, size_t src_len,
+                      uint32_t key) {
+    return compress_buf(src, dst, src_len, key, NULL);
+}
 
-    /* We're done, return the length of the full buffer. */
-    *dst = db2;
-    return rv + 8;
+int pso_prsd_compress2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                       size_t dst_len, uint32_t key) {
+    return compress_buf2(src, dst, src_len, dst_len, key, NULL);
+}
+
+int pso_prsd_compress_key(const uint8_t *src, uint8_t **dst, size_t src_len,
+                          const pso_prsd_key_t *key) {
+    if(!key)
+        return PSOARCHIVE_EFAULT;
+
+    return compress_buf(src, dst, src_len, key->cxt.key, key);
 }
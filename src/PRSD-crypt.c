@@ -41,8 +41,15 @@
     non-installed header file).
  ******************************************************************************/
 
+#include <string.h>
+
 #include "PRSD-common.h"
 
+#if defined(__SSE2__) && !defined(__BIG_ENDIAN__) && !defined(WORDS_BIGENDIAN)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
 #if defined(__BIG_ENDIAN__) || defined(WORDS_BIGENDIAN)
 #define LE32(x) (((x >> 24) & 0x00FF) | \
                  ((x >>  8) & 0xFF00) | \
@@ -52,10 +59,35 @@
 #define LE32(x) x
 #endif
 
+#ifdef USE_SSE2
+/* Subtract 4 words at b from the 4 words at a. */
+#define SUB4(a, b) \
+    _mm_storeu_si128((__m128i *)(a), \
+                     _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(a)), \
+                                   _mm_loadu_si128((const __m128i *)(b))))
+#endif
+
 static void mix_stream(struct prsd_crypt_cxt *cxt) {
     int i;
     uint32_t *ptr;
 
+#ifdef USE_SSE2
+    /* The first loop never reads anything that it writes, so it can be done
+       4 words at a time without any trouble. The second loop reads words 24
+       back from the ones it writes, so it can also be done 4 at a time, as
+       long as the groups are done in order. */
+    for(i = 6, ptr = cxt->stream + 1; i; --i, ptr += 4) {
+        SUB4(ptr, ptr + 31);
+    }
+
+    for(i = 7, ptr = cxt->stream + 25; i; --i, ptr += 4) {
+        SUB4(ptr, ptr - 24);
+    }
+
+    for(i = 3; i; --i, ++ptr) {
+        *ptr -= *(ptr - 24);
+    }
+#else
     for(i = 24, ptr = cxt->stream + 1; i; --i, ++ptr) {
         *ptr -= *(ptr + 31);
     }
@@ -63,6 +95,7 @@ static void mix_stream(struct prsd_crypt_cxt *cxt) {
     for(i = 31, ptr = cxt->stream + 25; i; --i, ++ptr) {
         *ptr -= *(ptr - 24);
     }
+#endif
 }
 
 void pso_prsd_crypt_init(struct prsd_crypt_cxt *cxt, uint32_t key) {
@@ -87,25 +120,294 @@ void pso_prsd_crypt_init(struct prsd_crypt_cxt *cxt, uint32_t key) {
     cxt->pos = 56;
 }
 
-static inline uint32_t crypt_dword(struct prsd_crypt_cxt *cxt, uint32_t data) {
-    if(cxt->pos == 56) {
-        mix_stream(cxt);
-        cxt->pos = 1;
+/* Jumping ahead in the stream.
+
+   Each time the stream is mixed, each word in it has the word 24 places back
+   in the overall sequence of words subtracted from it. If you line up every
+   block of the stream one after another, that works out to be the recurrence
+   u[n + 55] = u[n] - u[n + 31]. Since that is linear, any word later on in the
+   sequence is some fixed combination of the words in the initial block, and
+   the coefficients of that combination are just z^n reduced modulo the
+   polynomial z^55 + z^31 - 1. Those can be found with the usual square and
+   multiply approach in a handful of steps, rather than by mixing the stream
+   over and over again. All of this arithmetic is done modulo 2^32, just like
+   the mixing itself. */
+#define POLY_LEN    55
+
+/* r = a * b mod (z^55 + z^31 - 1). r may be the same as a or b. */
+static void poly_mulmod(uint32_t *r, const uint32_t *a, const uint32_t *b) {
+    uint32_t t[POLY_LEN * 2 - 1];
+    int i, j;
+
+    memset(t, 0, sizeof(t));
+
+    for(i = 0; i < POLY_LEN; ++i) {
+        if(!a[i])
+            continue;
+
+        for(j = 0; j < POLY_LEN; ++j) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+
+    /* Reduce from the top, using z^n = z^(n - 55) - z^(n - 24). */
+    for(i = POLY_LEN * 2 - 2; i >= POLY_LEN; --i) {
+        t[i - 55] += t[i];
+        t[i - 24] -= t[i];
+    }
+
+    memcpy(r, t, POLY_LEN * sizeof(uint32_t));
+}
+
+/* a = a * z mod (z^55 + z^31 - 1). */
+static void poly_mulz(uint32_t *a) {
+    uint32_t top = a[POLY_LEN - 1];
+
+    memmove(a + 1, a, (POLY_LEN - 1) * sizeof(uint32_t));
+    a[0] = top;
+    a[31] -= top;
+}
+
+void pso_prsd_crypt_seek(struct prsd_crypt_cxt *cxt, uint32_t word) {
+    uint32_t base[POLY_LEN], r[POLY_LEN], acc;
+    uint64_t e;
+    int i, j, bit;
+
+    /* Start over from the initial block for this key. */
+    pso_prsd_crypt_init(cxt, cxt->key);
+    memcpy(base, cxt->stream + 1, sizeof(base));
+
+    /* Word n of the output comes from block (n / 55) + 1 of the stream (the
+       block set up by the init function is never used directly). Figure out
+       the coefficients for the first word of that block. */
+    e = ((uint64_t)(word / POLY_LEN) + 1) * POLY_LEN;
+    memset(r, 0, sizeof(r));
+    r[0] = 1;
+
+    for(bit = 63; bit >= 0 && !((e >> bit) & 1); --bit) {
     }
 
-    return data ^ cxt->stream[cxt->pos++];
+    for(; bit >= 0; --bit) {
+        poly_mulmod(r, r, r);
+
+        if((e >> bit) & 1)
+            poly_mulz(r);
+    }
+
+    /* Fill in the block one word at a time, moving the coefficients along by
+       one word each time. */
+    for(i = 0; i < POLY_LEN; ++i) {
+        for(j = 0, acc = 0; j < POLY_LEN; ++j) {
+            acc += r[j] * base[j];
+        }
+
+        cxt->stream[i + 1] = acc;
+        poly_mulz(r);
+    }
+
+    cxt->pos = 1 + word % POLY_LEN;
+}
+
+/* XOR a run of words in the data with the same number of words from the
+   stream. */
+static inline void xor_words(uint32_t *data, const uint32_t *ks, uint32_t n) {
+    uint32_t tmp;
+
+#ifdef USE_SSE2
+    for(; n >= 4; n -= 4, data += 4, ks += 4) {
+        _mm_storeu_si128((__m128i *)data,
+                         _mm_xor_si128(_mm_loadu_si128((const __m128i *)data),
+                                       _mm_loadu_si128((const __m128i *)ks)));
+    }
+#endif
+
+    while(n--) {
+        tmp = LE32((*data)) ^ *ks++;
+        *data++ = LE32(tmp);
+    }
 }
 
 void pso_prsd_crypt(struct prsd_crypt_cxt *cxt, void *d, uint32_t len) {
     uint32_t *data = (uint32_t *)d;
-    uint32_t tmp;
+    uint32_t words, n;
 
     /* Round the size of the buffer to the next 4-byte boundary. */
-    len = (len + 3) & 0xFFFFFFFC;
+    words = ((len + 3) & 0xFFFFFFFC) >> 2;
 
-    while(len > 0) {
-        tmp = crypt_dword(cxt, LE32((*data)));
-        *data++ = LE32(tmp);
-        len -= 4;
+    /* Rather than going a word at a time, use up whatever is left of the
+       current block of the stream in one go, then mix up the next block. */
+    while(words > 0) {
+        if(cxt->pos == 56) {
+            mix_stream(cxt);
+            cxt->pos = 1;
+        }
+
+        n = 56 - cxt->pos;
+
+        if(n > words)
+            n = words;
+
+        xor_words(data, cxt->stream + cxt->pos, n);
+        cxt->pos += n;
+        data += n;
+        words -= n;
     }
 }
+
+/* Multi-buffer encryption.
+
+   Setting up the stream for a key is a long chain of steps that each depend on
+   the one before, and mixing the stream can only be done a few words at a time
+   for one key. The streams for different keys don't depend on each other at
+   all though, so here they're set up and mixed side by side, with word n of
+   each of the streams stored next to each other. That way, every step of the
+   setup and mixing works on all of the lanes at once, rather than waiting on
+   the step before it. This matters most for small buffers, where setting up
+   the key is most of the work. */
+#define LANES       8
+
+struct crypt_lanes {
+    uint32_t stream[56][LANES];
+};
+
+static void mix_lanes(struct crypt_lanes *c) {
+    int i;
+#ifndef USE_SSE2
+    int j;
+#endif
+
+    for(i = 1; i <= 24; ++i) {
+#ifdef USE_SSE2
+        SUB4(c->stream[i], c->stream[i + 31]);
+        SUB4(c->stream[i] + 4, c->stream[i + 31] + 4);
+#else
+        for(j = 0; j < LANES; ++j) {
+            c->stream[i][j] -= c->stream[i + 31][j];
+        }
+#endif
+    }
+
+    for(i = 25; i <= 55; ++i) {
+#ifdef USE_SSE2
+        SUB4(c->stream[i], c->stream[i - 24]);
+        SUB4(c->stream[i] + 4, c->stream[i - 24] + 4);
+#else
+        for(j = 0; j < LANES; ++j) {
+            c->stream[i][j] -= c->stream[i - 24][j];
+        }
+#endif
+    }
+}
+
+static void init_lanes(struct crypt_lanes *c, const uint32_t *keys) {
+    uint32_t i, idx, key[LANES], tmp[LANES];
+    int j;
+
+    for(j = 0; j < LANES; ++j) {
+        c->stream[55][j] = keys[j];
+        key[j] = keys[j];
+        tmp[j] = 1;
+    }
+
+    for(i = 0x15; i <= 0x46E; i += 0x15) {
+        idx = i % 55;
+
+        for(j = 0; j < LANES; ++j) {
+            key[j] -= tmp[j];
+            c->stream[idx][j] = tmp[j];
+            tmp[j] = key[j];
+            key[j] = c->stream[idx][j];
+        }
+    }
+
+    mix_lanes(c);
+    mix_lanes(c);
+    mix_lanes(c);
+    mix_lanes(c);
+}
+
+/* Encrypt up to LANES items at once. The setup for all of the keys and the
+   first block of the stream for each of them is done side by side, which takes
+   care of everything for small buffers. Anything longer than that carries on
+   from there on its own (which is already done in big chunks by
+   pso_prsd_crypt). */
+static void crypt_lanes(pso_prsd_crypt_item_t *items, int count) {
+    struct crypt_lanes c;
+    struct prsd_crypt_cxt cxt;
+    uint32_t keys[LANES], ks[55], tmp;
+    uint8_t *data;
+    size_t len, n, whole, left;
+    int i, j;
+
+    for(j = 0; j < LANES; ++j) {
+        keys[j] = j < count ? items[j].key : 0;
+    }
+
+    init_lanes(&c, keys);
+    mix_lanes(&c);
+
+    for(j = 0; j < count; ++j) {
+        data = items[j].data;
+        len = items[j].len;
+
+        /* Pull this lane's words of the first block out next to each other,
+           and use them on the start of the buffer. */
+        n = len > 55 * 4 ? 55 * 4 : len;
+
+        for(i = 0; i < 55; ++i) {
+            ks[i] = c.stream[i + 1][j];
+        }
+
+        xor_words((uint32_t *)data, ks, (uint32_t)(n >> 2));
+
+        /* If there's more than a block's worth, carry on with a normal
+           context, starting with the next block. */
+        if(len > n) {
+            for(i = 0; i < 56; ++i) {
+                cxt.stream[i] = c.stream[i][j];
+            }
+
+            cxt.key = keys[j];
+            cxt.pos = 56;
+
+            whole = (len - n) & ~(size_t)3;
+            pso_prsd_crypt(&cxt, data + n, (uint32_t)whole);
+            n += whole;
+        }
+
+        /* Do a partial word at the end outside of the buffer, so we don't
+           write past the end of it. */
+        if((left = len & 3)) {
+            tmp = 0;
+            memcpy(&tmp, data + len - left, left);
+
+            if(len > 55 * 4) {
+                pso_prsd_crypt(&cxt, &tmp, 4);
+            }
+            else {
+                tmp = LE32(tmp) ^ ks[len >> 2];
+                tmp = LE32(tmp);
+            }
+
+            memcpy(data + len - left, &tmp, left);
+        }
+    }
+}
+
+int pso_prsd_crypt_batch(pso_prsd_crypt_item_t *items, size_t count) {
+    size_t i;
+
+    if(!items)
+        return PSOARCHIVE_EFAULT;
+
+    for(i = 0; i < count; ++i) {
+        if(!items[i].data && items[i].len)
+            return PSOARCHIVE_EFAULT;
+    }
+
+    for(i = 0; i < count; i += LANES) {
+        crypt_lanes(items + i, count - i > LANES ? LANES : (int)(count - i));
+    }
+
+    return PSOARCHIVE_OK;
+}
@@ -34,88 +34,78 @@
 #include <stdlib.h>
 
 #include "PRSD-common.h"
+#include "PRS-common.h"
+#include "hash-common.h"
+#include "io-common.h"
+#include "thread-pool.h"
 #include "PRSD.h"
 #include "PRS.h"
 
+/* How much encrypted data to decrypt at a time when streaming. This must be a
+   multiple of 4 bytes. */
+#define STREAM_CHUNK    1024
+
+/* How much to read from a file at a time when streaming from a file
+   descriptor. This must be a multiple of 4 bytes. */
+#define FD_CHUNK        0x4000
+
+/* Smallest piece of data worth handing to its own thread when decrypting in
+   parallel. Jumping ahead in the stream costs about as much as decrypting this
+   much data. */
+#define DECRYPT_MIN_PIECE   0x40000
+
 int pso_prsd_decompress_file(const char *fn, uint8_t **dst) {
-    long len;
+    struct pso_io_map m;
     int rv;
-    FILE *fp;
-    uint8_t buf[8];
-    uint32_t key, unc_len;
-    uint8_t *cmp_buf;
-    struct prsd_crypt_cxt ccxt;
 
     if(!fn || !dst)
         return PSOARCHIVE_EFAULT;
 
-    if(!(fp = fopen(fn, "rb")))
-        return PSOARCHIVE_EFILE;
-
-    /* Figure out the length of the file. */
-    if(fseek(fp, 0, SEEK_END)) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    if((len = ftell(fp)) < 0) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
-
-    if(fseek(fp, 0, SEEK_SET)) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
+    /* Map the whole file (or read it in, if we can't). */
+    if((rv = pso_io_map_file(fn, &m)))
+        return rv;
 
     /* Every PRSD file has an 8-byte header and at least a minimal length PRS
        compressed/encrypted segment. Thus, the file must at least be 11 bytes
        in length. */
-    if(len < 11) {
-        fclose(fp);
+    if(m.len < 11) {
+        pso_io_unmap(&m);
         return PSOARCHIVE_EBADMSG;
     }
 
-    /* Read in the file header and parse it. */
-    if(fread(buf, 1, 8, fp) != 8) {
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
+    /* Now that the data is in memory, decrypt and decompress it like any other
+       buffer. */
+    rv = pso_prsd_decompress_buf(m.data, dst, m.len);
 
-    unc_len = buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
-    key = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
-    len -= 8;
+    pso_io_unmap(&m);
+    return rv;
+}
 
-    /* Allocate space for the compressed/encrypted data. */
-    if(!(cmp_buf = (uint8_t *)malloc((len + 3) & 0xFFFFFFFC))) {
-        fclose(fp);
-        return PSOARCHIVE_EMEM;
-    }
+/* The data is decrypted as it is decoded (see pso_prs_decompress_crypt in
+   PRS-decomp.c), so the input is never copied or modified, and nothing needs
+   to be allocated other than the output. */
+static int decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len,
+                          const pso_prsd_key_t *k) {
+    uint32_t key, unc_len;
+    struct prsd_crypt_cxt ccxt;
+    int rv;
 
-    /* Read in the data from the file. */
-    if(fread(cmp_buf, 1, len, fp) != len) {
-        free(cmp_buf);
-        fclose(fp);
-        return PSOARCHIVE_EIO;
-    }
+    /* Verify the input parameters. */
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
 
-    /* We're done with the file, close it. */
-    fclose(fp);
+    if(src_len < 11)
+        return PSOARCHIVE_EBADMSG;
 
-    /* Decrypt the file data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, cmp_buf, len);
+    /* Grab the uncompressed size and key from the source buffer. */
+    unc_len = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+    key = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
 
-    /* Now that we have the data decrypted, decompress it. */
-    if((rv = pso_prs_decompress_buf(cmp_buf, dst, len)) < 0) {
-        free(*dst);
-        free(cmp_buf);
-        *dst = NULL;
-        return rv;
-    }
+    /* Decrypt and decompress the file data. */
+    pso_prsd_key_setup(&ccxt, key, k);
 
-    /* Clean up the compressed buffer, we don't need it anymore. */
-    free(cmp_buf);
+    if((rv = pso_prs_decompress_crypt(src + 8, dst, src_len - 8, &ccxt)) < 0)
+        return rv;
 
     /* Does the uncompressed size match what we're expecting from the file
        header? */
@@ -130,8 +120,17 @@ int pso_prsd_decompress_file(const char *fn, uint8_t **dst) {
 }
 
 int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len) {
+    return decompress_buf(src, dst, src_len, NULL);
+}
+
+int pso_prsd_decompress_buf_key(const uint8_t *src, uint8_t **dst,
+                                size_t src_len, const pso_prsd_key_t *key) {
+    return decompress_buf(src, dst, src_len, key);
+}
+
+static int decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
+                           size_t dst_len, const pso_prsd_key_t *k) {
     uint32_t key, unc_len;
-    uint8_t *cmp_buf;
     struct prsd_crypt_cxt ccxt;
     int rv;
 
@@ -145,37 +144,22 @@ int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len) {
     /* Grab the uncompressed size and key from the source buffer. */
     unc_len = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
     key = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
-    src_len -= 8;
 
-    /* Allocate space for the compressed/encrypted data. */
-    if(!(cmp_buf = (uint8_t *)malloc((src_len + 3) & 0xFFFFFFFC)))
-        return PSOARCHIVE_EMEM;
-
-    /* Copy the data from the source buffer into our temporary one. */
-    memcpy(cmp_buf, src + 8, src_len);
+    /* Make sure the buffer the user gave us is big enough. */
+    if(dst_len < unc_len)
+        return PSOARCHIVE_ENOSPC;
 
-    /* Decrypt the file data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, cmp_buf, src_len);
+    /* Decrypt and decompress the file data. */
+    pso_prsd_key_setup(&ccxt, key, k);
 
-    /* Now that we have the data decrypted, decompress it. */
-    if((rv = pso_prs_decompress_buf(cmp_buf, dst, src_len)) < 0) {
-        free(*dst);
-        free(cmp_buf);
-        *dst = NULL;
+    if((rv = pso_prs_decompress_crypt2(src + 8, dst, src_len - 8, dst_len,
+                                       &ccxt)) < 0)
         return rv;
-    }
-
-    /* Clean up the temporary buffer, we don't need it anymore. */
-    free(cmp_buf);
 
     /* Does the uncompressed size match what we're expecting from the file
        header? */
-    if(rv != (int)unc_len) {
-        free(*dst);
-        *dst = NULL;
+    if(rv != (int)unc_len)
         return PSOARCHIVE_EFATAL;
-    }
 
     /* We're done, return the size of the uncompressed data. */
     return rv;
@@ -183,13 +167,89 @@ int pso_prsd_decompress_buf(const uint8_t *src, uint8_t **dst, size_t src_len) {
 
 int pso_prsd_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
                              size_t dst_len) {
-    uint32_t key, unc_len;
-    uint8_t *cmp_buf;
+    return decompress_buf2(src, dst, src_len, dst_len, NULL);
+}
+
+int pso_prsd_decompress_buf2_key(const uint8_t *src, uint8_t *dst,
+                                 size_t src_len, size_t dst_len,
+                                 const pso_prsd_key_t *key) {
+    return decompress_buf2(src, dst, src_len, dst_len, key);
+}
+
+int pso_prsd_decompress_size(const uint8_t *src, size_t src_len) {
+    /* Verify the input parameters. */
+    if(!src)
+        return PSOARCHIVE_EFAULT;
+
+    if(src_len < 11)
+        return PSOARCHIVE_EBADMSG;
+
+    return (int)(src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24));
+}
+
+/* Where the output of the streaming decoder goes. The output is collected in
+   the buffer here and passed on either to the callback (if there is one) or
+   written to the file descriptor each time it fills up. */
+struct stream_out {
+    uint8_t buf[PRS_WINDOW_SIZE];
+    size_t len;
+
+    pso_prs_hash_cb_t cb;
+    void *udata;
+    int fd;
+};
+
+static int stream_flush(struct stream_out *o) {
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    if(o->cb)
+        o->cb(o->udata, o->buf, o->len);
+    else
+        rv = pso_io_write(o->fd, o->buf, o->len);
+
+    o->len = 0;
+    return rv;
+}
+
+/* Run a piece of decrypted input through the streaming decoder. Returns
+   PSO_PRS_STREAM_END if the end of the stream was reached, 0 if more input is
+   needed, or a negative error code. */
+static int stream_feed(struct pso_prs_stream *s, struct stream_out *o,
+                       const uint8_t *ip, size_t il) {
+    uint8_t *op;
+    size_t ol;
+    int rv, err;
+
+    do {
+        op = o->buf + o->len;
+        ol = sizeof(o->buf) - o->len;
+
+        if((rv = pso_prs_stream_decompress(s, &ip, &il, &op, &ol)) < 0)
+            return rv;
+
+        o->len = sizeof(o->buf) - ol;
+
+        if(!ol || rv == PSO_PRS_STREAM_END) {
+            if((err = stream_flush(o)))
+                return err;
+        }
+    } while(il && rv != PSO_PRS_STREAM_END);
+
+    return rv;
+}
+
+int pso_prsd_verify_cb(const uint8_t *src, size_t src_len,
+                       pso_prs_hash_cb_t cb, void *udata) {
+    struct pso_prs_stream s;
     struct prsd_crypt_cxt ccxt;
-    int rv;
+    struct stream_out o;
+    uint8_t in[STREAM_CHUNK];
+    size_t amt;
+    uint32_t key, unc_len;
+    int rv = PSOARCHIVE_OK;
 
     /* Verify the input parameters. */
-    if(!src || !dst)
+    if(!src || !cb)
         return PSOARCHIVE_EFAULT;
 
     if(src_len < 11)
@@ -198,48 +258,339 @@ int pso_prsd_decompress_buf2(const uint8_t *src, uint8_t *dst, size_t src_len,
     /* Grab the uncompressed size and key from the source buffer. */
     unc_len = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
     key = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
+    src += 8;
     src_len -= 8;
 
-    /* Make sure the buffer the user gave us is big enough. */
-    if(dst_len < unc_len)
-        return PSOARCHIVE_ENOSPC;
+    pso_prsd_crypt_init(&ccxt, key);
+    pso_prs_stream_reset(&s);
+    o.len = 0;
+    o.cb = cb;
+    o.udata = udata;
+
+    /* Decrypt a small piece of the input at a time, and run it through the
+       streaming decoder, passing the output on each time the buffer fills. */
+    while(rv != PSO_PRS_STREAM_END) {
+        /* If we've run out of input before reaching the end of the stream,
+           then the data is truncated. */
+        if(!src_len)
+            return PSOARCHIVE_EBADMSG;
+
+        amt = src_len > STREAM_CHUNK ? STREAM_CHUNK : src_len;
+        memcpy(in, src, amt);
+        pso_prsd_crypt(&ccxt, in, (uint32_t)amt);
+        src += amt;
+        src_len -= amt;
+
+        if((rv = stream_feed(&s, &o, in, amt)) < 0)
+            return rv;
+    }
 
-    /* Allocate space for the compressed/encrypted data. */
-    if(!(cmp_buf = (uint8_t *)malloc((src_len + 3) & 0xFFFFFFFC)))
-        return PSOARCHIVE_EMEM;
+    /* Does the uncompressed size match what we're expecting from the file
+       header? */
+    if(s.total_out != unc_len)
+        return PSOARCHIVE_EFATAL;
 
-    /* Copy the data from the source buffer into our temporary one. */
-    memcpy(cmp_buf, src + 8, src_len);
+    return (int)s.total_out;
+}
 
-    /* Decrypt the file data. */
-    pso_prsd_crypt_init(&ccxt, key);
-    pso_prsd_crypt(&ccxt, cmp_buf, src_len);
+/* Everything needed to decode a PRSD file from a file descriptor. This is kept
+   off of the stack, since it's a bit big for that. */
+struct fd_cxt {
+    struct pso_prs_stream s;
+    struct prsd_crypt_cxt ccxt;
+    struct stream_out o;
+    uint8_t in[FD_CHUNK];
+};
 
-    /* Now that we have the data decrypted, decompress it. */
-    if((rv = pso_prs_decompress_buf2(cmp_buf, dst, src_len, dst_len)) < 0) {
-        free(cmp_buf);
-        return rv;
-    }
+static int decompress_fd(int fd, struct fd_cxt *c) {
+    uint8_t hdr[8];
+    uint32_t key, unc_len;
+    size_t have = 0, whole;
+    ssize_t bytes;
+    int rv = PSOARCHIVE_OK;
+
+    pso_io_advise(fd, PSO_IO_SEQUENTIAL);
+
+    /* Grab the uncompressed size and key from the header. */
+    if((bytes = pso_io_read(fd, hdr, 8)) < 0)
+        return (int)bytes;
+    else if(bytes != 8)
+        return PSOARCHIVE_EBADMSG;
+
+    unc_len = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16) | (hdr[3] << 24);
+    key = hdr[4] | (hdr[5] << 8) | (hdr[6] << 16) | (hdr[7] << 24);
+
+    pso_prsd_crypt_init(&c->ccxt, key);
+    pso_prs_stream_reset(&c->s);
+    c->o.len = 0;
 
-    /* Clean up the temporary buffer, we don't need it anymore. */
-    free(cmp_buf);
+    /* Read a chunk of the file at a time, decrypting and decoding it as we go.
+       Reads can come back short, so anything past the last whole word is kept
+       for next time (except at the end of the file, where the last word is
+       padded out). */
+    while(rv != PSO_PRS_STREAM_END) {
+        if((bytes = pso_io_read(fd, c->in + have, FD_CHUNK - have)) < 0)
+            return (int)bytes;
+
+        have += (size_t)bytes;
+
+        /* If we've run out of input before reaching the end of the stream,
+           then the data is truncated. */
+        if(!have)
+            return PSOARCHIVE_EBADMSG;
+
+        whole = bytes ? have & ~(size_t)3 : have;
+        pso_prsd_crypt(&c->ccxt, c->in, (uint32_t)whole);
+
+        if((rv = stream_feed(&c->s, &c->o, c->in, whole)) < 0)
+            return rv;
+
+        memmove(c->in, c->in + whole, have - whole);
+        have -= whole;
+    }
 
     /* Does the uncompressed size match what we're expecting from the file
        header? */
-    if(rv != (int)unc_len)
+    if(c->s.total_out != unc_len)
         return PSOARCHIVE_EFATAL;
 
-    /* We're done, return the size of the uncompressed data. */
+    return (int)c->s.total_out;
+}
+
+int pso_prsd_decompress_fd_cb(int fd, pso_prs_hash_cb_t cb, void *udata) {
+    struct fd_cxt *c;
+    int rv;
+
+    if(fd < 0)
+        return PSOARCHIVE_EINVAL;
+
+    if(!cb)
+        return PSOARCHIVE_EFAULT;
+
+    if(!(c = (struct fd_cxt *)malloc(sizeof(struct fd_cxt))))
+        return PSOARCHIVE_EMEM;
+
+    c->o.cb = cb;
+    c->o.udata = udata;
+
+    rv = decompress_fd(fd, c);
+    free(c);
+
     return rv;
 }
 
-int pso_prsd_decompress_size(const uint8_t *src, size_t src_len) {
+int pso_prsd_decompress_fd(int in_fd, int out_fd) {
+    struct fd_cxt *c;
+    int rv;
+
+    if(in_fd < 0 || out_fd < 0)
+        return PSOARCHIVE_EINVAL;
+
+    if(!(c = (struct fd_cxt *)malloc(sizeof(struct fd_cxt))))
+        return PSOARCHIVE_EMEM;
+
+    c->o.cb = NULL;
+    c->o.fd = out_fd;
+
+    rv = decompress_fd(in_fd, c);
+    free(c);
+
+    return rv;
+}
+
+int pso_prsd_verify(const uint8_t *src, size_t src_len, int hash,
+                    uint64_t *digest) {
+    struct pso_hash_cxt h;
+    int rv;
+
+    if(!digest)
+        return PSOARCHIVE_EFAULT;
+
+    if((rv = pso_hash_init(&h, hash)))
+        return rv;
+
+    if((rv = pso_prsd_verify_cb(src, src_len, &pso_hash_update, &h)) < 0)
+        return rv;
+
+    *digest = pso_hash_final(&h);
+    return rv;
+}
+
+static void batch_item(void *d, size_t item, int worker) {
+    pso_prs_batch_item_t *it = (pso_prs_batch_item_t *)d + item;
+
+    (void)worker;
+    it->result = decompress_buf2(it->src, it->dst, it->src_len, it->dst_len,
+                                 NULL);
+}
+
+int pso_prsd_decompress_batch(pso_prs_batch_item_t *items, size_t count,
+                              int threads) {
+    if(!items)
+        return PSOARCHIVE_EFAULT;
+
+    if(!count)
+        return PSOARCHIVE_OK;
+
+    return pso_pool_run(pso_pool_workers(threads, count), count, &batch_item,
+                        items);
+}
+
+/* Decrypt len bytes of the encrypted data at src (which starts off at offset
+   bytes into the encrypted data) into dst. The offset must be a multiple of 4,
+   but the length need not be. The data may be decrypted in place by passing
+   the same buffer as both src and dst. */
+static void decrypt_piece(uint32_t key, const uint8_t *src, size_t offset,
+                          uint8_t *dst, size_t len) {
+    struct prsd_crypt_cxt ccxt;
+    size_t whole = len & ~(size_t)3;
+    uint8_t tail[4] = { 0, 0, 0, 0 };
+
+    pso_prsd_crypt_init(&ccxt, key);
+
+    if(offset)
+        pso_prsd_crypt_seek(&ccxt, (uint32_t)(offset >> 2));
+
+    if(dst != src)
+        memcpy(dst, src, whole);
+
+    pso_prsd_crypt(&ccxt, dst, (uint32_t)whole);
+
+    /* Don't write past the end of the buffer if there's a partial word at the
+       end of it. */
+    if(len != whole) {
+        memcpy(tail, src + whole, len - whole);
+        pso_prsd_crypt(&ccxt, tail, 4);
+        memcpy(dst + whole, tail, len - whole);
+    }
+}
+
+int pso_prsd_decrypt_range(const uint8_t *src, size_t src_len, size_t offset,
+                           uint8_t *dst, size_t len) {
+    uint32_t key;
+
     /* Verify the input parameters. */
-    if(!src)
+    if(!src || !dst)
         return PSOARCHIVE_EFAULT;
 
     if(src_len < 11)
         return PSOARCHIVE_EBADMSG;
 
-    return (int)(src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24));
+    if(offset & 3)
+        return PSOARCHIVE_EINVAL;
+
+    key = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
+    src += 8;
+    src_len -= 8;
+
+    if(offset > src_len)
+        return PSOARCHIVE_ERANGE;
+
+    /* Don't go past the end of the data. */
+    if(len > src_len - offset)
+        len = src_len - offset;
+
+    decrypt_piece(key, src + offset, offset, dst, len);
+    return (int)len;
+}
+
+struct decrypt_cxt {
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t len;
+    size_t piece;
+    uint32_t key;
+};
+
+static void decrypt_item(void *d, size_t item, int worker) {
+    struct decrypt_cxt *c = (struct decrypt_cxt *)d;
+    size_t off = item * c->piece;
+    size_t len = c->len - off < c->piece ? c->len - off : c->piece;
+
+    (void)worker;
+    decrypt_piece(c->key, c->src + off, off, c->dst + off, len);
+}
+
+int pso_prsd_decrypt(const uint8_t *src, size_t src_len, uint8_t *dst,
+                     size_t dst_len, int threads) {
+    struct decrypt_cxt c;
+    int workers;
+    pso_error_t rv;
+
+    /* Verify the input parameters. */
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(src_len < 11)
+        return PSOARCHIVE_EBADMSG;
+
+    if(dst_len < src_len - 8)
+        return PSOARCHIVE_ENOSPC;
+
+    c.key = src[4] | (src[5] << 8) | (src[6] << 16) | (src[7] << 24);
+    c.src = src + 8;
+    c.dst = dst;
+    c.len = src_len - 8;
+
+    /* Give each worker one piece of the data, starting on a word boundary.
+       Each piece starts with a jump ahead in the stream, so there's no point
+       in cutting things up any finer than that. */
+    workers = pso_pool_workers(threads, (c.len + DECRYPT_MIN_PIECE - 1) /
+                               DECRYPT_MIN_PIECE);
+    c.piece = ((c.len + workers - 1) / workers + 3) & ~(size_t)3;
+
+    if((rv = pso_pool_run(workers, (c.len + c.piece - 1) / c.piece,
+                          &decrypt_item, &c)))
+        return rv;
+
+    return (int)c.len;
+}
+
+int pso_prsd_decrypt_inplace(uint8_t *buf, size_t len) {
+    uint32_t key;
+
+    /* Verify the input parameters. */
+    if(!buf)
+        return PSOARCHIVE_EFAULT;
+
+    if(len < 11)
+        return PSOARCHIVE_EBADMSG;
+
+    key = buf[4] | (buf[5] << 8) | (buf[6] << 16) | (buf[7] << 24);
+    decrypt_piece(key, buf + 8, 0, buf + 8, len - 8);
+
+    return (int)(len - 8);
+}
+
+int pso_prsd_decompress_inplace(uint8_t *src, size_t src_len, uint8_t *dst,
+                                size_t dst_len) {
+    uint32_t unc_len;
+    int rv;
+
+    /* Verify the input parameters. */
+    if(!src || !dst)
+        return PSOARCHIVE_EFAULT;
+
+    if(src_len < 11)
+        return PSOARCHIVE_EBADMSG;
+
+    /* Make sure the buffer the user gave us is big enough. */
+    unc_len = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+
+    if(dst_len < unc_len)
+        return PSOARCHIVE_ENOSPC;
+
+    /* Decrypt the data where it is, then decompress it as plain PRS data. */
+    if((rv = pso_prsd_decrypt_inplace(src, src_len)) < 0)
+        return rv;
+
+    if((rv = pso_prs_decompress_buf2(src + 8, dst, src_len - 8, dst_len)) < 0)
+        return rv;
+
+    /* Does the uncompressed size match what we're expecting from the file
+       header? */
+    if(rv != (int)unc_len)
+        return PSOARCHIVE_EFATAL;
+
+    return rv;
 }
@@ -0,0 +1,188 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    PRSD Keystream Objects
+
+    Setting up the encryption context for a key takes a fair bit more work than
+    encrypting a small buffer does, and a freshly set up context for a given key
+    is always exactly the same. These functions let the user set up a context
+    for a key once and then hand it to the PRSD functions as many times as they
+    like, where it is simply copied rather than set up all over again.
+
+    The key cache keeps a small number of these around, throwing out the one
+    that was least recently used when it needs room for a new key.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "PRSD-common.h"
+#include "PRSD.h"
+
+struct cache_ent {
+    pso_prsd_key_t key;
+    uint64_t last_use;
+};
+
+struct pso_prsd_key_cache {
+    struct cache_ent *ents;
+    int size;
+    int count;
+    uint64_t tick;
+};
+
+void pso_prsd_key_setup(struct prsd_crypt_cxt *cxt, uint32_t key,
+                        const pso_prsd_key_t *k) {
+    if(k && k->cxt.key == key)
+        memcpy(cxt, &k->cxt, sizeof(struct prsd_crypt_cxt));
+    else
+        pso_prsd_crypt_init(cxt, key);
+}
+
+pso_prsd_key_t *pso_prsd_key_new(uint32_t key, pso_error_t *err) {
+    pso_prsd_key_t *rv;
+
+    if(!(rv = (pso_prsd_key_t *)malloc(sizeof(pso_prsd_key_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    pso_prsd_crypt_init(&rv->cxt, key);
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
+pso_prsd_key_t *pso_prsd_key_clone(const pso_prsd_key_t *k, pso_error_t *err) {
+    pso_prsd_key_t *rv;
+
+    if(!k) {
+        if(err)
+            *err = PSOARCHIVE_EFAULT;
+
+        return NULL;
+    }
+
+    if(!(rv = (pso_prsd_key_t *)malloc(sizeof(pso_prsd_key_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    memcpy(rv, k, sizeof(pso_prsd_key_t));
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
+pso_error_t pso_prsd_key_free(pso_prsd_key_t *k) {
+    if(!k)
+        return PSOARCHIVE_EFAULT;
+
+    free(k);
+    return PSOARCHIVE_OK;
+}
+
+uint32_t pso_prsd_key_value(const pso_prsd_key_t *k) {
+    return k ? k->cxt.key : 0;
+}
+
+pso_prsd_key_cache_t *pso_prsd_key_cache_new(int size, pso_error_t *err) {
+    pso_prsd_key_cache_t *rv;
+
+    if(size <= 0)
+        size = PSO_PRSD_KEY_CACHE_SIZE;
+
+    if(!(rv = (pso_prsd_key_cache_t *)malloc(sizeof(pso_prsd_key_cache_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    if(!(rv->ents = (struct cache_ent *)malloc(sizeof(struct cache_ent) *
+                                               size))) {
+        free(rv);
+
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    rv->size = size;
+    rv->count = 0;
+    rv->tick = 0;
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
+pso_error_t pso_prsd_key_cache_free(pso_prsd_key_cache_t *c) {
+    if(!c)
+        return PSOARCHIVE_EFAULT;
+
+    free(c->ents);
+    free(c);
+    return PSOARCHIVE_OK;
+}
+
+const pso_prsd_key_t *pso_prsd_key_cache_get(pso_prsd_key_cache_t *c,
+                                             uint32_t key) {
+    int i, oldest = 0;
+    struct cache_ent *e;
+
+    if(!c)
+        return NULL;
+
+    /* The cache is meant to be small, so a simple scan of it is plenty. */
+    for(i = 0; i < c->count; ++i) {
+        e = &c->ents[i];
+
+        if(e->key.cxt.key == key) {
+            e->last_use = ++c->tick;
+            return &e->key;
+        }
+
+        if(e->last_use < c->ents[oldest].last_use)
+            oldest = i;
+    }
+
+    /* We don't have it, so either take a free slot or throw out the least
+       recently used key. */
+    if(c->count < c->size)
+        e = &c->ents[c->count++];
+    else
+        e = &c->ents[oldest];
+
+    pso_prsd_crypt_init(&e->key.cxt, key);
+    e->last_use = ++c->tick;
+
+    return &e->key;
+}
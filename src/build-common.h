@@ -0,0 +1,40 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "psoarchive-error.h"
+#include "psoarchive-build.h"
+
+/* How the batch builder hands finished files over to the archive writer. The
+   add_file function is used for files that are stored as-is from a path, so
+   that the writer can copy them however it likes best. The mtime passed to add
+   is the one that should go in a filename table, if the archive has one. */
+typedef pso_error_t (*pso_build_add_t)(void *archive, const char *name,
+                                       const uint8_t *data, uint32_t len,
+                                       time_t mtime);
+typedef pso_error_t (*pso_build_add_file_t)(void *archive, const char *name,
+                                            const char *path);
+
+/* This function is for internal use only. */
+pso_error_t pso_build_run(const pso_build_item_t *items, size_t count,
+                          int threads, size_t max_bytes, pso_build_add_t add,
+                          pso_build_add_file_t add_file, void *archive);
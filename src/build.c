@@ -0,0 +1,309 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Batch Archive Building
+
+    The files in a batch are loaded and compressed on the worker pool, but they
+    are always handed to the archive writer one at a time and in the order they
+    were given, so the archive that comes out is exactly the same no matter how
+    many threads are used.
+
+    Whichever worker finishes the file that is next in line to be written takes
+    on the job of writing it out, along with any files after it that are
+    already done. To keep memory use in check, workers won't start loading a
+    file while more than the limit is being held in memory, unless it's the
+    next one to be written (otherwise a file bigger than the limit would never
+    get done).
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "build-common.h"
+#include "thread-pool.h"
+#include "io-common.h"
+#include "PRS.h"
+#include "PRSD.h"
+
+struct build_slot {
+    uint8_t *data;
+    uint32_t len;
+    size_t held;
+    time_t mtime;
+
+    int owned;
+    int done;
+};
+
+struct build_cxt {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+
+    const pso_build_item_t *items;
+    struct build_slot *slots;
+    size_t count;
+
+    size_t held;
+    size_t max_bytes;
+    size_t next_write;
+    int writing;
+    pso_error_t err;
+    time_t start;
+
+    pso_build_add_t add;
+    pso_build_add_file_t add_file;
+    void *archive;
+};
+
+#ifdef HAVE_PTHREAD_H
+#define LOCK(c)         pthread_mutex_lock(&(c)->lock)
+#define UNLOCK(c)       pthread_mutex_unlock(&(c)->lock)
+#define WAIT(c)         pthread_cond_wait(&(c)->cond, &(c)->lock)
+#define WAKE(c)         pthread_cond_broadcast(&(c)->cond)
+#else
+#define LOCK(c)         (void)0
+#define UNLOCK(c)       (void)0
+#define WAIT(c)         (void)0
+#define WAKE(c)         (void)0
+#endif
+
+/* Load (and compress, if needed) one file. Returns the size of the result, or
+   an error code. */
+static int build_item(const pso_build_item_t *item, struct build_slot *s) {
+    struct pso_io_map m;
+    const uint8_t *src;
+    size_t len;
+    int rv;
+
+    /* Files that are copied straight from a path don't need to be loaded at
+       all, the writer will take care of them. */
+    if(item->transform == PSO_BUILD_COPY) {
+        if(item->path)
+            return 0;
+
+        s->data = (uint8_t *)item->data;
+        s->owned = 0;
+        return (int)item->len;
+    }
+
+    if(item->path) {
+        if((rv = pso_io_map_file(item->path, &m)))
+            return rv;
+
+        src = m.data;
+        len = m.len;
+    }
+    else {
+        src = item->data;
+        len = item->len;
+    }
+
+    if(item->transform == PSO_BUILD_PRS)
+        rv = pso_prs_compress(src, &s->data, len);
+    else if(item->transform == PSO_BUILD_PRSD)
+        rv = pso_prsd_compress(src, &s->data, len, item->key);
+    else
+        rv = PSOARCHIVE_EINVAL;
+
+    if(item->path)
+        pso_io_unmap(&m);
+
+    s->owned = rv >= 0;
+    return rv;
+}
+
+/* Write out all the files that are done, starting with the next one in line.
+   Must be called with the lock held. */
+static void write_ready(struct build_cxt *c) {
+    const pso_build_item_t *item;
+    struct build_slot *s;
+    pso_error_t rv;
+
+    /* If someone else is already at it, they'll pick up anything we finish. */
+    if(c->writing)
+        return;
+
+    c->writing = 1;
+
+    while(c->err == PSOARCHIVE_OK && c->next_write < c->count &&
+          c->slots[c->next_write].done) {
+        item = &c->items[c->next_write];
+        s = &c->slots[c->next_write];
+
+        UNLOCK(c);
+
+        if(item->transform == PSO_BUILD_COPY && item->path)
+            rv = c->add_file(c->archive, item->name, item->path);
+        else
+            rv = c->add(c->archive, item->name, s->data, s->len, s->mtime);
+
+        if(s->owned) {
+            free(s->data);
+            s->data = NULL;
+            s->owned = 0;
+        }
+
+        LOCK(c);
+
+        if(rv != PSOARCHIVE_OK)
+            c->err = rv;
+
+        c->held -= s->held;
+        ++c->next_write;
+        WAKE(c);
+    }
+
+    c->writing = 0;
+}
+
+static void build_thd(void *d, size_t i, int worker) {
+    struct build_cxt *c = (struct build_cxt *)d;
+    const pso_build_item_t *item = &c->items[i];
+    struct build_slot *s = &c->slots[i];
+    struct stat st;
+    size_t need = 0;
+    int rv;
+
+    (void)worker;
+
+    /* Figure out about how much memory this one is going to need, and what
+       time to give it in the filename table (if there is one). Files that are
+       copied straight from a path get theirs from the writer. */
+    s->mtime = item->mtime ? item->mtime : c->start;
+
+    if(item->transform != PSO_BUILD_COPY) {
+        if(!item->path) {
+            need = item->len;
+        }
+        else if(!stat(item->path, &st)) {
+            need = (size_t)st.st_size;
+            s->mtime = st.st_mtime;
+        }
+    }
+
+    LOCK(c);
+
+    while(c->err == PSOARCHIVE_OK && i != c->next_write &&
+          c->held + need > c->max_bytes)
+        WAIT(c);
+
+    if(c->err != PSOARCHIVE_OK) {
+        UNLOCK(c);
+        return;
+    }
+
+    c->held += need;
+    UNLOCK(c);
+
+    rv = build_item(item, s);
+
+    LOCK(c);
+
+    /* Now that we know how big the result really is, account for that rather
+       than our guess. */
+    c->held -= need;
+
+    if(rv < 0) {
+        c->err = (pso_error_t)rv;
+        WAKE(c);
+    }
+    else {
+        s->len = (uint32_t)rv;
+        s->held = s->owned ? (size_t)rv : 0;
+        s->done = 1;
+        c->held += s->held;
+        write_ready(c);
+    }
+
+    UNLOCK(c);
+}
+
+pso_error_t pso_build_run(const pso_build_item_t *items, size_t count,
+                          int threads, size_t max_bytes, pso_build_add_t add,
+                          pso_build_add_file_t add_file, void *archive) {
+    struct build_cxt c;
+    pso_error_t rv;
+    size_t i;
+
+    if(!items || !add || !add_file || !archive)
+        return PSOARCHIVE_EFAULT;
+
+    if(!count)
+        return PSOARCHIVE_OK;
+
+    if(!(c.slots = (struct build_slot *)calloc(count,
+                                               sizeof(struct build_slot))))
+        return PSOARCHIVE_EMEM;
+
+#ifdef HAVE_PTHREAD_H
+    if(pthread_mutex_init(&c.lock, NULL)) {
+        free(c.slots);
+        return PSOARCHIVE_EFATAL;
+    }
+
+    if(pthread_cond_init(&c.cond, NULL)) {
+        pthread_mutex_destroy(&c.lock);
+        free(c.slots);
+        return PSOARCHIVE_EFATAL;
+    }
+#endif
+
+    c.items = items;
+    c.count = count;
+    c.held = 0;
+    c.max_bytes = max_bytes ? max_bytes : PSO_BUILD_MAX_BYTES;
+    c.next_write = 0;
+    c.writing = 0;
+    c.err = PSOARCHIVE_OK;
+    c.start = time(NULL);
+    c.add = add;
+    c.add_file = add_file;
+    c.archive = archive;
+
+    rv = pso_pool_run(pso_pool_workers(threads, count), count, &build_thd, &c);
+
+    if(rv == PSOARCHIVE_OK)
+        rv = c.err;
+
+    /* If something went wrong, there may be some files that were done but never
+       got written out. */
+    for(i = 0; i < count; ++i) {
+        if(c.slots[i].owned)
+            free(c.slots[i].data);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.lock);
+#endif
+
+    free(c.slots);
+    return rv;
+}
@@ -0,0 +1,48 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "psoarchive-error.h"
+#include "psoarchive-build.h"
+
+/* A file to be extracted from an archive. */
+struct pso_extract_ent {
+    uint32_t hnd;
+    uint32_t offset;
+    uint32_t size;
+};
+
+/* How the extractor gets at the files in the archive. The map function may be
+   NULL, or may return NULL for archives that aren't mapped, in which case the
+   read function is used instead. */
+typedef ssize_t (*pso_extract_read_t)(void *archive, uint32_t hnd,
+                                      uint8_t *buf, size_t len);
+typedef const uint8_t *(*pso_extract_map_t)(void *archive, uint32_t hnd);
+typedef pso_error_t (*pso_extract_name_t)(void *archive, uint32_t hnd,
+                                          char *fn, size_t len);
+
+/* This function is for internal use only. The ents array is sorted in place
+   by offset. */
+pso_error_t pso_extract_run(struct pso_extract_ent *ents, uint32_t count,
+                            const char *dir, uint32_t flags, int threads,
+                            pso_extract_read_t read, pso_extract_map_t map,
+                            pso_extract_name_t name, void *archive);
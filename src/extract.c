@@ -0,0 +1,355 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Whole Archive Extraction
+
+    Extracting everything from an archive is done in the order the files are
+    laid out in the archive (rather than the order they appear in the table of
+    contents), so that the archive itself is read front to back. The reading,
+    decompressing, and writing out of the files is spread over the worker pool.
+
+    The names that files are written out under come from the archive, so they
+    are cleaned up first so that they can't point outside of the directory
+    being extracted into, and so that no two files get written to the same
+    place.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "extract-common.h"
+#include "thread-pool.h"
+#include "io-common.h"
+#include "PRS.h"
+#include "PRSD.h"
+
+/* Long enough for any name from an AFS or GSL archive, plus a suffix to make
+   it unique, if needed. */
+#define NAME_LEN        64
+
+struct extract_cxt {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+
+    struct pso_extract_ent *ents;
+    char (*names)[NAME_LEN];
+    const char *dir;
+    uint32_t flags;
+    pso_error_t err;
+
+    uint8_t **bufs;
+    size_t *buf_lens;
+
+    pso_extract_read_t read;
+    pso_extract_map_t map;
+    void *archive;
+};
+
+static int ent_cmp(const void *a, const void *b) {
+    const struct pso_extract_ent *e1 = (const struct pso_extract_ent *)a;
+    const struct pso_extract_ent *e2 = (const struct pso_extract_ent *)b;
+
+    if(e1->offset != e2->offset)
+        return e1->offset < e2->offset ? -1 : 1;
+
+    return e1->hnd < e2->hnd ? -1 : (e1->hnd > e2->hnd);
+}
+
+/* Where a name has to be cut off to leave room for a suffix of up to ten
+   digits. */
+#define BASE_LEN        (NAME_LEN - 12)
+
+struct name_ref {
+    char *name;
+    uint32_t hnd;
+    uint32_t suffix;
+    size_t base;
+    int renamed;
+};
+
+static int name_cmp(const void *a, const void *b) {
+    const struct name_ref *n1 = (const struct name_ref *)a;
+    const struct name_ref *n2 = (const struct name_ref *)b;
+    int rv;
+
+    if((rv = strcmp(n1->name, n2->name)))
+        return rv;
+
+    if(n1->renamed != n2->renamed)
+        return n1->renamed - n2->renamed;
+
+    return n1->hnd < n2->hnd ? -1 : (n1->hnd > n2->hnd);
+}
+
+static pso_error_t make_names(char (*names)[NAME_LEN], uint32_t count,
+                              pso_extract_name_t name, void *archive) {
+    struct name_ref *order, *r;
+    uint32_t i, keep;
+    char *c;
+    int dups;
+
+    for(i = 0; i < count; ++i) {
+        if(name(archive, i, names[i], NAME_LEN) != PSOARCHIVE_OK)
+            names[i][0] = 0;
+
+        names[i][NAME_LEN - 1] = 0;
+
+        /* Don't let the name go anywhere but the directory we were given. */
+        for(c = names[i]; *c; ++c) {
+            if(*c == '/' || *c == '\\')
+                *c = '_';
+        }
+
+        if(!names[i][0] || !strcmp(names[i], ".") || !strcmp(names[i], ".."))
+            snprintf(names[i], NAME_LEN, "%05lu.bin", (unsigned long)i);
+    }
+
+    /* Sort the names to find any duplicates. The first file with any given
+       name keeps it, the rest get a number added on to the end (starting with
+       their handle). That can clash with another file's name too, so keep at it
+       until there aren't any duplicates left. A file that hasn't been renamed
+       always keeps its name over one that has. */
+    if(!(order = (struct name_ref *)malloc(count * sizeof(struct name_ref))))
+        return PSOARCHIVE_EMEM;
+
+    for(i = 0; i < count; ++i) {
+        order[i].name = names[i];
+        order[i].hnd = i;
+        order[i].renamed = 0;
+    }
+
+    do {
+        qsort(order, count, sizeof(struct name_ref), &name_cmp);
+        dups = 0;
+
+        for(i = 1, keep = 0; i < count; ++i) {
+            if(strcmp(order[i].name, order[keep].name)) {
+                keep = i;
+                continue;
+            }
+
+            r = &order[i];
+
+            if(!r->renamed) {
+                r->renamed = 1;
+                r->suffix = r->hnd;
+                r->base = strlen(r->name);
+
+                if(r->base > BASE_LEN)
+                    r->base = BASE_LEN;
+            }
+            else
+                ++r->suffix;
+
+            snprintf(r->name + r->base, NAME_LEN - r->base, ".%05lu",
+                     (unsigned long)r->suffix);
+            dups = 1;
+        }
+    } while(dups);
+
+    free(order);
+    return PSOARCHIVE_OK;
+}
+
+static pso_error_t write_file(const char *dir, const char *fn,
+                              const uint8_t *data, size_t len) {
+    char *path;
+    int fd;
+    pso_error_t rv;
+
+    if(!(path = (char *)malloc(strlen(dir) + strlen(fn) + 2)))
+        return PSOARCHIVE_EMEM;
+
+    sprintf(path, "%s/%s", dir, fn);
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    free(path);
+
+    if(fd < 0)
+        return PSOARCHIVE_EFILE;
+
+    rv = pso_io_write(fd, data, len);
+
+    if(close(fd) && rv == PSOARCHIVE_OK)
+        rv = PSOARCHIVE_EIO;
+
+    return rv;
+}
+
+static void extract_thd(void *d, size_t i, int worker) {
+    struct extract_cxt *c = (struct extract_cxt *)d;
+    struct pso_extract_ent *e = &c->ents[i];
+    const uint8_t *src = NULL;
+    uint8_t *out = NULL;
+    void *tmp;
+    int len = -1;
+    pso_error_t rv = PSOARCHIVE_OK;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&c->lock);
+#endif
+    rv = c->err;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&c->lock);
+#endif
+
+    /* Don't bother if something has already gone wrong. */
+    if(rv != PSOARCHIVE_OK)
+        return;
+
+    /* Get at the data, either straight from the mapping or by reading it into
+       this worker's buffer. */
+    if(c->map)
+        src = c->map(c->archive, e->hnd);
+
+    if(!src && e->size) {
+        if(c->buf_lens[worker] < e->size) {
+            if(!(tmp = realloc(c->bufs[worker], e->size))) {
+                rv = PSOARCHIVE_EMEM;
+                goto out;
+            }
+
+            c->bufs[worker] = (uint8_t *)tmp;
+            c->buf_lens[worker] = e->size;
+        }
+
+        if(c->read(c->archive, e->hnd, c->bufs[worker], e->size) !=
+           (ssize_t)e->size) {
+            rv = PSOARCHIVE_EIO;
+            goto out;
+        }
+
+        src = c->bufs[worker];
+    }
+
+    if(e->size) {
+        if((c->flags & PSO_EXTRACT_PRSD))
+            len = pso_prsd_decompress_buf(src, &out, e->size);
+        else if((c->flags & PSO_EXTRACT_PRS))
+            len = pso_prs_decompress_buf(src, &out, e->size);
+    }
+
+    /* If it didn't decompress (or we weren't asked to), write it out as-is. */
+    if(len >= 0)
+        rv = write_file(c->dir, c->names[e->hnd], out, (size_t)len);
+    else
+        rv = write_file(c->dir, c->names[e->hnd], src, e->size);
+
+    free(out);
+
+out:
+    if(rv != PSOARCHIVE_OK) {
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&c->lock);
+#endif
+        if(c->err == PSOARCHIVE_OK)
+            c->err = rv;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&c->lock);
+#endif
+    }
+}
+
+pso_error_t pso_extract_run(struct pso_extract_ent *ents, uint32_t count,
+                            const char *dir, uint32_t flags, int threads,
+                            pso_extract_read_t read, pso_extract_map_t map,
+                            pso_extract_name_t name, void *archive) {
+    struct extract_cxt c;
+    int workers, i;
+    pso_error_t rv;
+
+    if(!ents || !dir || !read || !name || !archive)
+        return PSOARCHIVE_EFAULT;
+
+    /* Make the directory, if it isn't already there. */
+    if(mkdir(dir, 0755) && errno != EEXIST)
+        return PSOARCHIVE_EFILE;
+
+    if(!count)
+        return PSOARCHIVE_OK;
+
+    workers = pso_pool_workers(threads, count);
+
+    memset(&c, 0, sizeof(c));
+    c.names = (char (*)[NAME_LEN])malloc(count * NAME_LEN);
+    c.bufs = (uint8_t **)calloc(workers, sizeof(uint8_t *));
+    c.buf_lens = (size_t *)calloc(workers, sizeof(size_t));
+
+    if(!c.names || !c.bufs || !c.buf_lens) {
+        rv = PSOARCHIVE_EMEM;
+        goto out;
+    }
+
+    if((rv = make_names(c.names, count, name, archive)) != PSOARCHIVE_OK)
+        goto out;
+
+#ifdef HAVE_PTHREAD_H
+    if(pthread_mutex_init(&c.lock, NULL)) {
+        rv = PSOARCHIVE_EFATAL;
+        goto out;
+    }
+#endif
+
+    /* Go through the archive front to back. */
+    qsort(ents, count, sizeof(struct pso_extract_ent), &ent_cmp);
+
+    c.ents = ents;
+    c.dir = dir;
+    c.flags = flags;
+    c.err = PSOARCHIVE_OK;
+    c.read = read;
+    c.map = map;
+    c.archive = archive;
+
+    rv = pso_pool_run(workers, count, &extract_thd, &c);
+
+    if(rv == PSOARCHIVE_OK)
+        rv = c.err;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&c.lock);
+#endif
+
+out:
+    if(c.bufs) {
+        for(i = 0; i < workers; ++i)
+            free(c.bufs[i]);
+    }
+
+    free(c.buf_lens);
+    free(c.bufs);
+    free(c.names);
+
+    return rv;
+}
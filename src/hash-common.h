@@ -0,0 +1,43 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "psoarchive-error.h"
+
+struct pso_hash_cxt {
+    int type;
+    uint64_t total_len;
+
+    /* CRC32C state */
+    uint32_t crc;
+
+    /* XXH64 state */
+    uint64_t v[4];
+    uint8_t mem[32];
+    size_t mem_len;
+};
+
+/* These functions are all for internal use only. pso_hash_update has the same
+   signature as pso_prs_hash_cb_t, so it can be handed straight to the
+   _verify_cb functions. */
+pso_error_t pso_hash_init(struct pso_hash_cxt *h, int type);
+void pso_hash_update(void *h, const uint8_t *data, size_t len);
+uint64_t pso_hash_final(struct pso_hash_cxt *h);
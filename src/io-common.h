@@ -0,0 +1,151 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "psoarchive-error.h"
+#include "psoarchive-queue.h"
+
+/* A read-only view of the contents of a file. Where mmap() is available, this
+   is a mapping of the file, otherwise the file is read into a buffer in large
+   chunks. */
+struct pso_io_map {
+    const uint8_t *data;
+    size_t len;
+
+    void *base;
+    int mapped;
+};
+
+/* Access patterns that can be passed to pso_io_mmap() and pso_io_advise(). */
+#define PSO_IO_NORMAL       0
+#define PSO_IO_SEQUENTIAL   1
+#define PSO_IO_RANDOM       2
+
+/* These functions are all for internal use only. */
+pso_error_t pso_io_map_fd(int fd, size_t len, struct pso_io_map *m);
+
+/* Map the file, without falling back to reading it in if mmap() isn't usable.
+   Returns PSOARCHIVE_ENOTSUPP in that case. */
+pso_error_t pso_io_mmap(int fd, size_t len, int advice, struct pso_io_map *m);
+pso_error_t pso_io_map_file(const char *fn, struct pso_io_map *m);
+void pso_io_unmap(struct pso_io_map *m);
+
+/* Read up to len bytes from the file, stopping early only at the end of the
+   file. Returns the number of bytes read, or PSOARCHIVE_EIO on error. */
+ssize_t pso_io_read(int fd, void *buf, size_t len);
+
+/* Read up to len bytes from the file starting at offset off, without moving
+   the file position (where pread() is available). Like pso_io_read(), this
+   only stops early at the end of the file. */
+ssize_t pso_io_pread(int fd, void *buf, size_t len, off_t off);
+
+/* Write all len bytes to the file. */
+pso_error_t pso_io_write(int fd, const void *buf, size_t len);
+
+/* Write all len bytes to the file starting at offset off, without moving the
+   file position (where pwrite() is available). */
+pso_error_t pso_io_pwrite(int fd, const void *buf, size_t len, off_t off);
+
+/* Copy len bytes from the current position of in_fd to the current position
+   of out_fd, letting the kernel do the copying where it can. */
+pso_error_t pso_io_copy(int out_fd, int in_fd, size_t len);
+
+/* Hint how the file will be read from here on (one of the PSO_IO_* access
+   patterns above). */
+void pso_io_advise(int fd, int advice);
+
+/* A single read or write for an I/O queue. This has to stay around until it is
+   handed back by pso_io_queue_reap_ops(). */
+struct pso_io_op {
+    int fd;
+    int write;
+    void *buf;
+    size_t len;
+    off_t off;
+    ssize_t result;
+    void *tag;
+
+    struct pso_io_op *next;
+    struct iovec iov;
+};
+
+/* Create a queue. If io_uring can't be used, the operations are done on up to
+   threads threads (or one per CPU, for 0) when they are submitted. */
+pso_io_queue_t *pso_io_queue_create(unsigned int depth, int threads,
+                                    pso_error_t *err);
+
+/* Add an operation to the queue. This may submit the operations queued up so
+   far if the queue is full. */
+pso_error_t pso_io_queue_push(pso_io_queue_t *q, struct pso_io_op *op);
+
+/* Start all of the operations that have been pushed. */
+pso_error_t pso_io_queue_submit(pso_io_queue_t *q);
+
+/* Collect up to max completed operations, waiting for at least one if asked
+   to. */
+size_t pso_io_queue_reap_ops(pso_io_queue_t *q, struct pso_io_op **ops,
+                             size_t max, int wait);
+
+/* Get an operation structure from the queue's free list, or give one back. */
+struct pso_io_op *pso_io_queue_get_op(pso_io_queue_t *q);
+void pso_io_queue_put_op(pso_io_queue_t *q, struct pso_io_op *op);
+
+/* Push all count operations, submit them, and wait for all of them to be
+   done. Returns PSOARCHIVE_EIO if any of them didn't transfer everything. The
+   queue must not have any other operations on it. Even on error, the queue
+   doesn't hold on to any of the operations once this returns (if the kernel
+   can't be made to give them back, the queue refuses to be used again), so
+   they may live on the stack. */
+pso_error_t pso_io_queue_run(pso_io_queue_t *q, struct pso_io_op *ops,
+                             size_t count);
+
+/* Make sure there are at least count operation structures on the free list, so
+   that the next count calls to pso_io_queue_get_op() can't fail. */
+pso_error_t pso_io_queue_reserve(pso_io_queue_t *q, size_t count);
+
+/* Write hdr_len bytes of hdr at hdr_off, len bytes of data at data_off, and the
+   byte that pads the data out to the next 2048 byte boundary, all at once on
+   the queue at *q (which is created the first time it's needed). The position
+   just past the padding is stored in end. */
+pso_error_t pso_io_queue_write_file(pso_io_queue_t **q, int fd,
+                                    const uint8_t *hdr, size_t hdr_len,
+                                    off_t hdr_off, const uint8_t *data,
+                                    uint32_t len, off_t data_off, off_t *end);
+
+/* Look up where file hnd in an archive starts, and how big it is. Returns
+   nonzero if there is no such file. */
+typedef int (*pso_io_file_info_t)(void *archive, uint32_t hnd, off_t *off,
+                                  uint32_t *size);
+
+/* Queue up a read for each of the requests from the archive open on fd, then
+   submit them. All of the requests are checked before any of them are queued,
+   so that nothing is left half-submitted. */
+pso_error_t pso_io_queue_read_files(pso_io_queue_t *q, int fd,
+                                    pso_read_req_t *reqs, size_t count,
+                                    pso_io_file_info_t info, void *archive);
+
+/* Queue up a read request from one of the archive read_submit functions,
+   reading req->len bytes from offset off. */
+pso_error_t pso_io_queue_read(pso_io_queue_t *q, int fd, pso_read_req_t *req,
+                              off_t off);
+
@@ -0,0 +1,806 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    I/O Queues
+
+    A queue takes a batch of reads and writes at known offsets and gets them
+    all going at once, rather than doing them one by one. On Linux, this is
+    done with io_uring, talking to the kernel directly (so liburing isn't
+    needed). Each operation is handed to the kernel as a single-entry readv or
+    writev, since those have been supported since io_uring was first added.
+    The number of operations in flight is never allowed to go over the size of
+    the submission ring, so the completion ring (which is at least as big) can
+    never overflow.
+
+    Where io_uring isn't available (or the kernel won't let us set it up), the
+    operations that have been queued up are instead spread out over the worker
+    pool when they're submitted, so they're all done by the time the submit
+    function returns.
+
+    A queue is not safe to use from more than one thread at a time.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_SYSCALL_H) && \
+    defined(HAVE_SYS_MMAN_H)
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_URING
+#endif
+#endif
+
+#include "io-common.h"
+#include "thread-pool.h"
+
+/* Default queue depth, and the most we'll ask the kernel for. */
+#define DEFAULT_DEPTH   64
+#define MAX_DEPTH       4096
+
+/* How many operation structures to allocate at a time for the free list. */
+#define OP_BLOCK        64
+
+struct op_block {
+    struct op_block *next;
+    struct pso_io_op ops[OP_BLOCK];
+};
+
+struct pso_io_queue {
+    unsigned int depth;
+    int threads;
+
+    /* Operations that have been pushed, but not handed off yet. */
+    struct pso_io_op *pend;
+    struct pso_io_op *pend_tail;
+    size_t pend_count;
+
+    /* Operations that are done, but haven't been reaped. */
+    struct pso_io_op *done;
+    struct pso_io_op *done_tail;
+
+    struct pso_io_op *free_ops;
+    size_t free_count;
+    struct op_block *blocks;
+
+    /* Used to hand the pending operations to the worker pool. */
+    struct pso_io_op **run;
+    size_t run_allocd;
+
+    /* Set if pso_io_queue_run() couldn't be sure the kernel was done with the
+       operations it was given, in which case the queue can't be used again. */
+    int failed;
+
+#ifdef USE_URING
+    int ring_fd;
+    unsigned int inflight;
+    unsigned int unsubmitted;
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+static void push_pend(pso_io_queue_t *q, struct pso_io_op *op) {
+    op->next = NULL;
+
+    if(q->pend_tail)
+        q->pend_tail->next = op;
+    else
+        q->pend = op;
+
+    q->pend_tail = op;
+    ++q->pend_count;
+}
+
+static struct pso_io_op *pop_pend(pso_io_queue_t *q) {
+    struct pso_io_op *op = q->pend;
+
+    if(op) {
+        q->pend = op->next;
+        if(!q->pend)
+            q->pend_tail = NULL;
+        --q->pend_count;
+    }
+
+    return op;
+}
+
+static void push_done(pso_io_queue_t *q, struct pso_io_op *op) {
+    op->next = NULL;
+
+    if(q->done_tail)
+        q->done_tail->next = op;
+    else
+        q->done = op;
+
+    q->done_tail = op;
+}
+
+static int queue_async(pso_io_queue_t *q) {
+#ifdef USE_URING
+    return q->ring_fd >= 0;
+#else
+    (void)q;
+    return 0;
+#endif
+}
+
+/******************************************************************************
+    io_uring
+ ******************************************************************************/
+#ifdef USE_URING
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int complete,
+                       unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags,
+                        NULL, 0);
+}
+
+static void uring_close(pso_io_queue_t *q) {
+    if(q->sqes)
+        munmap(q->sqes, q->sqes_len);
+
+    if(q->cq_ring && q->cq_ring != q->sq_ring)
+        munmap(q->cq_ring, q->cq_ring_len);
+
+    if(q->sq_ring)
+        munmap(q->sq_ring, q->sq_ring_len);
+
+    if(q->ring_fd >= 0)
+        close(q->ring_fd);
+
+    q->sqes = NULL;
+    q->sq_ring = q->cq_ring = NULL;
+    q->ring_fd = -1;
+}
+
+static int uring_open(pso_io_queue_t *q) {
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    q->sq_ring = q->cq_ring = NULL;
+    q->sqes = NULL;
+
+    if((q->ring_fd = uring_setup(q->depth, &p)) < 0)
+        return -1;
+
+    q->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    q->cq_ring_len = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+    /* Newer kernels put both rings in the one mapping. */
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(q->cq_ring_len > q->sq_ring_len)
+            q->sq_ring_len = q->cq_ring_len;
+        q->cq_ring_len = q->sq_ring_len;
+    }
+#endif
+
+    q->sq_ring = mmap(NULL, q->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if(q->sq_ring == MAP_FAILED) {
+        q->sq_ring = NULL;
+        goto err;
+    }
+
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        q->cq_ring = q->sq_ring;
+    }
+    else
+#endif
+    {
+        q->cq_ring = mmap(NULL, q->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                          IORING_OFF_CQ_RING);
+        if(q->cq_ring == MAP_FAILED) {
+            q->cq_ring = NULL;
+            goto err;
+        }
+    }
+
+    q->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(NULL, q->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, q->ring_fd, IORING_OFF_SQES);
+    if(q->sqes == MAP_FAILED) {
+        q->sqes = NULL;
+        goto err;
+    }
+
+    sq = (uint8_t *)q->sq_ring;
+    cq = (uint8_t *)q->cq_ring;
+
+    q->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    q->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    q->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    q->sq_entries = p.sq_entries;
+
+    q->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    q->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    q->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    q->inflight = q->unsubmitted = 0;
+    return 0;
+
+err:
+    uring_close(q);
+    return -1;
+}
+
+/* Pull everything off of the completion ring. Anything that came up short
+   (but didn't hit the end of the file) goes back on the pending list to have
+   the rest of it done. */
+static void uring_harvest(pso_io_queue_t *q) {
+    unsigned int head, tail;
+    struct io_uring_cqe *cqe;
+    struct pso_io_op *op;
+    int res;
+
+    head = *q->cq_head;
+    tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail) {
+        cqe = &q->cqes[head & *q->cq_mask];
+        op = (struct pso_io_op *)(uintptr_t)cqe->user_data;
+        res = cqe->res;
+        ++head;
+        --q->inflight;
+
+        if(res < 0) {
+            op->result = PSOARCHIVE_EIO;
+        }
+        else if(res > 0) {
+            op->result += res;
+
+            if((size_t)op->result < op->len) {
+                op->iov.iov_base = (uint8_t *)op->buf + op->result;
+                op->iov.iov_len = op->len - (size_t)op->result;
+                push_pend(q, op);
+                continue;
+            }
+        }
+
+        push_done(q, op);
+    }
+
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Hand off anything that hasn't been submitted yet and wait for at least one
+   operation to finish. */
+static int uring_wait(pso_io_queue_t *q) {
+    int rv;
+
+    for(;;) {
+        rv = uring_enter(q->ring_fd, q->unsubmitted, 1,
+                         IORING_ENTER_GETEVENTS);
+
+        if(rv >= 0)
+            break;
+        else if(errno != EINTR && errno != EAGAIN)
+            return -1;
+    }
+
+    q->unsubmitted -= (unsigned int)rv;
+    uring_harvest(q);
+    return 0;
+}
+
+static pso_error_t uring_submit(pso_io_queue_t *q) {
+    struct io_uring_sqe *sqe;
+    struct pso_io_op *op;
+    unsigned int tail, idx;
+    int rv;
+
+    for(;;) {
+        tail = *q->sq_tail;
+
+        while(q->pend && q->inflight < q->sq_entries) {
+            op = pop_pend(q);
+            idx = tail & *q->sq_mask;
+            sqe = &q->sqes[idx];
+
+            memset(sqe, 0, sizeof(struct io_uring_sqe));
+            sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = op->fd;
+            sqe->off = (uint64_t)(op->off + op->result);
+            sqe->addr = (uint64_t)(uintptr_t)&op->iov;
+            sqe->len = 1;
+            sqe->user_data = (uint64_t)(uintptr_t)op;
+
+            q->sq_array[idx] = idx;
+            ++tail;
+            ++q->inflight;
+            ++q->unsubmitted;
+        }
+
+        __atomic_store_n(q->sq_tail, tail, __ATOMIC_RELEASE);
+
+        if(q->unsubmitted) {
+            rv = uring_enter(q->ring_fd, q->unsubmitted, 0, 0);
+
+            if(rv >= 0)
+                q->unsubmitted -= (unsigned int)rv;
+            else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                return PSOARCHIVE_EIO;
+        }
+
+        if(!q->pend)
+            return PSOARCHIVE_OK;
+
+        /* The ring is full, so wait for some room to open up. */
+        if(uring_wait(q))
+            return PSOARCHIVE_EIO;
+    }
+}
+
+#endif /* USE_URING */
+
+/******************************************************************************
+    Worker pool fallback
+ ******************************************************************************/
+
+static void run_op(void *udata, size_t item, int worker) {
+    pso_io_queue_t *q = (pso_io_queue_t *)udata;
+    struct pso_io_op *op = q->run[item];
+
+    (void)worker;
+
+    if(op->write) {
+        if(pso_io_pwrite(op->fd, op->buf, op->len, op->off) == PSOARCHIVE_OK)
+            op->result = (ssize_t)op->len;
+        else
+            op->result = PSOARCHIVE_EIO;
+    }
+    else {
+        op->result = pso_io_pread(op->fd, op->buf, op->len, op->off);
+    }
+}
+
+static pso_error_t pool_submit(pso_io_queue_t *q) {
+    struct pso_io_op **tmp;
+    size_t i, count = q->pend_count;
+    pso_error_t rv;
+
+    if(!count)
+        return PSOARCHIVE_OK;
+
+    if(count > q->run_allocd) {
+        if(!(tmp = (struct pso_io_op **)realloc(q->run, count *
+                                                sizeof(struct pso_io_op *))))
+            return PSOARCHIVE_EMEM;
+
+        q->run = tmp;
+        q->run_allocd = count;
+    }
+
+    for(i = 0; i < count; ++i) {
+        q->run[i] = pop_pend(q);
+    }
+
+    rv = pso_pool_run(pso_pool_workers(q->threads, count), count, &run_op, q);
+
+    for(i = 0; i < count; ++i) {
+        push_done(q, q->run[i]);
+    }
+
+    return rv;
+}
+
+/******************************************************************************
+    Queue functions
+ ******************************************************************************/
+
+pso_io_queue_t *pso_io_queue_create(unsigned int depth, int threads,
+                                    pso_error_t *err) {
+    pso_io_queue_t *rv;
+
+    if(!(rv = (pso_io_queue_t *)malloc(sizeof(pso_io_queue_t)))) {
+        if(err)
+            *err = PSOARCHIVE_EMEM;
+
+        return NULL;
+    }
+
+    memset(rv, 0, sizeof(pso_io_queue_t));
+
+    if(!depth)
+        depth = DEFAULT_DEPTH;
+    else if(depth > MAX_DEPTH)
+        depth = MAX_DEPTH;
+
+    rv->depth = depth;
+
+#ifdef HAVE_PREAD
+    rv->threads = threads;
+#else
+    /* Without pread(), the reads all have to share the file position. */
+    (void)threads;
+    rv->threads = 1;
+#endif
+
+#ifdef USE_URING
+    if(uring_open(rv))
+        rv->ring_fd = -1;
+#endif
+
+    if(err)
+        *err = PSOARCHIVE_OK;
+
+    return rv;
+}
+
+pso_io_queue_t *pso_io_queue_new(unsigned int depth, pso_error_t *err) {
+    return pso_io_queue_create(depth, 0, err);
+}
+
+pso_error_t pso_io_queue_free(pso_io_queue_t *q) {
+    struct op_block *i, *tmp;
+
+    if(!q)
+        return PSOARCHIVE_EFATAL;
+
+#ifdef USE_URING
+    if(queue_async(q)) {
+        /* Don't yank the buffers out from under the kernel. */
+        while(q->inflight) {
+            if(uring_wait(q))
+                break;
+        }
+
+        uring_close(q);
+    }
+#endif
+
+    i = q->blocks;
+    while(i) {
+        tmp = i->next;
+        free(i);
+        i = tmp;
+    }
+
+    free(q->run);
+    free(q);
+
+    return PSOARCHIVE_OK;
+}
+
+int pso_io_queue_async(pso_io_queue_t *q) {
+    return q ? queue_async(q) : 0;
+}
+
+pso_error_t pso_io_queue_push(pso_io_queue_t *q, struct pso_io_op *op) {
+    op->result = 0;
+    op->iov.iov_base = op->buf;
+    op->iov.iov_len = op->len;
+
+    push_pend(q, op);
+
+    if(q->pend_count >= q->depth)
+        return pso_io_queue_submit(q);
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_io_queue_submit(pso_io_queue_t *q) {
+#ifdef USE_URING
+    if(queue_async(q))
+        return uring_submit(q);
+#endif
+
+    return pool_submit(q);
+}
+
+size_t pso_io_queue_reap_ops(pso_io_queue_t *q, struct pso_io_op **ops,
+                             size_t max, int wait) {
+    size_t rv = 0;
+
+    if(q->pend)
+        pso_io_queue_submit(q);
+
+#ifdef USE_URING
+    if(queue_async(q)) {
+        uring_harvest(q);
+
+        while(!q->done && wait && (q->inflight || q->pend)) {
+            if(q->pend) {
+                if(uring_submit(q) != PSOARCHIVE_OK)
+                    break;
+            }
+            else if(uring_wait(q)) {
+                break;
+            }
+        }
+    }
+#else
+    (void)wait;
+#endif
+
+    while(q->done && rv < max) {
+        ops[rv++] = q->done;
+        q->done = q->done->next;
+    }
+
+    if(!q->done)
+        q->done_tail = NULL;
+
+    return rv;
+}
+
+static int grow_ops(pso_io_queue_t *q) {
+    struct op_block *b;
+    int i;
+
+    if(!(b = (struct op_block *)malloc(sizeof(struct op_block))))
+        return -1;
+
+    b->next = q->blocks;
+    q->blocks = b;
+
+    for(i = 0; i < OP_BLOCK; ++i) {
+        b->ops[i].next = q->free_ops;
+        q->free_ops = &b->ops[i];
+    }
+
+    q->free_count += OP_BLOCK;
+    return 0;
+}
+
+pso_error_t pso_io_queue_reserve(pso_io_queue_t *q, size_t count) {
+    while(q->free_count < count) {
+        if(grow_ops(q))
+            return PSOARCHIVE_EMEM;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+struct pso_io_op *pso_io_queue_get_op(pso_io_queue_t *q) {
+    struct pso_io_op *op;
+
+    if(!q->free_ops && grow_ops(q))
+        return NULL;
+
+    op = q->free_ops;
+    --q->free_count;
+    q->free_ops = op->next;
+    memset(op, 0, sizeof(struct pso_io_op));
+
+    return op;
+}
+
+void pso_io_queue_put_op(pso_io_queue_t *q, struct pso_io_op *op) {
+    op->next = q->free_ops;
+    q->free_ops = op;
+    ++q->free_count;
+}
+
+/* Throw away everything on the queue after pso_io_queue_run() hits an error,
+   so that nothing is left pointing at its operations once it returns. Anything
+   the kernel still has hold of has to be waited for, and if that doesn't work,
+   the queue is marked as failed. */
+static void queue_abort(pso_io_queue_t *q) {
+    while(q->pend)
+        pop_pend(q);
+
+#ifdef USE_URING
+    if(queue_async(q)) {
+        while(q->inflight) {
+            if(uring_wait(q)) {
+                /* Make sure nothing left in the ring ever gets submitted. */
+                q->unsubmitted = 0;
+                q->failed = 1;
+                break;
+            }
+
+            /* Don't let anything that came up short start up again. */
+            while(q->pend)
+                pop_pend(q);
+        }
+    }
+#endif
+
+    q->done = q->done_tail = NULL;
+}
+
+pso_error_t pso_io_queue_run(pso_io_queue_t *q, struct pso_io_op *ops,
+                             size_t count) {
+    struct pso_io_op *done[8];
+    size_t i, n, left = count;
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    if(q->failed)
+        return PSOARCHIVE_EIO;
+
+    for(i = 0; i < count; ++i) {
+        if(pso_io_queue_push(q, &ops[i]) != PSOARCHIVE_OK)
+            goto err;
+    }
+
+    if(pso_io_queue_submit(q) != PSOARCHIVE_OK)
+        goto err;
+
+    while(left) {
+        if(!(n = pso_io_queue_reap_ops(q, done, left > 8 ? 8 : left, 1)))
+            goto err;
+
+        for(i = 0; i < n; ++i) {
+            if(done[i]->result != (ssize_t)done[i]->len)
+                rv = PSOARCHIVE_EIO;
+        }
+
+        left -= n;
+    }
+
+    return rv;
+
+err:
+    queue_abort(q);
+    return PSOARCHIVE_EIO;
+}
+
+pso_error_t pso_io_queue_read(pso_io_queue_t *q, int fd, pso_read_req_t *req,
+                              off_t off) {
+    struct pso_io_op *op;
+
+    if(!(op = pso_io_queue_get_op(q)))
+        return PSOARCHIVE_EMEM;
+
+    op->fd = fd;
+    op->buf = req->buf;
+    op->len = req->len;
+    op->off = off;
+    op->tag = req;
+    req->result = -1;
+
+    return pso_io_queue_push(q, op);
+}
+
+pso_error_t pso_io_queue_read_files(pso_io_queue_t *q, int fd,
+                                    pso_read_req_t *reqs, size_t count,
+                                    pso_io_file_info_t info, void *archive) {
+    size_t i;
+    off_t off;
+    uint32_t size;
+    pso_error_t rv;
+
+    if(!q || (!reqs && count))
+        return PSOARCHIVE_EFATAL;
+
+    for(i = 0; i < count; ++i) {
+        if(info(archive, reqs[i].hnd, &off, &size) || !reqs[i].buf ||
+           !reqs[i].len)
+            return PSOARCHIVE_EFATAL;
+    }
+
+    if((rv = pso_io_queue_reserve(q, count)) != PSOARCHIVE_OK)
+        return rv;
+
+    for(i = 0; i < count; ++i) {
+        info(archive, reqs[i].hnd, &off, &size);
+
+        if(size < reqs[i].len)
+            reqs[i].len = size;
+
+        if((rv = pso_io_queue_read(q, fd, &reqs[i], off)) != PSOARCHIVE_OK)
+            return rv;
+    }
+
+    return pso_io_queue_submit(q);
+}
+
+pso_error_t pso_io_queue_write_file(pso_io_queue_t **q, int fd,
+                                    const uint8_t *hdr, size_t hdr_len,
+                                    off_t hdr_off, const uint8_t *data,
+                                    uint32_t len, off_t data_off, off_t *end) {
+    struct pso_io_op ops[3];
+    uint8_t pad = 0;
+    off_t pad_end;
+    pso_error_t rv;
+
+    if(!*q && !(*q = pso_io_queue_create(4, 1, &rv)))
+        return rv;
+
+    /* This lands the padding exactly where the writers' pad_file() would. */
+    pad_end = ((data_off + len) & ~(off_t)2047) + 2048;
+
+    memset(ops, 0, sizeof(ops));
+    ops[0].fd = ops[1].fd = ops[2].fd = fd;
+    ops[0].write = ops[1].write = ops[2].write = 1;
+
+    ops[0].buf = (void *)hdr;
+    ops[0].len = hdr_len;
+    ops[0].off = hdr_off;
+
+    ops[1].buf = (void *)data;
+    ops[1].len = len;
+    ops[1].off = data_off;
+
+    ops[2].buf = &pad;
+    ops[2].len = 1;
+    ops[2].off = pad_end - 1;
+
+    if((rv = pso_io_queue_run(*q, ops, 3)) != PSOARCHIVE_OK)
+        return rv;
+
+    *end = pad_end;
+    return PSOARCHIVE_OK;
+}
+
+size_t pso_io_queue_reap(pso_io_queue_t *q, pso_read_req_t **done, size_t max,
+                         int wait) {
+    struct pso_io_op *ops[32];
+    pso_read_req_t *req;
+    size_t rv = 0, n, i;
+
+    if(!q || !done)
+        return 0;
+
+    while(rv < max) {
+        n = max - rv;
+        if(n > 32)
+            n = 32;
+
+        if(!(n = pso_io_queue_reap_ops(q, ops, n, wait && !rv)))
+            break;
+
+        for(i = 0; i < n; ++i) {
+            req = (pso_read_req_t *)ops[i]->tag;
+            req->result = ops[i]->result < 0 ? -1 : ops[i]->result;
+            done[rv++] = req;
+            pso_io_queue_put_op(q, ops[i]);
+        }
+    }
+
+    return rv;
+}
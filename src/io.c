@@ -0,0 +1,373 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    File I/O Helpers
+
+    The functions in here are used internally to get at the contents of files
+    in bulk, rather than a byte (or a handful of bytes) at a time.
+ ******************************************************************************/
+
+/* For copy_file_range(). */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#define USE_MMAP 1
+#endif
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+#include <sys/sendfile.h>
+#define USE_SENDFILE 1
+#endif
+
+#include "io-common.h"
+
+/* How much to read at a time when we can't map the file. */
+#define READ_CHUNK  0x100000
+
+/* How much to copy at a time when the kernel can't do it for us. */
+#define COPY_CHUNK  0x100000
+
+static pso_error_t read_fd(int fd, size_t len, struct pso_io_map *m) {
+    uint8_t *buf;
+    size_t pos = 0, amt;
+    ssize_t bytes;
+
+    if(!(buf = (uint8_t *)malloc(len)))
+        return PSOARCHIVE_EMEM;
+
+    /* Read the file in big chunks, rather than little bits at a time. */
+    while(pos < len) {
+        amt = len - pos > READ_CHUNK ? READ_CHUNK : len - pos;
+
+        if((bytes = read(fd, buf + pos, amt)) <= 0) {
+            free(buf);
+            return PSOARCHIVE_EIO;
+        }
+
+        pos += (size_t)bytes;
+    }
+
+    m->data = buf;
+    m->len = len;
+    m->base = buf;
+    m->mapped = 0;
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_io_mmap(int fd, size_t len, int advice, struct pso_io_map *m) {
+#ifdef USE_MMAP
+    void *addr;
+    struct stat st;
+
+    if(!m)
+        return PSOARCHIVE_EFAULT;
+
+    /* Touching a mapping past the end of the file would crash, so don't map
+       anything unless the file really is as long as we've been told. */
+    if(!len || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+       (off_t)len > st.st_size)
+        return PSOARCHIVE_ENOTSUPP;
+
+    addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if(addr == MAP_FAILED)
+        return PSOARCHIVE_ENOTSUPP;
+
+#ifdef HAVE_MADVISE
+    if(advice == PSO_IO_SEQUENTIAL)
+        madvise(addr, len, MADV_SEQUENTIAL);
+    else if(advice == PSO_IO_RANDOM)
+        madvise(addr, len, MADV_RANDOM);
+#else
+    (void)advice;
+#endif
+
+    m->data = (const uint8_t *)addr;
+    m->len = len;
+    m->base = addr;
+    m->mapped = 1;
+    return PSOARCHIVE_OK;
+#else
+    (void)fd;
+    (void)len;
+    (void)advice;
+    (void)m;
+    return PSOARCHIVE_ENOTSUPP;
+#endif
+}
+
+pso_error_t pso_io_map_fd(int fd, size_t len, struct pso_io_map *m) {
+    if(!m)
+        return PSOARCHIVE_EFAULT;
+
+    /* There's nothing to map for an empty file, and mmap() would complain. */
+    if(!len) {
+        m->data = NULL;
+        m->len = 0;
+        m->base = NULL;
+        m->mapped = 0;
+        return PSOARCHIVE_OK;
+    }
+
+    /* All the users of this read the file front to back. If the mapping fails
+       (say, because fd is a pipe), fall back to reading the file in. */
+    if(pso_io_mmap(fd, len, PSO_IO_SEQUENTIAL, m) == PSOARCHIVE_OK)
+        return PSOARCHIVE_OK;
+
+    return read_fd(fd, len, m);
+}
+
+pso_error_t pso_io_map_file(const char *fn, struct pso_io_map *m) {
+    int fd;
+    struct stat st;
+    pso_error_t rv;
+
+    if(!fn || !m)
+        return PSOARCHIVE_EFAULT;
+
+    if((fd = open(fn, O_RDONLY)) < 0)
+        return PSOARCHIVE_EFILE;
+
+    /* Figure out the length of the file. */
+    if(fstat(fd, &st)) {
+        close(fd);
+        return PSOARCHIVE_EIO;
+    }
+
+    rv = pso_io_map_fd(fd, (size_t)st.st_size, m);
+
+    /* The mapping (if there is one) stays valid after the file is closed. */
+    close(fd);
+    return rv;
+}
+
+void pso_io_unmap(struct pso_io_map *m) {
+    if(!m || !m->base)
+        return;
+
+#ifdef USE_MMAP
+    if(m->mapped)
+        munmap(m->base, m->len);
+    else
+#endif
+        free(m->base);
+
+    m->data = NULL;
+    m->base = NULL;
+    m->len = 0;
+}
+
+ssize_t pso_io_read(int fd, void *buf, size_t len) {
+    uint8_t *ptr = (uint8_t *)buf;
+    size_t pos = 0;
+    ssize_t bytes;
+
+    /* Keep reading until we have all of it, or we hit the end of the file. */
+    while(pos < len) {
+        if((bytes = read(fd, ptr + pos, len - pos)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return PSOARCHIVE_EIO;
+        }
+        else if(!bytes) {
+            break;
+        }
+
+        pos += (size_t)bytes;
+    }
+
+    return (ssize_t)pos;
+}
+
+ssize_t pso_io_pread(int fd, void *buf, size_t len, off_t off) {
+#ifdef HAVE_PREAD
+    uint8_t *ptr = (uint8_t *)buf;
+    size_t pos = 0;
+    ssize_t bytes;
+
+    while(pos < len) {
+        if((bytes = pread(fd, ptr + pos, len - pos, off + (off_t)pos)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return PSOARCHIVE_EIO;
+        }
+        else if(!bytes) {
+            break;
+        }
+
+        pos += (size_t)bytes;
+    }
+
+    return (ssize_t)pos;
+#else
+    if(lseek(fd, off, SEEK_SET) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    return pso_io_read(fd, buf, len);
+#endif
+}
+
+pso_error_t pso_io_write(int fd, const void *buf, size_t len) {
+    const uint8_t *ptr = (const uint8_t *)buf;
+    ssize_t bytes;
+
+    while(len) {
+        if((bytes = write(fd, ptr, len)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return PSOARCHIVE_EIO;
+        }
+
+        ptr += bytes;
+        len -= (size_t)bytes;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+pso_error_t pso_io_pwrite(int fd, const void *buf, size_t len, off_t off) {
+#ifdef HAVE_PWRITE
+    const uint8_t *ptr = (const uint8_t *)buf;
+    ssize_t bytes;
+
+    while(len) {
+        if((bytes = pwrite(fd, ptr, len, off)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            return PSOARCHIVE_EIO;
+        }
+
+        ptr += bytes;
+        off += (off_t)bytes;
+        len -= (size_t)bytes;
+    }
+
+    return PSOARCHIVE_OK;
+#else
+    if(lseek(fd, off, SEEK_SET) == (off_t)-1)
+        return PSOARCHIVE_EIO;
+
+    return pso_io_write(fd, buf, len);
+#endif
+}
+
+pso_error_t pso_io_copy(int out_fd, int in_fd, size_t len) {
+    ssize_t bytes;
+    uint8_t *buf;
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    /* Both of these use (and update) the current position in each file. Try
+       copy_file_range() first, since it lets filesystems that support it share
+       the data between the files rather than copying it at all. It only works
+       between regular files (on the same filesystem on older kernels), so if
+       it fails, move on to sendfile(), which works as long as in_fd can be
+       mapped, and then finally to doing it ourselves. */
+#ifdef HAVE_COPY_FILE_RANGE
+    while(len) {
+        if((bytes = copy_file_range(in_fd, NULL, out_fd, NULL, len, 0)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            break;
+        }
+        else if(!bytes) {
+            return PSOARCHIVE_EIO;
+        }
+
+        len -= (size_t)bytes;
+    }
+#endif
+
+#ifdef USE_SENDFILE
+    while(len) {
+        if((bytes = sendfile(out_fd, in_fd, NULL, len)) < 0) {
+            if(errno == EINTR)
+                continue;
+
+            break;
+        }
+        else if(!bytes) {
+            return PSOARCHIVE_EIO;
+        }
+
+        len -= (size_t)bytes;
+    }
+#endif
+
+    if(!len)
+        return PSOARCHIVE_OK;
+
+    if(!(buf = (uint8_t *)malloc(len > COPY_CHUNK ? COPY_CHUNK : len)))
+        return PSOARCHIVE_EMEM;
+
+    while(len) {
+        bytes = pso_io_read(in_fd, buf, len > COPY_CHUNK ? COPY_CHUNK : len);
+
+        if(bytes <= 0) {
+            rv = PSOARCHIVE_EIO;
+            break;
+        }
+
+        if((rv = pso_io_write(out_fd, buf, (size_t)bytes)) != PSOARCHIVE_OK)
+            break;
+
+        len -= (size_t)bytes;
+    }
+
+    free(buf);
+    return rv;
+}
+
+void pso_io_advise(int fd, int advice) {
+    /* For sequential access, this lets the kernel know to read ahead of us, so
+       that the reads overlap with whatever we're doing with the data. This is
+       only a hint, so it doesn't matter if it fails. */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+    if(advice == PSO_IO_SEQUENTIAL)
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_RANDOM)
+    if(advice == PSO_IO_RANDOM)
+        (void)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+
+    (void)fd;
+    (void)advice;
+}
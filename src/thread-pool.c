@@ -0,0 +1,172 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Worker Pool
+
+    This is a very simple pool of worker threads for the batch functions in the
+    library. All of the work that gets handed to it is a set of independent
+    items, so rather than giving each worker a fixed slice of the items, each
+    worker just grabs the next unclaimed item whenever it finishes one. That
+    keeps all of the workers busy until the very end, even when some items take
+    far longer than others.
+
+    The calling thread acts as worker 0. If threads aren't available (or can't
+    be created), the calling thread will simply do all of the work itself.
+ ******************************************************************************/
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "thread-pool.h"
+
+/* Cap the number of workers we'll spin up, regardless of what's asked for. */
+#define MAX_WORKERS     64
+
+struct pool_run {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+
+    size_t next;
+    size_t items;
+
+    pso_pool_func_t func;
+    void *udata;
+};
+
+struct pool_worker {
+    struct pool_run *run;
+    int num;
+};
+
+int pso_pool_workers(int threads, size_t items) {
+#ifdef HAVE_PTHREAD_H
+    long cpus;
+
+    /* If the caller didn't ask for a specific number, use one worker per CPU
+       that we have available. */
+    if(threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+#else
+        threads = 1;
+#endif
+    }
+
+    if(threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+
+    /* There's no point in having more workers than items to work on. */
+    if((size_t)threads > items)
+        threads = items ? (int)items : 1;
+
+    return threads;
+#else
+    (void)threads;
+    (void)items;
+    return 1;
+#endif
+}
+
+static void *pool_thd(void *d) {
+    struct pool_worker *w = (struct pool_worker *)d;
+    struct pool_run *r = w->run;
+    size_t item;
+
+    for(;;) {
+        /* Claim the next item that nobody else has started on yet. */
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_lock(&r->lock);
+#endif
+        item = r->next;
+
+        if(item < r->items)
+            ++r->next;
+#ifdef HAVE_PTHREAD_H
+        pthread_mutex_unlock(&r->lock);
+#endif
+
+        if(item >= r->items)
+            break;
+
+        r->func(r->udata, item, w->num);
+    }
+
+    return NULL;
+}
+
+pso_error_t pso_pool_run(int workers, size_t items, pso_pool_func_t func,
+                         void *udata) {
+    struct pool_run r;
+    struct pool_worker w[MAX_WORKERS];
+#ifdef HAVE_PTHREAD_H
+    pthread_t thds[MAX_WORKERS];
+    int i, started = 1;
+#endif
+
+    if(!func)
+        return PSOARCHIVE_EFAULT;
+
+    if(workers < 1 || workers > MAX_WORKERS)
+        return PSOARCHIVE_EINVAL;
+
+    r.next = 0;
+    r.items = items;
+    r.func = func;
+    r.udata = udata;
+
+#ifdef HAVE_PTHREAD_H
+    if(pthread_mutex_init(&r.lock, NULL))
+        return PSOARCHIVE_EFATAL;
+
+    /* Start up the other workers. If we can't start one, the rest of the
+       workers will just pick up the slack. */
+    for(i = 1; i < workers; ++i) {
+        w[started].run = &r;
+        w[started].num = started;
+
+        if(!pthread_create(&thds[started], NULL, &pool_thd, &w[started]))
+            ++started;
+    }
+#endif
+
+    /* The calling thread is always worker 0. */
+    w[0].run = &r;
+    w[0].num = 0;
+    pool_thd(&w[0]);
+
+#ifdef HAVE_PTHREAD_H
+    for(i = 1; i < started; ++i) {
+        pthread_join(thds[i], NULL);
+    }
+
+    pthread_mutex_destroy(&r.lock);
+#endif
+
+    return PSOARCHIVE_OK;
+}
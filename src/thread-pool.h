@@ -0,0 +1,32 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+
+#include "psoarchive-error.h"
+
+/* Called once for each item, from whichever worker picks it up. The worker
+   number is in the range [0, workers) and is stable for the thread, so it can
+   be used to index per-worker scratch space. */
+typedef void (*pso_pool_func_t)(void *udata, size_t item, int worker);
+
+/* These functions are all for internal use only. */
+int pso_pool_workers(int threads, size_t items);
+pso_error_t pso_pool_run(int workers, size_t items, pso_pool_func_t func,
+                         void *udata);
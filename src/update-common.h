@@ -0,0 +1,88 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "psoarchive-error.h"
+#include "psoarchive-queue.h"
+
+/* Where a file is in an archive that is being updated. */
+struct pso_update_ent {
+    uint32_t offset;
+    uint32_t size;
+};
+
+/* Put a file's offset and size into the 8 bytes at buf, the way the archive
+   stores them in its table of contents. */
+typedef void (*pso_update_encode_t)(uint8_t *buf, uint32_t offset,
+                                    uint32_t size, uint32_t flags);
+
+/* The table of contents of an archive that is being updated in place, along
+   with how the archive lays it out. The writer fills in the format parts and
+   the entries, then calls pso_update_loaded() before using any of the rest. */
+struct pso_update {
+    struct pso_update_ent *toc;
+    int allocd;
+
+    /* Where the first file's data starts. The table can grow up to here. */
+    off_t data_start;
+
+    /* The lowest offset of any empty file, or UINT32_MAX if there aren't any
+       empty files. */
+    uint32_t low_empty;
+
+    /* Where the offset and size of the first entry are in the archive, and
+       how far apart the entries are. */
+    off_t ent_pos;
+    off_t ent_len;
+
+    uint32_t flags;
+    pso_update_encode_t encode;
+};
+
+/* These functions are all for internal use only. In all of them, used is the
+   number of entries in the table, and data_pos is where the next file's data
+   will go (the end of the archive). */
+
+/* Allocate space in the table for at least count entries. */
+pso_error_t pso_update_alloc(struct pso_update *u, uint32_t count);
+void pso_update_free(struct pso_update *u);
+
+/* Work out where the file data starts, once the entries have been filled in. */
+void pso_update_loaded(struct pso_update *u, int used, off_t data_pos);
+
+/* Make sure the table can grow up to toc_end (just past the new entry and
+   whatever the format needs after the last one), moving any files that are
+   in the way to the end of the archive, and that there's space in the array
+   for one more entry. */
+pso_error_t pso_update_room(struct pso_update *u, int fd, int used,
+                            off_t toc_end, off_t *data_pos);
+
+/* Remember where the file about to be added as entry used is going. */
+void pso_update_add(struct pso_update *u, int used, off_t data_pos,
+                    uint32_t len);
+
+/* Replace the data of file hnd, overwriting the old data if the new data fits
+   where it was, otherwise putting it at the end of the archive. The writes are
+   done on the queue at *q, which is created the first time it's needed. */
+pso_error_t pso_update_replace(struct pso_update *u, pso_io_queue_t **q,
+                               int fd, int used, off_t *data_pos,
+                               uint32_t hnd, const uint8_t *data,
+                               uint32_t len);
@@ -0,0 +1,266 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    Updating Archives In Place
+
+    The AFS and GSL writers can both open an existing archive and add files to
+    it or replace files in it. The two formats differ only in how their tables
+    of contents are laid out, so the work of keeping track of where everything
+    is, and of making room for the table to grow, is all done here.
+
+    The table grows into the space before the first file's data. When it runs
+    out of room, the first file is moved to the end of the archive. Empty files
+    don't take up any space, so they can point anywhere, but some readers work
+    out how big the table is from where the first file starts. Any empty file
+    that would end up pointing inside the table is pointed at the start of the
+    data instead.
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "io-common.h"
+#include "update-common.h"
+
+/* How much data is copied at a time when moving a file within an archive. */
+#define COPY_CHUNK      0x100000
+
+#define PAD_END(x)      ((((off_t)(x)) & ~(off_t)2047) + 2048)
+
+pso_error_t pso_update_alloc(struct pso_update *u, uint32_t count) {
+    u->allocd = count ? (int)count * 2 : 16;
+    u->toc = (struct pso_update_ent *)malloc(u->allocd *
+                                             sizeof(struct pso_update_ent));
+
+    return u->toc ? PSOARCHIVE_OK : PSOARCHIVE_EMEM;
+}
+
+void pso_update_free(struct pso_update *u) {
+    free(u->toc);
+    u->toc = NULL;
+}
+
+/* Where the first file's data starts. Empty files don't count, since there's
+   nothing there to overwrite. */
+static off_t first_data(struct pso_update *u, int used, off_t data_pos) {
+    off_t rv = data_pos;
+    int i;
+
+    for(i = 0; i < used; ++i) {
+        if(u->toc[i].size && u->toc[i].offset < rv)
+            rv = u->toc[i].offset;
+    }
+
+    return rv;
+}
+
+void pso_update_loaded(struct pso_update *u, int used, off_t data_pos) {
+    int i;
+
+    u->data_start = first_data(u, used, data_pos);
+    u->low_empty = UINT32_MAX;
+
+    for(i = 0; i < used; ++i) {
+        if(!u->toc[i].size && u->toc[i].offset < u->low_empty)
+            u->low_empty = u->toc[i].offset;
+    }
+}
+
+static pso_error_t write_toc(struct pso_update *u, int fd, int hnd) {
+    uint8_t buf[8];
+
+    u->encode(buf, u->toc[hnd].offset, u->toc[hnd].size, u->flags);
+    return pso_io_pwrite(fd, buf, 8, u->ent_pos + u->ent_len * hnd);
+}
+
+/* Copy a file's data to the end of the archive and point its entry in the
+   table of contents at the new copy. */
+static pso_error_t move_data(struct pso_update *u, int fd, int hnd,
+                             off_t *data_pos) {
+    uint8_t *buf, pad = 0;
+    uint32_t done = 0, size = u->toc[hnd].size;
+    off_t from = u->toc[hnd].offset, to = *data_pos, end;
+    size_t amt;
+    pso_error_t rv = PSOARCHIVE_OK;
+
+    if(!(buf = (uint8_t *)malloc(size < COPY_CHUNK ? size : COPY_CHUNK)))
+        return PSOARCHIVE_EMEM;
+
+    while(done < size && rv == PSOARCHIVE_OK) {
+        amt = size - done < COPY_CHUNK ? size - done : COPY_CHUNK;
+
+        if(pso_io_pread(fd, buf, amt, from + done) != (ssize_t)amt)
+            rv = PSOARCHIVE_EIO;
+        else
+            rv = pso_io_pwrite(fd, buf, amt, to + done);
+
+        done += (uint32_t)amt;
+    }
+
+    free(buf);
+
+    if(rv != PSOARCHIVE_OK)
+        return rv;
+
+    end = PAD_END(to + size);
+
+    if((rv = pso_io_pwrite(fd, &pad, 1, end - 1)) != PSOARCHIVE_OK)
+        return rv;
+
+    u->toc[hnd].offset = (uint32_t)to;
+    *data_pos = end;
+
+    return write_toc(u, fd, hnd);
+}
+
+pso_error_t pso_update_room(struct pso_update *u, int fd, int used,
+                            off_t toc_end, off_t *data_pos) {
+    void *tmp;
+    int i, allocd;
+    pso_error_t rv;
+
+    while(toc_end > u->data_start) {
+        for(i = 0; i < used; ++i) {
+            if(u->toc[i].size && u->toc[i].offset == u->data_start) {
+                if((rv = move_data(u, fd, i, data_pos)) != PSOARCHIVE_OK)
+                    return rv;
+            }
+        }
+
+        u->data_start = first_data(u, used, *data_pos);
+    }
+
+    /* Don't leave any empty files pointing inside the table. */
+    if((off_t)u->low_empty < toc_end) {
+        u->low_empty = UINT32_MAX;
+
+        for(i = 0; i < used; ++i) {
+            if(u->toc[i].size)
+                continue;
+
+            if((off_t)u->toc[i].offset < toc_end) {
+                u->toc[i].offset = (uint32_t)u->data_start;
+
+                if((rv = write_toc(u, fd, i)) != PSOARCHIVE_OK)
+                    return rv;
+            }
+
+            if(u->toc[i].offset < u->low_empty)
+                u->low_empty = u->toc[i].offset;
+        }
+    }
+
+    /* Make sure we have space in the array... */
+    if(used == u->allocd) {
+        allocd = u->allocd * 2;
+
+        if(!(tmp = realloc(u->toc, allocd * sizeof(struct pso_update_ent))))
+            return PSOARCHIVE_EMEM;
+
+        u->toc = (struct pso_update_ent *)tmp;
+        u->allocd = allocd;
+    }
+
+    return PSOARCHIVE_OK;
+}
+
+void pso_update_add(struct pso_update *u, int used, off_t data_pos,
+                    uint32_t len) {
+    u->toc[used].offset = (uint32_t)data_pos;
+    u->toc[used].size = len;
+
+    if(!len && (uint32_t)data_pos < u->low_empty)
+        u->low_empty = (uint32_t)data_pos;
+}
+
+/* How much data can be written where the file is now, without running into
+   the next file. */
+static off_t slot_size(struct pso_update *u, int used, off_t data_pos,
+                       int hnd) {
+    off_t start = u->toc[hnd].offset, rv = data_pos - start;
+    int i;
+
+    if(start < u->data_start)
+        return 0;
+
+    for(i = 0; i < used; ++i) {
+        if(i != hnd && u->toc[i].size && u->toc[i].offset >= start &&
+           u->toc[i].offset - start < rv)
+            rv = u->toc[i].offset - start;
+    }
+
+    return rv;
+}
+
+pso_error_t pso_update_replace(struct pso_update *u, pso_io_queue_t **q,
+                               int fd, int used, off_t *data_pos,
+                               uint32_t hnd, const uint8_t *data,
+                               uint32_t len) {
+    struct pso_io_op ops[3];
+    uint8_t buf[8], pad = 0;
+    off_t pos, end = 0;
+    int count = 2;
+    pso_error_t rv;
+
+    if(!*q && !(*q = pso_io_queue_create(4, 1, &rv)))
+        return rv;
+
+    /* Overwrite the old data if the new data fits where it was, otherwise put
+       it at the end of the archive. The old space is simply left unused. */
+    pos = u->toc[hnd].offset;
+
+    if((off_t)len > slot_size(u, used, *data_pos, (int)hnd)) {
+        pos = *data_pos;
+        end = PAD_END(pos + len);
+        count = 3;
+    }
+
+    u->encode(buf, (uint32_t)pos, len, u->flags);
+
+    memset(ops, 0, sizeof(ops));
+    ops[0].fd = ops[1].fd = ops[2].fd = fd;
+    ops[0].write = ops[1].write = ops[2].write = 1;
+
+    ops[0].buf = (void *)data;
+    ops[0].len = len;
+    ops[0].off = pos;
+
+    ops[1].buf = buf;
+    ops[1].len = 8;
+    ops[1].off = u->ent_pos + u->ent_len * hnd;
+
+    ops[2].buf = &pad;
+    ops[2].len = 1;
+    ops[2].off = end - 1;
+
+    if((rv = pso_io_queue_run(*q, ops, count)) != PSOARCHIVE_OK)
+        return rv;
+
+    u->toc[hnd].offset = (uint32_t)pos;
+    u->toc[hnd].size = len;
+
+    if(!len && (uint32_t)pos < u->low_empty)
+        u->low_empty = (uint32_t)pos;
+
+    if(end)
+        *data_pos = end;
+
+    return PSOARCHIVE_OK;
+}
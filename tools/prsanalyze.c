@@ -0,0 +1,187 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    prsanalyze - Show what the contents of PRS files are made up of.
+
+    Usage:
+        prsanalyze [-r] file.prs ...
+            Print statistics about the tokens in each of the files given. With
+            -r, each file is also decompressed and recompressed (with both the
+            compressor and the archiver in the library), and statistics are
+            printed for the recompressed data too, so the original can be
+            compared against what this library would produce for the same data.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PRS.h"
+#include "tools-common.h"
+
+static const char *kind_names[PSO_PRS_COPY_KINDS] = {
+    "short", "long", "extended"
+};
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-r] file.prs ...\n", argv0);
+}
+
+static double pct(size_t n, size_t d) {
+    return d ? 100.0 * (double)n / (double)d : 0.0;
+}
+
+static void print_hist(const char *name, const size_t *h) {
+    int i, last = -1;
+
+    for(i = 0; i < PSO_PRS_STATS_BUCKETS; ++i) {
+        if(h[i])
+            last = i;
+    }
+
+    if(last < 0)
+        return;
+
+    printf("      %s:", name);
+
+    for(i = 0; i <= last; ++i) {
+        printf(" %u+:%lu", 1U << i, (unsigned long)h[i]);
+    }
+
+    printf("\n");
+}
+
+static void print_stats(const char *fn, const char *what,
+                        const pso_prs_stats_t *st) {
+    const pso_prs_copy_stats_t *c;
+    int i;
+
+    printf("%s (%s):\n", fn, what);
+    printf("  compressed %lu bytes, decompressed %lu bytes, ratio %.2f%%\n",
+           (unsigned long)st->compressed_size,
+           (unsigned long)st->decompressed_size,
+           pct(st->compressed_size, st->decompressed_size));
+    printf("  literals: %lu bytes (%.2f%% of output)\n",
+           (unsigned long)st->literals,
+           pct(st->literals, st->decompressed_size));
+    printf("  flags: %lu bits in %lu bytes (%.2f%% of input)\n",
+           (unsigned long)st->flag_bits, (unsigned long)st->flag_bytes,
+           pct(st->flag_bytes, st->compressed_size));
+
+    for(i = 0; i < PSO_PRS_COPY_KINDS; ++i) {
+        c = &st->copies[i];
+        printf("  %s copies: %lu, %lu bytes (%.2f%% of output)\n",
+               kind_names[i], (unsigned long)c->count, (unsigned long)c->bytes,
+               pct(c->bytes, st->decompressed_size));
+        print_hist("length", c->length);
+        print_hist("offset", c->offset);
+    }
+}
+
+/* Compress the data with the function given and print the statistics for the
+   result. */
+static int recompress(const char *fn, const char *what, const uint8_t *data,
+                      size_t len,
+                      int (*func)(const uint8_t *, uint8_t **, size_t)) {
+    pso_prs_stats_t st;
+    uint8_t *cmp;
+    int rv;
+
+    if((rv = func(data, &cmp, len)) < 0)
+        return rv;
+
+    rv = pso_prs_analyze(cmp, (size_t)rv, &st);
+    free(cmp);
+
+    if(rv < 0)
+        return rv;
+
+    print_stats(fn, what, &st);
+    return 0;
+}
+
+static int analyze_file(const char *argv0, const char *fn, int recomp) {
+    pso_prs_stats_t st;
+    uint8_t *src, *dec;
+    size_t src_len;
+    int rv;
+
+    if(!(src = read_file(fn, &src_len))) {
+        fprintf(stderr, "%s: Cannot read %s\n", argv0, fn);
+        return 1;
+    }
+
+    if((rv = pso_prs_analyze(src, src_len, &st)) < 0) {
+        fprintf(stderr, "%s: Cannot analyze %s: %s\n", argv0, fn,
+                pso_strerror((pso_error_t)rv));
+        free(src);
+        return 1;
+    }
+
+    print_stats(fn, "original", &st);
+
+    if(!recomp) {
+        free(src);
+        return 0;
+    }
+
+    /* Decompress the original, then see what we'd have done with it. */
+    if((rv = pso_prs_decompress_buf(src, &dec, src_len)) < 0) {
+        fprintf(stderr, "%s: Cannot decompress %s: %s\n", argv0, fn,
+                pso_strerror((pso_error_t)rv));
+        free(src);
+        return 1;
+    }
+
+    free(src);
+
+    if((rv = recompress(fn, "recompressed", dec, st.decompressed_size,
+                        &pso_prs_compress)) < 0 ||
+       (rv = recompress(fn, "archived", dec, st.decompressed_size,
+                        &pso_prs_archive)) < 0) {
+        fprintf(stderr, "%s: Cannot recompress %s: %s\n", argv0, fn,
+                pso_strerror((pso_error_t)rv));
+        free(dec);
+        return 1;
+    }
+
+    free(dec);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int recomp = 0, i = 1, rv = 0;
+
+    if(i < argc && !strcmp(argv[i], "-r")) {
+        recomp = 1;
+        ++i;
+    }
+
+    if(i >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for(; i < argc; ++i) {
+        rv |= analyze_file(argv[0], argv[i], recomp);
+    }
+
+    return rv;
+}
@@ -0,0 +1,157 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/******************************************************************************
+    prsindex - Build seek indexes for PRS files and read ranges using them.
+
+    Usage:
+        prsindex [-i interval] file.prs [file.prsi]
+            Build an index for file.prs, saving it to file.prsi (or to the name
+            of the input file with .prsi appended, if not given).
+
+        prsindex -x offset:length file.prs [file.prsi]
+            Decompress length bytes from offset in file.prs to stdout, using
+            the index previously built for it.
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PRS.h"
+#include "tools-common.h"
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-i interval] file.prs [file.prsi]\n"
+            "       %s -x offset:length file.prs [file.prsi]\n", argv0, argv0);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long interval = 0, offset = 0, length = 0;
+    int extract = 0, i = 1, rv;
+    const char *fn;
+    char *ifn, *end;
+    uint8_t *src, *dst;
+    size_t src_len;
+    pso_prs_index_t *idx;
+    pso_error_t err;
+
+    /* Parse the options. */
+    while(i < argc && argv[i][0] == '-') {
+        if(!strcmp(argv[i], "-i") && i + 1 < argc) {
+            interval = strtoul(argv[i + 1], NULL, 0);
+        }
+        else if(!strcmp(argv[i], "-x") && i + 1 < argc) {
+            offset = strtoul(argv[i + 1], &end, 0);
+
+            if(*end != ':' || !*(end + 1)) {
+                usage(argv[0]);
+                return 1;
+            }
+
+            length = strtoul(end + 1, &end, 0);
+
+            if(*end) {
+                usage(argv[0]);
+                return 1;
+            }
+
+            extract = 1;
+        }
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+
+        i += 2;
+    }
+
+    if(i >= argc || argc - i > 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    fn = argv[i];
+
+    /* Figure out the name of the index file. */
+    if(i + 1 < argc) {
+        ifn = strdup(argv[i + 1]);
+    }
+    else if((ifn = (char *)malloc(strlen(fn) + 6))) {
+        sprintf(ifn, "%s.prsi", fn);
+    }
+
+    if(!ifn) {
+        fprintf(stderr, "%s: Out of memory\n", argv[0]);
+        return 1;
+    }
+
+    if(!(src = read_file(fn, &src_len))) {
+        fprintf(stderr, "%s: Cannot read %s\n", argv[0], fn);
+        free(ifn);
+        return 1;
+    }
+
+    if(!extract) {
+        if(!(idx = pso_prs_index_build(src, src_len, interval, &err)) ||
+           (err = pso_prs_index_save(idx, ifn))) {
+            fprintf(stderr, "%s: Cannot build index for %s: %s\n", argv[0],
+                    fn, pso_strerror(err));
+            rv = 1;
+        }
+        else {
+            printf("%s: %d bytes, index saved to %s\n", fn,
+                   pso_prs_index_size(idx), ifn);
+            rv = 0;
+        }
+    }
+    else {
+        if(!(idx = pso_prs_index_load(ifn, &err))) {
+            fprintf(stderr, "%s: Cannot load index %s: %s\n", argv[0], ifn,
+                    pso_strerror(err));
+            rv = 1;
+        }
+        else if(!(dst = (uint8_t *)malloc(length ? length : 1))) {
+            fprintf(stderr, "%s: Out of memory\n", argv[0]);
+            rv = 1;
+        }
+        else {
+            if((rv = pso_prs_decompress_range(src, src_len, idx, offset, dst,
+                                              length)) < 0) {
+                fprintf(stderr, "%s: Cannot decompress %s: %s\n", argv[0], fn,
+                        pso_strerror((pso_error_t)rv));
+                rv = 1;
+            }
+            else {
+                fwrite(dst, 1, (size_t)rv, stdout);
+                rv = 0;
+            }
+
+            free(dst);
+        }
+    }
+
+    if(idx)
+        pso_prs_index_free(idx);
+
+    free(src);
+    free(ifn);
+
+    return rv;
+}
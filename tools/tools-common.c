@@ -0,0 +1,53 @@
+/*
+    This file is part of libpsoarchive.
+
+    Copyright (C) 2015 Lawrence Sebald
+
+    This library is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as
+    published by the Free Software Foundation, either version 2.1 or
+    version 3 of the License.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tools-common.h"
+
+uint8_t *read_file(const char *fn, size_t *len) {
+    FILE *fp;
+    long l;
+    uint8_t *rv;
+
+    if(!(fp = fopen(fn, "rb")))
+        return NULL;
+
+    if(fseek(fp, 0, SEEK_END) || (l = ftell(fp)) < 0 ||
+       fseek(fp, 0, SEEK_SET)) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if(!(rv = (uint8_t *)malloc(l ? l : 1))) {
+        fclose(fp);
+        return NULL;
+    }
+
+    if(fread(rv, 1, l, fp) != (size_t)l) {
+        free(rv);
+        fclose(fp);
+        return NULL;
+    }
+
+    fclose(fp);
+    *len = (size_t)l;
+    return rv;
+}